@@ -0,0 +1,53 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BENCHUTIL_H
+#define BENCHUTIL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+using namespace std;
+
+namespace bench {
+
+	/**
+	 * Report the p50 / p99 / p999 of the latency samples (nanoseconds) as counters of the benchmark
+	 *
+	 * Counters are averaged over the benchmark threads, so every thread can report its own samples.
+	 * The samples are sorted in place.
+	 */
+	inline void ReportPercentiles(benchmark::State& state, vector<int64_t>& samples, const string& prefix = "") {
+		if (samples.empty()) return;
+		sort(samples.begin(), samples.end());
+		auto at = [&](double p) {
+			size_t index = min(samples.size() - 1, (size_t)(p * (double)samples.size()));
+			return (double)samples[index];
+		};
+		state.counters[prefix + "p50_ns"] = benchmark::Counter(at(0.50), benchmark::Counter::kAvgThreads);
+		state.counters[prefix + "p99_ns"] = benchmark::Counter(at(0.99), benchmark::Counter::kAvgThreads);
+		state.counters[prefix + "p999_ns"] = benchmark::Counter(at(0.999), benchmark::Counter::kAvgThreads);
+	}
+}
+
+#endif
@@ -0,0 +1,117 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+#include "bench/benchutil.hpp"
+#include "shared/util/chan.hpp"
+
+using namespace std;
+
+// Number of values transferred per benchmark iteration
+static constexpr size_t CHAN_BENCH_VALUES = 1 << 16;
+
+static int64_t nowNs() {
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * N producers push timestamps to a chan that is drained by one consumer
+ *
+ * Args: producers, capacity (0 is unbounded, else BLOCK).
+ * The latency percentiles are the time from push() until the consumer got the value.
+ */
+static void BM_ChanPushGet(benchmark::State& state) {
+	size_t producers = state.range(0);
+	size_t capacity = state.range(1);
+	size_t perProducer = CHAN_BENCH_VALUES / producers;
+	size_t total = perProducer * producers;
+	vector<int64_t> latencies;
+	latencies.reserve(total);
+
+	for (auto _ : state) {
+		util::chan<int64_t> ch(capacity);
+		latencies.clear();
+		auto start = chrono::steady_clock::now();
+		vector<thread> threads;
+		for (size_t p = 0; p < producers; p++) {
+			threads.emplace_back([&ch, perProducer]() {
+				for (size_t i = 0; i < perProducer; i++) ch.push(nowNs());
+			});
+		}
+		for (size_t i = 0; i < total; i++) {
+			auto [value, ok] = ch.get();
+			latencies.push_back(nowNs() - value);
+		}
+		for (auto& t : threads) t.join();
+		state.SetIterationTime(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+	}
+	state.SetItemsProcessed(state.iterations() * total);
+	bench::ReportPercentiles(state, latencies);
+}
+BENCHMARK(BM_ChanPushGet)
+	->ArgNames({"producers", "capacity"})
+	->ArgsProduct({{1, 4, 16, 64}, {0, 1024}})
+	->UseManualTime()
+	->Unit(benchmark::kMillisecond);
+
+/**
+ * Same as BM_ChanPushGet, but the consumer fetches up to 256 values per get_batch()
+ */
+static void BM_ChanPushGetBatch(benchmark::State& state) {
+	size_t producers = state.range(0);
+	size_t capacity = state.range(1);
+	size_t perProducer = CHAN_BENCH_VALUES / producers;
+	size_t total = perProducer * producers;
+	vector<int64_t> latencies;
+	latencies.reserve(total);
+	vector<int64_t> batch;
+
+	for (auto _ : state) {
+		util::chan<int64_t> ch(capacity);
+		latencies.clear();
+		auto start = chrono::steady_clock::now();
+		vector<thread> threads;
+		for (size_t p = 0; p < producers; p++) {
+			threads.emplace_back([&ch, perProducer]() {
+				for (size_t i = 0; i < perProducer; i++) ch.push(nowNs());
+			});
+		}
+		for (size_t received = 0; received < total; ) {
+			batch.clear();
+			received += ch.get_batch(batch, 256);
+			int64_t now = nowNs();
+			for (int64_t value : batch) latencies.push_back(now - value);
+		}
+		for (auto& t : threads) t.join();
+		state.SetIterationTime(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+	}
+	state.SetItemsProcessed(state.iterations() * total);
+	bench::ReportPercentiles(state, latencies);
+}
+BENCHMARK(BM_ChanPushGetBatch)
+	->ArgNames({"producers", "capacity"})
+	->ArgsProduct({{1, 4, 16, 64}, {0, 1024}})
+	->UseManualTime()
+	->Unit(benchmark::kMillisecond);
@@ -0,0 +1,132 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+
+#include "bench/benchutil.hpp"
+#include "shared/logger/logger.hpp"
+
+using namespace std;
+
+// Number of lines logged per iteration of the end-to-end benchmark
+static constexpr size_t LOGGER_BENCH_LINES = 1 << 16;
+
+static string logPath(const string& name) {
+	return (filesystem::temp_directory_path() / ("cthulhu_bench_" + name + ".log")).string();
+}
+
+/**
+ * Create the logger of a benchmark run on a empty logfile
+ */
+static unique_ptr<logger::Logger> benchLogger(const string& path, int queue) {
+	filesystem::remove(path);
+	return make_unique<logger::Logger>(logger::INFO, path, false, false, queue);
+}
+
+/**
+ * Wait until `lines` further lines were written to the file, `offset` is advanced past them
+ */
+static void awaitLines(const string& path, off_t& offset, size_t lines) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	char buffer[64 * 1024];
+	while (lines > 0) {
+		ssize_t n = pread(fd, buffer, sizeof(buffer), offset);
+		if (n <= 0) {
+			this_thread::yield();
+			continue;
+		}
+		// Only complete lines are consumed
+		ssize_t consumed = 0;
+		for (char* cur = buffer; lines > 0; ) {
+			cur = static_cast<char*>(memchr(cur, '\n', buffer + n - cur));
+			if (!cur) break;
+			cur++;
+			consumed = cur - buffer;
+			lines--;
+		}
+		offset += consumed;
+	}
+	::close(fd);
+}
+
+/**
+ * Lines/sec from the first LogInfo() until the worker wrote the last line to the logfile
+ *
+ * The last line of every iteration is a error, so the buffered output is flushed right away.
+ * Args: queue size (0 is unbounded).
+ */
+static void BM_LoggerEndToEnd(benchmark::State& state) {
+	string path = logPath("e2e_" + to_string(state.range(0)));
+	auto log = benchLogger(path, state.range(0));
+	off_t offset = filesystem::file_size(path);
+	for (auto _ : state) {
+		auto start = chrono::steady_clock::now();
+		for (size_t i = 0; i < LOGGER_BENCH_LINES - 1; i++) {
+			log->LogInfo("request {} served in {}ms by {}", i, 1.5, "worker");
+		}
+		log->LogError("request {} failed after {}ms by {}", LOGGER_BENCH_LINES, 1.5, "worker");
+		awaitLines(path, offset, LOGGER_BENCH_LINES);
+		state.SetIterationTime(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+	}
+	state.SetItemsProcessed(state.iterations() * LOGGER_BENCH_LINES);
+}
+BENCHMARK(BM_LoggerEndToEnd)
+	->ArgName("queue")
+	->Arg(0)->Arg(1024)->Arg(65536)
+	->UseManualTime()
+	->Unit(benchmark::kMillisecond);
+
+/**
+ * Caller-side latency of LogInfo() with concurrent callers
+ *
+ * Args: queue size (0 is unbounded). Bounded queues block the callers once the worker falls behind.
+ */
+static void BM_LoggerCallerLatency(benchmark::State& state) {
+	// Shared by the threads of the run, the state loop synchronizes the threads at its start and end
+	static unique_ptr<logger::Logger> log;
+	if (state.thread_index() == 0) {
+		log = benchLogger(logPath("latency_" + to_string(state.range(0))), state.range(0));
+	}
+	vector<int64_t> latencies;
+	latencies.reserve(1 << 20);
+	size_t i = 0;
+	for (auto _ : state) {
+		auto start = chrono::steady_clock::now();
+		log->LogInfo("request {} served in {}ms by {}", i++, 1.5, "worker");
+		latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+	}
+	state.SetItemsProcessed(state.iterations());
+	bench::ReportPercentiles(state, latencies);
+	if (state.thread_index() == 0) log.reset();
+}
+BENCHMARK(BM_LoggerCallerLatency)
+	->ArgName("queue")
+	->Arg(0)->Arg(1024)
+	->Threads(1)->Threads(4)->Threads(16);
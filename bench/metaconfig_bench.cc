@@ -0,0 +1,116 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <benchmark/benchmark.h>
+
+#include "shared/metaconfig/metaconfig.hpp"
+
+using namespace std;
+
+/**
+ * Write a generated config with `keys` keys (similar to the configs pushed by juju)
+ *
+ * Every 10th value is a multiline list, every 100th line is a comment.
+ */
+static string writeConfig(size_t keys) {
+	string path = (filesystem::temp_directory_path() / ("cthulhu_bench_" + to_string(keys) + ".conf")).string();
+	ofstream file(path, ofstream::out | ofstream::trunc);
+	for (size_t i = 0; i < keys; i++) {
+		if (i % 100 == 0) file << "# section " << i / 100 << "\n";
+		file << "component.section" << i % 64 << ".key" << i << "=\"";
+		if (i % 10 == 0) file << "node-a.cluster.local,\nnode-b.cluster.local,\nnode-c.cluster.local,";
+		else file << i * 7.5;
+		file << "\"\n";
+	}
+	return path;
+}
+
+static void BM_MetaConfigReadFromDisk(benchmark::State& state) {
+	string path = writeConfig(state.range(0));
+	metaconfig::MetaConfig config(path);
+	for (auto _ : state) {
+		config.ReadFromDisk();
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	state.SetBytesProcessed(state.iterations() * filesystem::file_size(path));
+	filesystem::remove(path);
+}
+BENCHMARK(BM_MetaConfigReadFromDisk)->Arg(10)->Arg(1000)->Arg(100000)->Unit(benchmark::kMicrosecond);
+
+static void BM_MetaConfigWriteToDisk(benchmark::State& state) {
+	string path = writeConfig(state.range(0));
+	metaconfig::MetaConfig config(path, {.Journal = state.range(1) != 0});
+	config.ReadFromDisk();
+	size_t i = 0;
+	for (auto _ : state) {
+		// Every write has one changed key, like a single update of a hook
+		config.SetString("component.section0.key0", to_string(i++));
+		config.WriteToDisk();
+	}
+	state.SetItemsProcessed(state.iterations());
+	filesystem::remove(path);
+	filesystem::remove(path + JOURNAL_FILE_EXTENSION);
+}
+BENCHMARK(BM_MetaConfigWriteToDisk)
+	->ArgNames({"keys", "journal"})
+	->ArgsProduct({{10, 1000, 100000}, {0, 1}})
+	->Unit(benchmark::kMicrosecond);
+
+static unique_ptr<metaconfig::MetaConfig> sharedConfig;
+
+/**
+ * Concurrent GetDouble() / SetDouble() calls
+ *
+ * Args: percentage of reads (every thread interleaves reads and writes in this ratio), keys of the config.
+ */
+static void BM_MetaConfigGetSet(benchmark::State& state) {
+	if (state.thread_index() == 0) {
+		string path = writeConfig(state.range(1));
+		sharedConfig = make_unique<metaconfig::MetaConfig>(path);
+		sharedConfig->ReadFromDisk();
+		filesystem::remove(path);
+	}
+	size_t readPercent = state.range(0);
+	// Threads use distinct keys of the config (key i is in section i % 64), so the mix is not biased by a single hot key
+	size_t index = state.thread_index() * 10 + 1;
+	string key = "component.section" + to_string(index % 64) + ".key" + to_string(index);
+	size_t i = 0;
+	for (auto _ : state) {
+		if (i++ % 100 < readPercent) {
+			benchmark::DoNotOptimize(sharedConfig->GetDouble(key));
+		} else {
+			sharedConfig->SetDouble(key, (double)i);
+		}
+	}
+	state.SetItemsProcessed(state.iterations());
+	if (state.thread_index() == 0) sharedConfig.reset();
+}
+BENCHMARK(BM_MetaConfigGetSet)
+	->ArgNames({"reads", "keys"})
+	->ArgsProduct({{100, 99, 90, 50}, {1000}})
+	->Threads(1)->Threads(4)->Threads(16);
+// Writes on a large config must not copy the whole configuration
+BENCHMARK(BM_MetaConfigGetSet)
+	->ArgNames({"reads", "keys"})
+	->ArgsProduct({{90, 0}, {100000}})
+	->Threads(1)->Threads(4);
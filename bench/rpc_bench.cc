@@ -0,0 +1,130 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <boost/asio/executor_work_guard.hpp>
+
+#include "bench/benchutil.hpp"
+#include "rpc/rpcclient.hpp"
+#include "rpc/rpcserver.hpp"
+
+using namespace std;
+
+// Number of calls per benchmark iteration
+static constexpr size_t RPC_BENCH_CALLS = 1 << 14;
+
+/**
+ * Echo server and a connected client, both on one io_context thread
+ */
+struct rpcbench {
+	net::io_context ioContext;
+	net::executor_work_guard<net::io_context::executor_type> guard = net::make_work_guard(ioContext);
+	string socketPath = filesystem::temp_directory_path() / ("cthulhu_rpc_bench_" + to_string(getpid()) + ".sock");
+	rpc::RpcServer server{ioContext, socketPath, filesystem::perms::owner_all};
+	unique_ptr<rpc::RpcClient> client;
+	thread runner;
+
+	rpcbench() {
+		server.Handle(1, [](rpc::RpcCall& call) { return call.Request().String(); });
+		server.Serve();
+		runner = thread([this]() { ioContext.run(); });
+		client = make_unique<rpc::RpcClient>(ioContext, socketPath);
+	}
+
+	~rpcbench() {
+		client.reset();
+		server.Close();
+		guard.reset();
+		runner.join();
+	}
+};
+
+/**
+ * Sequential calls, every call waits for the previous response
+ *
+ * Args: payload size. The latency percentiles are the round trip of one call.
+ */
+static void BM_RpcInvoke(benchmark::State& state) {
+	rpcbench b;
+	string payload(state.range(0), 'x');
+	vector<int64_t> latencies;
+	latencies.reserve(RPC_BENCH_CALLS);
+
+	for (auto _ : state) {
+		latencies.clear();
+		for (size_t i = 0; i < RPC_BENCH_CALLS; i++) {
+			auto start = chrono::steady_clock::now();
+			benchmark::DoNotOptimize(b.client->Invoke(1, payload));
+			latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * RPC_BENCH_CALLS);
+	bench::ReportPercentiles(state, latencies);
+}
+BENCHMARK(BM_RpcInvoke)
+	->ArgNames({"payload"})
+	->Arg(16)->Arg(4096)
+	->Unit(benchmark::kMillisecond);
+
+/**
+ * Pipelined calls, up to `window` calls are open at once
+ *
+ * Args: window, payload size.
+ */
+static void BM_RpcPipelined(benchmark::State& state) {
+	rpcbench b;
+	size_t window = state.range(0);
+	string payload(state.range(1), 'x');
+	mutex m;
+	condition_variable cond;
+
+	for (auto _ : state) {
+		size_t open = 0;
+		for (size_t i = 0; i < RPC_BENCH_CALLS; i++) {
+			{
+				unique_lock<mutex> lock(m);
+				cond.wait(lock, [&]() { return open < window; });
+				open++;
+			}
+			b.client->Call(1, payload, [&](rpc::RpcResult) {
+				lock_guard<mutex> lock(m);
+				open--;
+				cond.notify_one();
+			});
+		}
+		unique_lock<mutex> lock(m);
+		cond.wait(lock, [&]() { return open == 0; });
+	}
+	state.SetItemsProcessed(state.iterations() * RPC_BENCH_CALLS);
+	state.SetBytesProcessed(state.iterations() * RPC_BENCH_CALLS * payload.size());
+}
+BENCHMARK(BM_RpcPipelined)
+	->ArgNames({"window", "payload"})
+	->ArgsProduct({{1, 16, 256}, {16, 4096}})
+	->UseRealTime()
+	->Unit(benchmark::kMillisecond);
@@ -0,0 +1,95 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+#include "shared/util/strutil.hpp"
+
+using namespace std;
+
+/**
+ * Generate a list with `count` elements (similar to the node lists of the metaconfig)
+ */
+static string makeList(size_t count) {
+	string list;
+	for (size_t i = 0; i < count; i++) {
+		list += "node-" + to_string(i) + ".cluster.local,";
+	}
+	return list;
+}
+
+static void BM_StrutilSplit(benchmark::State& state) {
+	string list = makeList(state.range(0));
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(util::strutil::split(list, ','));
+	}
+	state.SetBytesProcessed(state.iterations() * list.size());
+}
+BENCHMARK(BM_StrutilSplit)->Arg(4)->Arg(64)->Arg(1024);
+
+static void BM_StrutilSplitView(benchmark::State& state) {
+	string list = makeList(state.range(0));
+	for (auto _ : state) {
+		for (string_view token : util::strutil::splitView(list, ',')) {
+			benchmark::DoNotOptimize(token);
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * list.size());
+}
+BENCHMARK(BM_StrutilSplitView)->Arg(4)->Arg(64)->Arg(1024);
+
+static void BM_StrutilUnsplit(benchmark::State& state) {
+	vector<string> tokens = util::strutil::split(makeList(state.range(0)), ',');
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(util::strutil::unsplit(tokens, ','));
+	}
+}
+BENCHMARK(BM_StrutilUnsplit)->Arg(4)->Arg(64)->Arg(1024);
+
+static void BM_StrutilJoin(benchmark::State& state) {
+	vector<string> tokens = util::strutil::split(makeList(state.range(0)), ',');
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(util::strutil::join(tokens, ","));
+	}
+}
+BENCHMARK(BM_StrutilJoin)->Arg(4)->Arg(64)->Arg(1024);
+
+static void BM_StrutilCmpIgnoreCase(benchmark::State& state) {
+	string a(state.range(0), 'a');
+	string b(state.range(0), 'A');
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(util::strutil::cmpIgnoreCase(a, b));
+	}
+	state.SetBytesProcessed(state.iterations() * a.size());
+}
+BENCHMARK(BM_StrutilCmpIgnoreCase)->Arg(4)->Arg(64)->Arg(1024);
+
+static void BM_StrutilCmpIgnoreCaseAscii(benchmark::State& state) {
+	string a(state.range(0), 'a');
+	string b(state.range(0), 'A');
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(util::strutil::cmpIgnoreCaseAscii(a, b));
+	}
+	state.SetBytesProcessed(state.iterations() * a.size());
+}
+BENCHMARK(BM_StrutilCmpIgnoreCaseAscii)->Arg(4)->Arg(64)->Arg(1024);
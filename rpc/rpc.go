@@ -0,0 +1,600 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+package rpc
+
+import (
+	"context"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io/fs"
+	"net"
+	"os"
+	"path/filepath"
+	"sync"
+)
+
+// Wire format, see rpc.hpp
+const (
+	RPC_HEADER_SIZE = 16
+	RPC_MAX_FRAME_SIZE = 16 * 1024 * 1024
+	RPC_READ_BUFFER = 64 * 1024
+)
+
+type RpcFrameType uint8
+
+const (
+	// Client opens a stream, the payload is the request
+	REQUEST RpcFrameType = 1
+	// Server sends a message on the stream
+	DATA RpcFrameType = 2
+	// Server closes the stream, the payload is the response
+	END RpcFrameType = 3
+	// Server closes the stream, the payload is the error message
+	ERROR RpcFrameType = 4
+	// Client abandons the stream, the server stops sending on it
+	CANCEL RpcFrameType = 5
+)
+
+var ErrRpcClosed = errors.New("Rpc connection is closed")
+
+type rpcFrameHeader struct {
+	length uint32
+	stream uint32
+	method uint32
+	typ RpcFrameType
+}
+
+/**
+ * Splits the received byte stream into frames
+ *
+ * Payloads are slices of the chunk they were read into (no copies).
+ * A chunk is compacted in place as long as no payload was handed out from it,
+ * otherwise the incomplete tail is copied into a new chunk and the old one is left to the payloads.
+ */
+type frameReader struct {
+	chunk []byte
+	begin int
+	end int
+	shared bool
+	chunkSize int
+}
+
+func (r *frameReader) next(conn net.Conn) (rpcFrameHeader, []byte, error) {
+	for {
+		if r.end-r.begin >= RPC_HEADER_SIZE {
+			h := r.chunk[r.begin:]
+			header := rpcFrameHeader{
+				length: binary.LittleEndian.Uint32(h[0:]),
+				stream: binary.LittleEndian.Uint32(h[4:]),
+				method: binary.LittleEndian.Uint32(h[8:]),
+				typ: RpcFrameType(h[12]),
+			}
+			if header.length > RPC_MAX_FRAME_SIZE {
+				return header, nil, fmt.Errorf("Rpc frame exceeds the maximum frame size (%d bytes)", header.length)
+			}
+			size := RPC_HEADER_SIZE+int(header.length)
+			if r.end-r.begin >= size {
+				var payload []byte
+				if header.length > 0 {
+					payload = r.chunk[r.begin+RPC_HEADER_SIZE : r.begin+size : r.begin+size]
+					r.shared = true
+				}
+				r.begin += size
+				return header, payload, nil
+			}
+		}
+		if err:=r.fill(conn); err!=nil {
+			return rpcFrameHeader{}, nil, err
+		}
+	}
+}
+
+/**
+ * Read at least once, the buffer always holds the missing bytes of the current frame
+ */
+func (r *frameReader) fill(conn net.Conn) error {
+	if r.begin==r.end && !r.shared {
+		r.begin, r.end = 0, 0
+	}
+	avail := r.end-r.begin
+	need := RPC_HEADER_SIZE
+	if avail >= RPC_HEADER_SIZE {
+		need += int(binary.LittleEndian.Uint32(r.chunk[r.begin:]))
+	}
+	want := max(need-avail, r.chunkSize/4)
+	if len(r.chunk)-r.end < want {
+		if !r.shared && len(r.chunk) >= avail+want {
+			copy(r.chunk, r.chunk[r.begin:r.end])
+		} else {
+			chunk := make([]byte, max(r.chunkSize, avail+want))
+			copy(chunk, r.chunk[r.begin:r.end])
+			r.chunk = chunk
+			r.shared = false
+		}
+		r.begin, r.end = 0, avail
+	}
+	n, err := conn.Read(r.chunk[r.end:])
+	r.end += n
+	if n > 0 {
+		return nil
+	}
+	return err
+}
+
+/**
+ * Framed connection, base of the server connections and the client
+ *
+ * send() can be called from any goroutine. The first sender becomes the writer and writes
+ * everything queued with one writev (net.Buffers), frames queued meanwhile go out with the next one.
+ */
+type rpcConn struct {
+	conn net.Conn
+	reader frameReader
+	writeLock sync.Mutex
+	pending net.Buffers
+	writing bool
+	closed bool
+}
+
+func newRpcConn(conn net.Conn) *rpcConn {
+	return &rpcConn{
+		conn: conn,
+		reader: frameReader{chunkSize: RPC_READ_BUFFER},
+	}
+}
+
+/**
+ * Queue a frame, the payload must not be modified afterwards
+ */
+func (c *rpcConn) send(stream uint32, method uint32, typ RpcFrameType, payload []byte) error {
+	header := make([]byte, RPC_HEADER_SIZE)
+	binary.LittleEndian.PutUint32(header[0:], uint32(len(payload)))
+	binary.LittleEndian.PutUint32(header[4:], stream)
+	binary.LittleEndian.PutUint32(header[8:], method)
+	header[12] = byte(typ)
+
+	c.writeLock.Lock()
+	defer c.writeLock.Unlock()
+	if c.closed {
+		return ErrRpcClosed
+	}
+	c.pending = append(c.pending, header)
+	if len(payload) > 0 {
+		c.pending = append(c.pending, payload)
+	}
+	if c.writing {
+		return nil
+	}
+	c.writing = true
+	for len(c.pending) > 0 {
+		bufs := c.pending
+		c.pending = nil
+		c.writeLock.Unlock()
+		_, err := bufs.WriteTo(c.conn)
+		c.writeLock.Lock()
+		if err!=nil {
+			c.writing = false
+			c.closed = true
+			c.pending = nil
+			c.conn.Close()
+			return err
+		}
+	}
+	c.writing = false
+	return nil
+}
+
+func (c *rpcConn) close() {
+	c.writeLock.Lock()
+	defer c.writeLock.Unlock()
+	if c.closed {
+		return
+	}
+	c.closed = true
+	c.pending = nil
+	c.conn.Close()
+}
+
+// Server
+
+/**
+ * Call of a method, passed to the handler
+ */
+type RpcCall struct {
+	conn *rpcConn
+	stream uint32
+	method uint32
+	request []byte
+	ctx context.Context
+	cancel context.CancelFunc
+}
+
+func (c *RpcCall) Method() uint32 {
+	return c.method
+}
+
+func (c *RpcCall) Stream() uint32 {
+	return c.stream
+}
+
+/**
+ * Request payload, it is a slice of the receive buffer and must not be modified
+ */
+func (c *RpcCall) Request() []byte {
+	return c.request
+}
+
+/**
+ * Context of the call, it is cancelled if the client cancels the call or the connection is closed
+ */
+func (c *RpcCall) Context() context.Context {
+	return c.ctx
+}
+
+/**
+ * Send a message on the stream before the handler returns the response
+ */
+func (c *RpcCall) Send(data []byte) error {
+	if err:=c.ctx.Err(); err!=nil {
+		return err
+	}
+	return c.conn.send(c.stream, 0, DATA, data)
+}
+
+/**
+ * Handler of a method, the returned slice is the response
+ *
+ * Errors are returned to the client as error message.
+ */
+type RpcHandler func(call *RpcCall) ([]byte, error)
+
+/**
+ * RpcServer serves binary framed calls over a UNIX socket (see rpc.hpp for the wire format)
+ *
+ * It implements the same protocol as the C++ RpcServer:
+ * Methods are registered with Handle() before Serve(), every request runs in its own goroutine,
+ * so pipelined requests of a connection are handled concurrently and answered in the order they finish.
+ */
+type RpcServer struct {
+	socketPath string
+	socketPerm fs.FileMode
+	handlers map[uint32]RpcHandler
+	lock sync.Mutex
+	listener net.Listener
+	conns map[*rpcConn]struct{}
+	closed bool
+}
+
+/**
+ * Initialize the RPC server, creates the socket path and removes old sockets
+ */
+func CreateRpcServer(socketpath string, socketperm fs.FileMode) (*RpcServer, error) {
+	// Create path recursively
+	parentpath := filepath.Dir(socketpath)
+	if err:=os.MkdirAll(parentpath, 0755); err!=nil {
+		return nil, err
+	}
+	// Cleanup old socket
+	if err:=os.Remove(socketpath); err!=nil&&!os.IsNotExist(err) {
+		return nil, err
+	}
+	return &RpcServer{
+		socketPath: socketpath,
+		socketPerm: socketperm,
+		handlers: map[uint32]RpcHandler{},
+		conns: map[*rpcConn]struct{}{},
+	}, nil
+}
+
+/**
+ * Register the handler of a method, handlers must be registered before Serve()
+ */
+func (s *RpcServer) Handle(method uint32, handler RpcHandler) {
+	s.handlers[method] = handler
+}
+
+/**
+ * Create unix socket / listener and accept connections
+ *
+ * Serve() will block execution until Close() is called, you can safely push it to a goroutine
+ */
+func (s *RpcServer) Serve() error {
+	// Remove socket if already existent
+	if err:=os.Remove(s.socketPath); err!=nil && !os.IsNotExist(err) {
+		return err
+	}
+	unixListener, err := net.Listen("unix", s.socketPath)
+	if err!=nil {
+		return err
+	}
+	defer unixListener.Close()
+	defer os.Remove(s.socketPath)
+
+	// Change socket permissions
+	if err:=os.Chmod(s.socketPath, s.socketPerm); err!=nil {
+		return err
+	}
+	s.lock.Lock()
+	if s.closed {
+		s.lock.Unlock()
+		return nil
+	}
+	s.listener = unixListener
+	s.lock.Unlock()
+
+	for {
+		conn, err := unixListener.Accept()
+		if err!=nil {
+			s.lock.Lock()
+			closed := s.closed
+			s.lock.Unlock()
+			if closed {
+				return nil
+			}
+			return err
+		}
+		go s.serveConn(newRpcConn(conn))
+	}
+}
+
+/**
+ * Stop accepting connections and close open connections
+ *
+ * Running handlers are cancelled through the context of their call.
+ */
+func (s *RpcServer) Close() error {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	s.closed = true
+	for conn := range s.conns {
+		conn.close()
+	}
+	if s.listener!=nil {
+		return s.listener.Close()
+	}
+	return nil
+}
+
+func (s *RpcServer) serveConn(conn *rpcConn) {
+	s.lock.Lock()
+	if s.closed {
+		s.lock.Unlock()
+		conn.close()
+		return
+	}
+	s.conns[conn] = struct{}{}
+	s.lock.Unlock()
+
+	connCtx, connCancel := context.WithCancel(context.Background())
+	var callsLock sync.Mutex
+	calls := map[uint32]*RpcCall{}
+	defer func() {
+		connCancel()
+		conn.close()
+		s.lock.Lock()
+		delete(s.conns, conn)
+		s.lock.Unlock()
+	}()
+
+	for {
+		header, payload, err := conn.reader.next(conn.conn)
+		if err!=nil {
+			return
+		}
+		switch header.typ {
+		case REQUEST:
+			handler, ok := s.handlers[header.method]
+			if !ok {
+				conn.send(header.stream, 0, ERROR, []byte(fmt.Sprintf("Unknown rpc method: %d", header.method)))
+				continue
+			}
+			ctx, cancel := context.WithCancel(connCtx)
+			call := &RpcCall{
+				conn: conn,
+				stream: header.stream,
+				method: header.method,
+				request: payload,
+				ctx: ctx,
+				cancel: cancel,
+			}
+			callsLock.Lock()
+			_, exists := calls[header.stream]
+			if !exists {
+				calls[header.stream] = call
+			}
+			callsLock.Unlock()
+			if exists {
+				cancel()
+				conn.send(header.stream, 0, ERROR, []byte(fmt.Sprintf("Rpc stream is already open: %d", header.stream)))
+				continue
+			}
+			go func() {
+				response, err := handler(call)
+				callsLock.Lock()
+				delete(calls, call.stream)
+				callsLock.Unlock()
+				// Cancelled streams are already forgotten by the client
+				if call.ctx.Err()==nil {
+					if err!=nil {
+						conn.send(call.stream, 0, ERROR, []byte(err.Error()))
+					} else {
+						conn.send(call.stream, 0, END, response)
+					}
+				}
+				call.cancel()
+			}()
+		case CANCEL:
+			callsLock.Lock()
+			if call, ok := calls[header.stream]; ok {
+				call.cancel()
+			}
+			callsLock.Unlock()
+		default:
+			// Protocol error
+			return
+		}
+	}
+}
+
+// Client
+
+type pendingCall struct {
+	onData func([]byte)
+	done chan struct{}
+	response []byte
+	err error
+}
+
+/**
+ * RpcClient calls methods of a RpcServer (C++ or Go) over one UNIX socket connection
+ *
+ * Every method can be called from any goroutine, calls of concurrent goroutines are pipelined
+ * on the connection and their responses arrive in any order.
+ * Responses and messages are slices of the receive buffer, they must not be modified.
+ */
+type RpcClient struct {
+	conn *rpcConn
+	lock sync.Mutex
+	calls map[uint32]*pendingCall
+	nextStream uint32
+	closed bool
+}
+
+/**
+ * Connect to the server socket
+ */
+func DialRpc(socketpath string) (*RpcClient, error) {
+	conn, err := net.Dial("unix", socketpath)
+	if err!=nil {
+		return nil, err
+	}
+	client := &RpcClient{
+		conn: newRpcConn(conn),
+		calls: map[uint32]*pendingCall{},
+		nextStream: 1,
+	}
+	go client.readLoop()
+	return client, nil
+}
+
+/**
+ * Call a method and wait for the response
+ *
+ * If the context is done before the response arrives, the call is cancelled.
+ */
+func (c *RpcClient) Invoke(ctx context.Context, method uint32, request []byte) ([]byte, error) {
+	return c.Stream(ctx, method, request, nil)
+}
+
+/**
+ * Call a method, onData is called (on the reader goroutine) for every message the server sends before the response
+ */
+func (c *RpcClient) Stream(ctx context.Context, method uint32, request []byte, onData func([]byte)) ([]byte, error) {
+	call := &pendingCall{
+		onData: onData,
+		done: make(chan struct{}),
+	}
+	c.lock.Lock()
+	if c.closed {
+		c.lock.Unlock()
+		return nil, ErrRpcClosed
+	}
+	stream := c.nextStream
+	for _, exists := c.calls[stream]; stream==0 || exists; _, exists = c.calls[stream] {
+		stream++
+	}
+	c.nextStream = stream+1
+	c.calls[stream] = call
+	c.lock.Unlock()
+
+	if err:=c.conn.send(stream, method, REQUEST, request); err!=nil {
+		c.finish(stream, nil, err)
+	}
+	select {
+	case <-call.done:
+	case <-ctx.Done():
+		if c.finish(stream, nil, ctx.Err()) {
+			c.conn.send(stream, 0, CANCEL, nil)
+		}
+		<-call.done
+	}
+	return call.response, call.err
+}
+
+/**
+ * Close the connection, open calls return ErrRpcClosed
+ */
+func (c *RpcClient) Close() error {
+	c.conn.close()
+	return nil
+}
+
+/**
+ * Remove the call and finish it, false if the call is not open
+ */
+func (c *RpcClient) finish(stream uint32, response []byte, err error) bool {
+	c.lock.Lock()
+	call, ok := c.calls[stream]
+	delete(c.calls, stream)
+	c.lock.Unlock()
+	if !ok {
+		return false
+	}
+	call.response = response
+	call.err = err
+	close(call.done)
+	return true
+}
+
+func (c *RpcClient) readLoop() {
+	for {
+		header, payload, err := c.conn.reader.next(c.conn.conn)
+		if err!=nil {
+			break
+		}
+		if header.typ==DATA {
+			c.lock.Lock()
+			call, ok := c.calls[header.stream]
+			c.lock.Unlock()
+			// Messages of cancelled calls are dropped
+			if ok && call.onData!=nil {
+				call.onData(payload)
+			}
+		} else if header.typ==END {
+			c.finish(header.stream, payload, nil)
+		} else if header.typ==ERROR {
+			c.finish(header.stream, nil, errors.New(string(payload)))
+		} else {
+			// Protocol error
+			break
+		}
+	}
+	c.conn.close()
+	c.lock.Lock()
+	c.closed = true
+	calls := c.calls
+	c.calls = map[uint32]*pendingCall{}
+	c.lock.Unlock()
+	for _, call := range calls {
+		call.err = ErrRpcClosed
+		close(call.done)
+	}
+}
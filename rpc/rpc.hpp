@@ -0,0 +1,373 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef RPC_H
+#define RPC_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/write.hpp>
+
+namespace net = boost::asio;
+using unixsocket = net::local::stream_protocol;
+
+using namespace std;
+
+/**
+ * Wire format shared by rpcserver.hpp, rpcclient.hpp and rpc.go
+ *
+ * Every frame is a 16 byte header followed by the payload (all integers little endian):
+ *
+ *   0  uint32 payload length
+ *   4  uint32 stream id (chosen by the client, unique among the open streams of the connection)
+ *   8  uint32 method id (REQUEST frames only)
+ *   12 uint8  frame type (RpcFrameType)
+ *   13 uint8  flags (reserved, 0)
+ *   14 uint16 reserved (0)
+ *
+ * A REQUEST opens a stream, the server answers with any number of DATA frames
+ * and closes the stream with END (response) or ERROR (error message).
+ * Streams are multiplexed on one connection and answered in any order,
+ * so clients pipeline requests without waiting for the previous response.
+ */
+namespace rpc {
+
+	// Size of the header preceding every payload
+	inline constexpr size_t RPC_HEADER_SIZE = 16;
+	// Frames with a larger payload are a protocol error, the connection is closed
+	inline constexpr size_t RPC_MAX_FRAME_SIZE = 16 * 1024 * 1024;
+	// Default size of the receive chunks
+	inline constexpr size_t RPC_READ_BUFFER = 64 * 1024;
+	// Frames written with one gathered write (two buffers per frame, asio writes up to 64 buffers per syscall)
+	inline constexpr size_t RPC_WRITE_BATCH = 32;
+
+	/**
+	 * Type of a frame
+	 */
+	enum RpcFrameType : uint8_t {
+		// Client opens a stream, the payload is the request
+		REQUEST = 1,
+		// Server sends a message on the stream
+		DATA = 2,
+		// Server closes the stream, the payload is the response
+		END = 3,
+		// Server closes the stream, the payload is the error message
+		ERROR = 4,
+		// Client abandons the stream, the server stops sending on it
+		CANCEL = 5,
+	};
+
+	struct RpcFrameHeader {
+		uint32_t Length = 0;
+		uint32_t Stream = 0;
+		uint32_t Method = 0;
+		uint8_t Type = 0;
+		uint8_t Flags = 0;
+	};
+
+	inline void putle32(char* out, uint32_t value) {
+		for (size_t i = 0; i < 4; i++) out[i] = static_cast<char>(value >> (8 * i));
+	}
+
+	inline uint32_t getle32(const char* in) {
+		uint32_t value = 0;
+		for (size_t i = 0; i < 4; i++) value |= static_cast<uint32_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+		return value;
+	}
+
+	inline void encodeHeader(const RpcFrameHeader& header, char* out) {
+		putle32(out, header.Length);
+		putle32(out + 4, header.Stream);
+		putle32(out + 8, header.Method);
+		out[12] = static_cast<char>(header.Type);
+		out[13] = static_cast<char>(header.Flags);
+		out[14] = 0;
+		out[15] = 0;
+	}
+
+	inline RpcFrameHeader decodeHeader(const char* in) {
+		return RpcFrameHeader{
+			getle32(in), getle32(in + 4), getle32(in + 8),
+			static_cast<uint8_t>(in[12]), static_cast<uint8_t>(in[13]),
+		};
+	}
+
+	/**
+	 * Payload of a received frame
+	 *
+	 * The payload is not copied out of the receive buffer, it references the chunk it was read into
+	 * and keeps the chunk alive. A chunk is only reused by the connection after all its payloads are released,
+	 * so keep payloads short lived (or copy them with String()) to not pin receive chunks.
+	 */
+	class RpcPayload {
+	public:
+		RpcPayload() = default;
+		RpcPayload(shared_ptr<const char[]> chunk, const char* data, size_t size)
+			: chunk(move(chunk)), data(data, size) {}
+
+		string_view View() const { return data; }
+		const char* Data() const { return data.data(); }
+		size_t Size() const { return data.size(); }
+		bool Empty() const { return data.empty(); }
+		string String() const { return string(data); }
+
+	private:
+		shared_ptr<const char[]> chunk;
+		string_view data;
+	};
+
+	/**
+	 * Splits the received byte stream into frames
+	 *
+	 * Data is read into chunks, frames are handed out as views into the chunk.
+	 * A chunk is compacted in place if no payload references it, otherwise the incomplete tail
+	 * is copied into a new chunk (frames larger than the chunk size get a chunk of their size).
+	 */
+	class framereader {
+	public:
+		framereader(size_t chunkSize, size_t maxFrameSize)
+			: chunkSize(max(chunkSize, RPC_HEADER_SIZE)), maxFrameSize(maxFrameSize) {}
+
+		/**
+		 * Buffer for the next read, always holds at least the missing bytes of the current frame
+		 */
+		net::mutable_buffer prepare() {
+			if (begin == end && chunk && chunk.use_count() == 1) begin = end = 0;
+			size_t avail = end - begin;
+			size_t want = max(need() - avail, chunkSize / 4);
+			if (capacity - end < want) relocate(avail + want);
+			return net::buffer(chunk.get() + end, capacity - end);
+		}
+
+		void commit(size_t n) {
+			end += n;
+		}
+
+		/**
+		 * Take the next complete frame, false if more data is required
+		 *
+		 * Throws a runtime_error if the frame exceeds the maximum frame size.
+		 */
+		bool next(RpcFrameHeader& header, RpcPayload& payload) {
+			if (end - begin < RPC_HEADER_SIZE) return false;
+			header = decodeHeader(chunk.get() + begin);
+			if (header.Length > maxFrameSize) {
+				throw runtime_error("Rpc frame exceeds the maximum frame size (" + to_string(header.Length) + " bytes)");
+			}
+			if (end - begin < RPC_HEADER_SIZE + header.Length) return false;
+			const char* data = chunk.get() + begin + RPC_HEADER_SIZE;
+			payload = header.Length > 0 ? RpcPayload(chunk, data, header.Length) : RpcPayload();
+			begin += RPC_HEADER_SIZE + header.Length;
+			return true;
+		}
+
+	private:
+		size_t chunkSize;
+		size_t maxFrameSize;
+		shared_ptr<char[]> chunk;
+		size_t capacity = 0;
+		size_t begin = 0;
+		size_t end = 0;
+
+		/**
+		 * Bytes of the current frame (header only until the header is complete)
+		 */
+		size_t need() const {
+			if (end - begin < RPC_HEADER_SIZE) return RPC_HEADER_SIZE;
+			return RPC_HEADER_SIZE + min<size_t>(getle32(chunk.get() + begin), maxFrameSize);
+		}
+
+		void relocate(size_t size) {
+			size_t avail = end - begin;
+			if (chunk && chunk.use_count() == 1 && capacity >= size) {
+				memmove(chunk.get(), chunk.get() + begin, avail);
+			} else {
+				size_t newCapacity = max(chunkSize, size);
+				auto newChunk = make_shared_for_overwrite<char[]>(newCapacity);
+				if (avail > 0) memcpy(newChunk.get(), chunk.get() + begin, avail);
+				chunk = move(newChunk);
+				capacity = newCapacity;
+			}
+			begin = 0;
+			end = avail;
+		}
+	};
+
+	/**
+	 * Framed connection on a UNIX socket, base of the server sessions and the client
+	 *
+	 * The socket must be created on a strand, reads, writes and the callbacks run on it.
+	 * send() can be called from any thread: frames are queued and the queue is written
+	 * with gathered writes, so frames queued while a write is in flight go out with the next syscall.
+	 */
+	class connection : public enable_shared_from_this<connection> {
+	public:
+		connection(unixsocket::socket socket, size_t readBuffer, size_t maxFrameSize)
+			: socket(move(socket)), reader(readBuffer, maxFrameSize) {}
+
+		virtual ~connection() = default;
+
+		connection(const connection&) = delete;
+		connection& operator=(const connection&) = delete;
+
+		void start() {
+			net::dispatch(socket.get_executor(), [self = shared_from_this()]() { self->doRead(); });
+		}
+
+		/**
+		 * Queue a frame, false if the connection is closed
+		 */
+		bool send(uint32_t stream, uint32_t method, RpcFrameType type, string payload) {
+			outframe frame;
+			encodeHeader(RpcFrameHeader{static_cast<uint32_t>(payload.size()), stream, method, type, 0}, frame.header.data());
+			frame.payload = move(payload);
+			bool startWrite;
+			{
+				lock_guard<mutex> lock(writeMutex);
+				if (closed) return false;
+				pending.push_back(move(frame));
+				startWrite = !writing;
+				writing = true;
+			}
+			if (startWrite) net::post(socket.get_executor(), [self = shared_from_this()]() { self->doWrite(); });
+			return true;
+		}
+
+		/**
+		 * Close the socket, queued frames are dropped
+		 */
+		void close() {
+			net::post(socket.get_executor(), [self = shared_from_this()]() { self->shutdown(); });
+		}
+
+		bool isclosed() {
+			lock_guard<mutex> lock(writeMutex);
+			return closed;
+		}
+
+	protected:
+		/**
+		 * Called on the strand for every received frame, exceptions close the connection
+		 */
+		virtual void onFrame(const RpcFrameHeader& header, RpcPayload payload) = 0;
+
+		/**
+		 * Called on the strand once the connection is closed
+		 */
+		virtual void onClose() = 0;
+
+	private:
+		struct outframe {
+			array<char, RPC_HEADER_SIZE> header;
+			string payload;
+		};
+
+		unixsocket::socket socket;
+		framereader reader;
+
+		mutex writeMutex;
+		deque<outframe> pending;
+		bool writing = false;
+		bool closed = false;
+		// Frames of the write in flight and their buffers (only used on the strand)
+		vector<outframe> inflight;
+		vector<net::const_buffer> buffers;
+
+		void doRead() {
+			socket.async_read_some(reader.prepare(), [self = shared_from_this()](const boost::system::error_code& ec, size_t n) {
+				if (ec) {
+					self->shutdown();
+					return;
+				}
+				self->reader.commit(n);
+				try {
+					RpcFrameHeader header;
+					RpcPayload payload;
+					while (self->reader.next(header, payload)) {
+						self->onFrame(header, move(payload));
+					}
+				} catch (const exception&) {
+					self->shutdown();
+					return;
+				}
+				self->doRead();
+			});
+		}
+
+		void doWrite() {
+			{
+				lock_guard<mutex> lock(writeMutex);
+				if (closed) return;
+				size_t n = min(pending.size(), RPC_WRITE_BATCH);
+				for (size_t i = 0; i < n; i++) {
+					inflight.push_back(move(pending.front()));
+					pending.pop_front();
+				}
+			}
+			for (auto& frame : inflight) {
+				buffers.push_back(net::buffer(frame.header));
+				if (!frame.payload.empty()) buffers.push_back(net::buffer(frame.payload));
+			}
+			net::async_write(socket, buffers, [self = shared_from_this()](const boost::system::error_code& ec, size_t) {
+				self->inflight.clear();
+				self->buffers.clear();
+				if (ec) {
+					self->shutdown();
+					return;
+				}
+				bool more;
+				{
+					lock_guard<mutex> lock(self->writeMutex);
+					more = !self->pending.empty();
+					self->writing = more;
+				}
+				if (more) self->doWrite();
+			});
+		}
+
+		void shutdown() {
+			{
+				lock_guard<mutex> lock(writeMutex);
+				if (closed) return;
+				closed = true;
+				pending.clear();
+			}
+			boost::system::error_code ec;
+			socket.shutdown(unixsocket::socket::shutdown_both, ec);
+			socket.close(ec);
+			onClose();
+		}
+	};
+}
+
+#endif
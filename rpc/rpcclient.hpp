@@ -0,0 +1,227 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef RPCCLIENT_H
+#define RPCCLIENT_H
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/strand.hpp>
+
+#include "rpc/rpc.hpp"
+
+using namespace std;
+
+namespace rpc {
+
+	/**
+	 * Result of a call
+	 */
+	struct RpcResult {
+		// False if the server returned an error, the call was cancelled or the connection was closed
+		bool Ok = false;
+		// Response of the server (payload of the END frame)
+		RpcPayload Response;
+		string Error;
+	};
+
+	// Called once when the call is finished
+	using RpcDoneCallback = move_only_function<void(RpcResult)>;
+	// Called for every message the server sends on the stream before the response
+	using RpcDataCallback = function<void(RpcPayload)>;
+
+	/**
+	 * Options of the RPC client
+	 */
+	struct RpcClientOptions {
+		// Size of the receive chunks of the connection
+		size_t ReadBuffer = RPC_READ_BUFFER;
+		// The connection is closed if the server sends larger frames
+		size_t MaxFrameSize = RPC_MAX_FRAME_SIZE;
+	};
+
+	/**
+	 * RpcClient calls methods of a RpcServer (or the server of rpc.go) over one UNIX socket connection
+	 *
+	 * Calls are pipelined: Call() queues the request and returns immediately,
+	 * any number of calls can be open at once and their responses arrive in any order.
+	 * Requests queued while the connection is writing are sent with one gathered write.
+	 * Callbacks run on the io_context of the client, they must not block.
+	 * Every method can be called from any thread, Invoke() must not be called from the io_context.
+	 */
+	class RpcClient {
+	public:
+		/**
+		 * Connect to the server socket
+		 *
+		 * Function will throw a runtime error if the socket cannot be connected
+		 */
+		RpcClient(net::io_context& ioContext, string socketPath, RpcClientOptions options = RpcClientOptions()) {
+			unixsocket::socket socket(net::make_strand(ioContext));
+			boost::system::error_code ec;
+			socket.connect(unixsocket::endpoint(socketPath), ec);
+			if (ec) {
+				throw runtime_error("Failed to connect rpc socket at: " + socketPath + "\n" + ec.message());
+			}
+			conn = make_shared<clientconn>(move(socket), options);
+			conn->start();
+		}
+
+		virtual ~RpcClient() {
+			Close();
+		}
+
+		RpcClient(const RpcClient&) = delete;
+		RpcClient& operator=(const RpcClient&) = delete;
+
+		/**
+		 * Call a method, returns the stream id of the call (used to cancel it)
+		 *
+		 * onDone is always called exactly once, also if the connection is closed.
+		 */
+		uint32_t Call(uint32_t method, string request, RpcDoneCallback onDone, RpcDataCallback onData = nullptr) {
+			auto call = make_shared<pendingcall>(move(onDone), move(onData));
+			uint32_t stream;
+			{
+				lock_guard<mutex> lock(conn->callsMutex);
+				do {
+					stream = nextStream++;
+				} while (stream == 0 || !conn->calls.emplace(stream, call).second);
+			}
+			if (!conn->send(stream, method, REQUEST, move(request))) {
+				conn->finish(stream, RpcResult{false, RpcPayload(), "Rpc connection is closed"});
+			}
+			return stream;
+		}
+
+		/**
+		 * Call a method and wait for the response
+		 *
+		 * Function will throw a runtime error with the error message if the call failed.
+		 */
+		RpcPayload Invoke(uint32_t method, string request) {
+			promise<RpcResult> result;
+			auto future = result.get_future();
+			Call(method, move(request), [&result](RpcResult r) { result.set_value(move(r)); });
+			RpcResult r = future.get();
+			if (!r.Ok) throw runtime_error(r.Error);
+			return move(r.Response);
+		}
+
+		/**
+		 * Cancel an open call, its onDone is called with an error
+		 *
+		 * The server is notified and stops sending on the stream, calls that already finished are ignored.
+		 */
+		void Cancel(uint32_t stream) {
+			if (conn->finish(stream, RpcResult{false, RpcPayload(), "Rpc call was cancelled"})) {
+				conn->send(stream, 0, CANCEL, "");
+			}
+		}
+
+		/**
+		 * Close the connection, open calls are finished with an error
+		 */
+		void Close() {
+			conn->close();
+		}
+
+		bool Closed() {
+			return conn->isclosed();
+		}
+
+	private:
+		struct pendingcall {
+			RpcDoneCallback done;
+			RpcDataCallback data;
+		};
+
+		class clientconn : public connection {
+		public:
+			clientconn(unixsocket::socket socket, RpcClientOptions options)
+				: connection(move(socket), options.ReadBuffer, options.MaxFrameSize) {}
+
+			mutex callsMutex;
+			unordered_map<uint32_t, shared_ptr<pendingcall>> calls;
+
+			/**
+			 * Remove the call and finish it, false if the call is not open
+			 */
+			bool finish(uint32_t stream, RpcResult result) {
+				shared_ptr<pendingcall> call;
+				{
+					lock_guard<mutex> lock(callsMutex);
+					auto it = calls.find(stream);
+					if (it == calls.end()) return false;
+					call = move(it->second);
+					calls.erase(it);
+				}
+				call->done(move(result));
+				return true;
+			}
+
+		private:
+			void onFrame(const RpcFrameHeader& header, RpcPayload payload) override {
+				switch (header.Type) {
+				case DATA: {
+					shared_ptr<pendingcall> call;
+					{
+						lock_guard<mutex> lock(callsMutex);
+						auto it = calls.find(header.Stream);
+						if (it != calls.end()) call = it->second;
+					}
+					// Messages of cancelled calls are dropped
+					if (call && call->data) call->data(move(payload));
+					return;
+				}
+				case END:
+					finish(header.Stream, RpcResult{true, move(payload), ""});
+					return;
+				case ERROR:
+					finish(header.Stream, RpcResult{false, RpcPayload(), payload.String()});
+					return;
+				default:
+					throw runtime_error("Unexpected rpc frame type: " + to_string(header.Type));
+				}
+			}
+
+			void onClose() override {
+				unordered_map<uint32_t, shared_ptr<pendingcall>> open;
+				{
+					lock_guard<mutex> lock(callsMutex);
+					open.swap(calls);
+				}
+				for (auto& [_, call] : open) call->done(RpcResult{false, RpcPayload(), "Rpc connection is closed"});
+			}
+		};
+
+		shared_ptr<clientconn> conn;
+		uint32_t nextStream = 1;
+	};
+}
+
+#endif
@@ -0,0 +1,321 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef RPCSERVER_H
+#define RPCSERVER_H
+
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/strand.hpp>
+
+#include "rpc/rpc.hpp"
+#include "shared/util/trace.hpp"
+#include "shared/util/workpool.hpp"
+
+using namespace std;
+
+namespace rpc {
+
+	/**
+	 * Call of a method, passed to the handler
+	 */
+	class RpcCall {
+	public:
+		RpcCall(shared_ptr<connection> conn, uint32_t stream, uint32_t method, RpcPayload request)
+			: conn(move(conn)), stream(stream), method(method), request(move(request)) {}
+
+		uint32_t Method() const { return method; }
+		uint32_t Stream() const { return stream; }
+
+		/**
+		 * Request payload, it references the receive buffer of the connection (see RpcPayload)
+		 */
+		const RpcPayload& Request() const { return request; }
+
+		/**
+		 * Send a message on the stream before the handler returns the response
+		 *
+		 * Returns false if the call was cancelled or the connection is closed.
+		 */
+		bool Send(string data) {
+			if (Cancelled()) return false;
+			return conn->send(stream, 0, DATA, move(data));
+		}
+
+		/**
+		 * True if the client cancelled the call or the connection was closed
+		 */
+		bool Cancelled() const {
+			return cancelled.load(memory_order_relaxed);
+		}
+
+	private:
+		friend class RpcServer;
+
+		shared_ptr<connection> conn;
+		uint32_t stream;
+		uint32_t method;
+		RpcPayload request;
+		atomic<bool> cancelled = false;
+	};
+
+	/**
+	 * Handler of a method, the returned string is the response
+	 *
+	 * Exceptions thrown by the handler are returned to the client as error.
+	 */
+	using RpcHandler = function<string(RpcCall&)>;
+
+	/**
+	 * Options of the RPC server
+	 */
+	struct RpcServerOptions {
+		// Run handlers on this pool, if not set handlers run on the io_context and must not block
+		util::workpool* Workers = nullptr;
+		// Size of the receive chunks of a connection
+		size_t ReadBuffer = RPC_READ_BUFFER;
+		// Connections sending larger frames are closed
+		size_t MaxFrameSize = RPC_MAX_FRAME_SIZE;
+	};
+
+	/**
+	 * RpcServer serves binary framed calls over a UNIX socket (see rpc.hpp for the wire format)
+	 *
+	 * It is the low latency channel for control traffic between the components,
+	 * the same protocol is implemented by rpc.go.
+	 * - Methods are identified by a numeric id and registered with Handle() before Serve().
+	 * - Calls of a connection are multiplexed, handlers of pipelined requests run concurrently
+	 *   on RpcServerOptions::Workers and responses are sent as soon as they are ready.
+	 * - Responses queued while the connection is writing are sent with one gathered write.
+	 * - Request payloads are passed to the handler without copying them out of the receive buffer.
+	 * Connections are accepted and handled asynchronously on the io_context of the component.
+	 */
+	class RpcServer {
+	public:
+		/**
+		 * Initialize the RPC server, creates the socket path and removes old sockets
+		 */
+		RpcServer(net::io_context& ioContext,
+							string socketPath,
+							filesystem::perms socketPerm,
+							RpcServerOptions options = RpcServerOptions())
+			: state(make_shared<serverstate>(options)),
+				ioContext(ioContext),
+				socketPath(socketPath),
+				socketPerm(socketPerm),
+				acceptor(ioContext) {
+			// Create path recursively
+			filesystem::path fspath(socketPath);
+			if (fspath.has_parent_path()) {
+				filesystem::create_directories(fspath.parent_path());
+			}
+			// Cleanup old socket
+			filesystem::remove(socketPath);
+		}
+
+		virtual ~RpcServer() {
+			Close();
+		}
+
+		RpcServer(const RpcServer&) = delete;
+		RpcServer& operator=(const RpcServer&) = delete;
+
+		/**
+		 * Register the handler of a method
+		 *
+		 * Handlers must be registered before Serve(), otherwise a runtime error is thrown.
+		 */
+		void Handle(uint32_t method, RpcHandler handler) {
+			if (acceptor.is_open()) {
+				throw runtime_error("Rpc handlers must be registered before Serve()");
+			}
+			state->handlers[method] = move(handler);
+		}
+
+		/**
+		 * Create unix socket / listener and start accepting connections
+		 *
+		 * Serve() does not block, connections are handled while the io_context runs.
+		 * Function will throw a runtime error if the socket cannot be created
+		 */
+		void Serve() {
+			// Remove socket if already existent
+			filesystem::remove(socketPath);
+			boost::system::error_code ec;
+			unixsocket::endpoint endpoint(socketPath);
+			acceptor.open(endpoint.protocol(), ec);
+			if (!ec) acceptor.bind(endpoint, ec);
+			if (!ec) acceptor.listen(net::socket_base::max_listen_connections, ec);
+			if (ec) {
+				throw runtime_error("Failed to open rpc socket at: " + socketPath + "\n" + ec.message());
+			}
+			// Change socket permissions
+			filesystem::permissions(socketPath, socketPerm);
+			doAccept();
+		}
+
+		/**
+		 * Stop accepting connections, close open connections and remove the socket
+		 *
+		 * Running handlers are cancelled (see RpcCall::Cancelled()), their responses are dropped.
+		 */
+		void Close() {
+			if (!acceptor.is_open()) return;
+			boost::system::error_code ec;
+			acceptor.close(ec);
+			error_code fsec;
+			filesystem::remove(socketPath, fsec);
+			lock_guard<mutex> lock(state->sessionsMutex);
+			for (auto& s : state->sessions) {
+				if (auto conn = s.lock()) conn->close();
+			}
+			state->sessions.clear();
+		}
+
+	private:
+		class session;
+
+		struct serverstate {
+			RpcServerOptions options;
+			unordered_map<uint32_t, RpcHandler> handlers;
+			mutex sessionsMutex;
+			vector<weak_ptr<connection>> sessions;
+
+			explicit serverstate(RpcServerOptions options) : options(options) {}
+		};
+
+		shared_ptr<serverstate> state;
+		net::io_context& ioContext;
+		string socketPath;
+		filesystem::perms socketPerm;
+		unixsocket::acceptor acceptor;
+
+		void doAccept();
+	};
+
+	/**
+	 * Connection of a client, tracks the open calls for cancellation
+	 */
+	class RpcServer::session : public connection {
+	public:
+		session(unixsocket::socket socket, shared_ptr<serverstate> state)
+			: connection(move(socket), state->options.ReadBuffer, state->options.MaxFrameSize), state(move(state)) {}
+
+	private:
+		shared_ptr<serverstate> state;
+		mutex callsMutex;
+		unordered_map<uint32_t, shared_ptr<RpcCall>> calls;
+
+		void onFrame(const RpcFrameHeader& header, RpcPayload payload) override {
+			switch (header.Type) {
+			case REQUEST:
+				startCall(header, move(payload));
+				return;
+			case CANCEL: {
+				lock_guard<mutex> lock(callsMutex);
+				auto it = calls.find(header.Stream);
+				if (it != calls.end()) it->second->cancelled = true;
+				return;
+			}
+			default:
+				throw runtime_error("Unexpected rpc frame type: " + to_string(header.Type));
+			}
+		}
+
+		void onClose() override {
+			lock_guard<mutex> lock(callsMutex);
+			for (auto& [_, call] : calls) call->cancelled = true;
+		}
+
+		void startCall(const RpcFrameHeader& header, RpcPayload payload) {
+			auto handler = state->handlers.find(header.Method);
+			if (handler == state->handlers.end()) {
+				send(header.Stream, 0, ERROR, "Unknown rpc method: " + to_string(header.Method));
+				return;
+			}
+			auto call = make_shared<RpcCall>(shared_from_this(), header.Stream, header.Method, move(payload));
+			{
+				lock_guard<mutex> lock(callsMutex);
+				if (!calls.emplace(header.Stream, call).second) {
+					send(header.Stream, 0, ERROR, "Rpc stream is already open: " + to_string(header.Stream));
+					return;
+				}
+			}
+			auto run = [this, call, handler = &handler->second]() { runCall(*call, *handler); };
+			if (!state->options.Workers) {
+				run();
+			} else if (!state->options.Workers->post(run)) {
+				finishCall(*call, ERROR, "Rpc worker pool is closed");
+			}
+		}
+
+		void runCall(RpcCall& call, const RpcHandler& handler) {
+			string response;
+			RpcFrameType type = END;
+			try {
+				TRACE_SPAN("rpc.call");
+				response = handler(call);
+			} catch (const exception& e) {
+				type = ERROR;
+				response = e.what();
+			} catch (...) {
+				type = ERROR;
+				response = "Rpc handler failed for method: " + to_string(call.Method());
+			}
+			finishCall(call, type, move(response));
+		}
+
+		void finishCall(RpcCall& call, RpcFrameType type, string response) {
+			{
+				lock_guard<mutex> lock(callsMutex);
+				calls.erase(call.Stream());
+			}
+			// Cancelled streams are already forgotten by the client
+			if (!call.Cancelled()) send(call.Stream(), 0, type, move(response));
+		}
+	};
+
+	inline void RpcServer::doAccept() {
+		acceptor.async_accept(net::make_strand(ioContext), [this](const boost::system::error_code& ec, unixsocket::socket socket) {
+			// Acceptor was closed
+			if (ec == net::error::operation_aborted) return;
+			if (!ec) {
+				auto conn = make_shared<session>(move(socket), state);
+				{
+					lock_guard<mutex> lock(state->sessionsMutex);
+					erase_if(state->sessions, [](const weak_ptr<connection>& s) { return s.expired(); });
+					state->sessions.push_back(conn);
+				}
+				conn->start();
+			}
+			if (acceptor.is_open()) doAccept();
+		});
+	}
+}
+
+#endif
@@ -0,0 +1,84 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOGCONFIG_H
+#define LOGCONFIG_H
+
+#include <chrono>
+#include <string>
+
+#include "shared/logger/logrotate.hpp"
+#include "shared/metaconfig/metaconfig.hpp"
+
+using namespace std;
+
+namespace logger {
+
+	// MetaConfig keys of the LogRotationPolicy
+	inline const string LOG_ROTATION_MAXSIZE_KEY = "log.rotation.maxsize";
+	inline const string LOG_ROTATION_INTERVAL_KEY = "log.rotation.interval";
+	inline const string LOG_ROTATION_COMPRESS_KEY = "log.rotation.compress";
+	inline const string LOG_RETENTION_SEGMENTS_KEY = "log.retention.segments";
+	inline const string LOG_RETENTION_MAXAGE_KEY = "log.retention.maxage";
+
+	/**
+	 * Load the rotation and retention policy of the logfile from the config
+	 *
+	 * ```
+	 * log.rotation.maxsize="104857600"   # bytes
+	 * log.rotation.interval="86400"      # seconds
+	 * log.rotation.compress="true"
+	 * log.retention.segments="14"
+	 * log.retention.maxage="1209600"     # seconds
+	 * ```
+	 *
+	 * Keys that are not set keep the value of `defaults`, sizes and durations of 0 disable the setting.
+	 * The keys are declared with their expected types, so later writes with invalid values are rejected.
+	 *
+	 * This operation does not read / parse anything from disk!
+	 *
+	 * Function will throw a runtime error if a key holds a invalid value
+	 */
+	inline LogRotationPolicy LoadRotationPolicy(metaconfig::MetaConfig& config, LogRotationPolicy defaults = LogRotationPolicy()) {
+		config.ExpectType(LOG_ROTATION_MAXSIZE_KEY, metaconfig::DOUBLE);
+		config.ExpectType(LOG_ROTATION_INTERVAL_KEY, metaconfig::DOUBLE);
+		config.ExpectType(LOG_ROTATION_COMPRESS_KEY, metaconfig::BOOL);
+		config.ExpectType(LOG_RETENTION_SEGMENTS_KEY, metaconfig::DOUBLE);
+		config.ExpectType(LOG_RETENTION_MAXAGE_KEY, metaconfig::DOUBLE);
+
+		LogRotationPolicy policy = defaults;
+		auto getCount = [&](const string& key) -> size_t {
+			double value = config.GetDouble(key);
+			return value > 0 ? (size_t)value : 0;
+		};
+		if (config.Exists(LOG_ROTATION_MAXSIZE_KEY))
+			policy.MaxSize = getCount(LOG_ROTATION_MAXSIZE_KEY);
+		if (config.Exists(LOG_ROTATION_INTERVAL_KEY))
+			policy.Interval = chrono::seconds(getCount(LOG_ROTATION_INTERVAL_KEY));
+		if (config.Exists(LOG_ROTATION_COMPRESS_KEY))
+			policy.Compress = config.GetBool(LOG_ROTATION_COMPRESS_KEY);
+		if (config.Exists(LOG_RETENTION_SEGMENTS_KEY))
+			policy.RetainSegments = getCount(LOG_RETENTION_SEGMENTS_KEY);
+		if (config.Exists(LOG_RETENTION_MAXAGE_KEY))
+			policy.RetainAge = chrono::seconds(getCount(LOG_RETENTION_MAXAGE_KEY));
+		return policy;
+	}
+};
+
+#endif
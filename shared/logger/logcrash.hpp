@@ -0,0 +1,114 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LOGCRASH_H
+#define LOGCRASH_H
+
+#include <atomic>
+#include <csignal>
+#include <cstddef>
+#include <mutex>
+#include <signal.h>
+
+using namespace std;
+
+namespace logger {
+
+	// Maximum number of crash flushes that can be registered at the same time
+	inline constexpr size_t LOG_CRASH_SLOTS = 16;
+	// Fatal signals that trigger the crash flushes
+	inline constexpr int LOG_CRASH_SIGNALS[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+	/**
+	 * Flush called from the crash handler, it must be async-signal-safe
+	 */
+	using LogCrashFlush = void (*)(void* ctx) noexcept;
+
+	namespace detail {
+		struct logcrashslot {
+			atomic<LogCrashFlush> fn = nullptr;
+			atomic<void*> ctx = nullptr;
+		};
+
+		inline logcrashslot crashSlots[LOG_CRASH_SLOTS];
+		// Serializes the registration, never taken by the handler
+		inline mutex crashSlotLock;
+		inline once_flag crashInstalled;
+		inline struct sigaction crashPrevious[NSIG];
+
+		/**
+		 * Run the registered flushes and re-raise the signal with the previous action
+		 */
+		inline void crashHandler(int sig) {
+			for (auto& slot : crashSlots) {
+				LogCrashFlush fn = slot.fn.load(memory_order_acquire);
+				void* ctx = slot.ctx.load(memory_order_acquire);
+				if (fn && ctx) fn(ctx);
+			}
+			// The signal is blocked while the handler runs, it is delivered with the previous action after return
+			sigaction(sig, &crashPrevious[sig], nullptr);
+			raise(sig);
+		}
+
+		inline void installCrashHandler() {
+			struct sigaction action = {};
+			action.sa_handler = crashHandler;
+			sigemptyset(&action.sa_mask);
+			action.sa_flags = SA_ONSTACK;
+			for (int sig : LOG_CRASH_SIGNALS) {
+				sigaction(sig, &action, &crashPrevious[sig]);
+			}
+		}
+	}
+
+	/**
+	 * Register a flush that runs when the process receives a fatal signal (see LOG_CRASH_SIGNALS)
+	 *
+	 * The signal handlers are installed on the first registration,
+	 * after the flushes ran the previously installed action of the signal is restored and the signal re-raised.
+	 * Returns the slot for UnregisterCrashFlush() or -1 if all slots are taken.
+	 */
+	inline int RegisterCrashFlush(void* ctx, LogCrashFlush fn) {
+		call_once(detail::crashInstalled, detail::installCrashHandler);
+		lock_guard<mutex> lock(detail::crashSlotLock);
+		for (size_t i = 0; i < LOG_CRASH_SLOTS; i++) {
+			auto& slot = detail::crashSlots[i];
+			if (slot.ctx.load(memory_order_relaxed)) continue;
+			slot.ctx.store(ctx, memory_order_release);
+			slot.fn.store(fn, memory_order_release);
+			return (int)i;
+		}
+		return -1;
+	}
+
+	/**
+	 * Remove a flush registered with RegisterCrashFlush()
+	 *
+	 * The handlers stay installed, a crash while the flush is removed may still call it.
+	 */
+	inline void UnregisterCrashFlush(int slot) {
+		if (slot < 0 || (size_t)slot >= LOG_CRASH_SLOTS) return;
+		lock_guard<mutex> lock(detail::crashSlotLock);
+		detail::crashSlots[slot].fn.store(nullptr, memory_order_release);
+		detail::crashSlots[slot].ctx.store(nullptr, memory_order_release);
+	}
+};
+
+#endif
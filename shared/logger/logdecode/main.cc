@@ -0,0 +1,89 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Renders a binary log as text or JSON-lines
+ *
+ * ```
+ * logdecode [--json] [--debug] [logfile]
+ * ```
+ *
+ * Reads from stdin if no logfile is specified.
+ */
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include "shared/logger/logformat.hpp"
+
+using namespace std;
+
+int main(int argc, char** argv) {
+	bool json = false;
+	bool debug = false;
+	string path;
+	for (int i = 1; i < argc; i++) {
+		string_view arg(argv[i]);
+		if (arg == "--json") json = true;
+		else if (arg == "--debug") debug = true;
+		else if (arg.starts_with("-")) {
+			cerr << "usage: " << argv[0] << " [--json] [--debug] [logfile]" << endl;
+			return 2;
+		} else path = arg;
+	}
+
+	ifstream file;
+	if (!path.empty()) {
+		file.open(path, ios::binary);
+		if (!file) {
+			cerr << "Failed to open logfile at: " << path << endl;
+			return 1;
+		}
+	}
+	istream& in = path.empty() ? cin : file;
+
+	logger::LogBinaryDecoder decoder;
+	logger::LogTextEncoder textEncoder(debug);
+	logger::LogJsonEncoder jsonEncoder;
+	logger::LogRecord record;
+	string out;
+	try {
+		while (decoder.Next(in, record)) {
+			auto render = [&](string& text) {
+				logger::RenderLogArgs(text, record.callsite->format, record.args);
+			};
+			out.clear();
+			if (json) {
+				jsonEncoder.Append(out, record.loglevel, record.timestamp, record.thread,
+													 record.callsite->file, record.callsite->line, render);
+			} else {
+				textEncoder.Append(out, record.loglevel, record.timestamp,
+													 record.callsite->file, record.callsite->line, render);
+			}
+			cout.write(out.data(), out.size());
+		}
+	} catch (const exception& e) {
+		cout.flush();
+		cerr << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
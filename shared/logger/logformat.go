@@ -0,0 +1,146 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+package logger
+
+import (
+	"encoding/binary"
+	"encoding/json"
+)
+
+// Output format of the log records (same values as in logformat.hpp)
+type LOGFORMAT int
+const (
+	TEXT LOGFORMAT = iota + 1
+	BINARY
+	JSON
+)
+
+// Record types and argument tags of the binary log format (see logformat.hpp)
+const (
+	recordHeader uint8 = 1
+	recordCallsite uint8 = 2
+	recordMessage uint8 = 3
+
+	argString uint8 = 8
+
+	binaryVersion uint16 = 1
+)
+
+var binaryMagic = []byte("CTLG")
+
+type callsiteKey struct {
+	file string
+	line int
+}
+
+// binaryEncoder writes the binary log format of the C++ logger,
+// messages are already formatted in Go, so they are written as single string argument of a "{}" callsite.
+type binaryEncoder struct {
+	callsites map[callsiteKey]uint32
+}
+
+func (e *binaryEncoder) appendHeader(out []byte) []byte {
+	e.callsites = map[callsiteKey]uint32{}
+	start := len(out)
+	out = beginRecord(out, recordHeader)
+	out = append(out, binaryMagic...)
+	out = binary.LittleEndian.AppendUint16(out, binaryVersion)
+	return endRecord(out, start)
+}
+
+func (e *binaryEncoder) append(out []byte, msg *LogMessage) []byte {
+	key := callsiteKey{msg.file, msg.line}
+	id, ok := e.callsites[key]
+	if !ok {
+		id = uint32(len(e.callsites) + 1)
+		e.callsites[key] = id
+		start := len(out)
+		out = beginRecord(out, recordCallsite)
+		out = binary.LittleEndian.AppendUint32(out, id)
+		out = binary.LittleEndian.AppendUint32(out, uint32(msg.line))
+		out = appendString16(out, msg.file)
+		out = appendString16(out, "{}")
+		out = endRecord(out, start)
+	}
+
+	start := len(out)
+	out = beginRecord(out, recordMessage)
+	out = binary.LittleEndian.AppendUint32(out, id)
+	out = append(out, uint8(msg.loglevel))
+	out = binary.LittleEndian.AppendUint64(out, uint64(msg.timestamp.UnixNano()))
+	// Goroutines have no stable thread id
+	out = binary.LittleEndian.AppendUint64(out, 0)
+	out = append(out, 1, argString)
+	out = binary.LittleEndian.AppendUint32(out, uint32(len(msg.message)))
+	out = append(out, msg.message...)
+	return endRecord(out, start)
+}
+
+func appendString16(out []byte, str string) []byte {
+	if len(str) > 0xffff {
+		str = str[:0xffff]
+	}
+	out = binary.LittleEndian.AppendUint16(out, uint16(len(str)))
+	return append(out, str...)
+}
+
+func beginRecord(out []byte, recordType uint8) []byte {
+	// Size is patched by endRecord
+	out = binary.LittleEndian.AppendUint32(out, 0)
+	return append(out, recordType)
+}
+
+func endRecord(out []byte, start int) []byte {
+	binary.LittleEndian.PutUint32(out[start:], uint32(len(out)-start-4))
+	return out
+}
+
+type jsonRecord struct {
+	Timestamp int64 `json:"timestamp"`
+	Level string `json:"level"`
+	Thread uint64 `json:"thread"`
+	File string `json:"file"`
+	Line int `json:"line"`
+	Message string `json:"message"`
+}
+
+// appendJson writes the JSON-lines format of the C++ logger
+func appendJson(out []byte, msg *LogMessage) []byte {
+	record, _ := json.Marshal(jsonRecord{
+		Timestamp: msg.timestamp.UnixNano(),
+		Level: levelName(msg.loglevel),
+		File: msg.file,
+		Line: msg.line,
+		Message: msg.message,
+	})
+	out = append(out, record...)
+	return append(out, '\n')
+}
+
+func levelName(level LOGLEVEL) string {
+	switch level {
+	case ERROR:
+		return "ERROR"
+	case WARN:
+		return "WARN"
+	default:
+		return "INFO"
+	}
+}
@@ -0,0 +1,587 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOGFORMAT_H
+#define LOGFORMAT_H
+
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <functional>
+#include <istream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "shared/logger/logmessage.hpp"
+#include "shared/logger/logsink.hpp"
+
+using namespace std;
+
+namespace logger {
+
+	/**
+	 * Output format of the log records
+	 */
+	enum LOGFORMAT {
+		// Human readable multi-line records
+		TEXT = 1,
+		// Compact length-prefixed records, rendered offline with the logdecode tool
+		BINARY = 2,
+		// One JSON object per line
+		JSON = 3,
+	};
+
+	/**
+	 * Binary log format
+	 *
+	 * A binary log is a sequence of records, all integers are little-endian:
+	 *
+	 * ```
+	 * record   := u32 size | u8 type | body           (size counts type and body)
+	 * HEADER   := char[4] magic | u16 version
+	 * CALLSITE := u32 id | u32 line | u16 len | file | u16 len | format
+	 * MESSAGE  := u32 callsite | u8 level | i64 timestamp (ns) | u64 thread | u8 argc | args
+	 * ```
+	 *
+	 * Every writer starts with a HEADER, which resets the callsite ids.
+	 * A CALLSITE is written once before the first MESSAGE that refers to it,
+	 * so file, line and format string are not repeated per message.
+	 * The args are encoded like the LogMessage payload (see LOGARGTYPE),
+	 * the format string is a std::format string that is rendered when the log is decoded.
+	 *
+	 * Unknown record types are skipped by the decoder.
+	 */
+	enum LOGRECORDTYPE : uint8_t {
+		RECORD_HEADER = 1,
+		RECORD_CALLSITE = 2,
+		RECORD_MESSAGE = 3,
+	};
+
+	inline constexpr char LOG_BINARY_MAGIC[4] = {'C', 'T', 'L', 'G'};
+	inline constexpr uint16_t LOG_BINARY_VERSION = 1;
+	// Upper bound of a record, larger sizes are treated as corrupt data
+	inline constexpr uint32_t LOG_MAX_RECORD_SIZE = 1 << 24;
+
+	/**
+	 * Get the banner of the loglevel
+	 */
+	inline string_view LogLevelBanner(LOGLEVEL level) {
+		switch (level) {
+		case ERROR:
+			return "[ ERROR ]:\n";
+		case WARN:
+			return "[ WARN ]:\n";
+		default:
+			return "[ INFO ]:\n";
+		}
+	}
+
+	/**
+	 * Get the name of the loglevel
+	 */
+	inline string_view LogLevelName(LOGLEVEL level) {
+		switch (level) {
+		case ERROR:
+			return "ERROR";
+		case WARN:
+			return "WARN";
+		default:
+			return "INFO";
+		}
+	}
+
+	namespace detail {
+		template <typename T>
+		void appendRaw(string& out, T val) {
+			out.append((const char*)&val, sizeof(val));
+		}
+
+		/**
+		 * Append the string as JSON string literal
+		 */
+		inline void appendJsonString(string& out, string_view str) {
+			out += '"';
+			size_t start = 0;
+			for (size_t i = 0; i < str.size(); i++) {
+				unsigned char c = str[i];
+				if (c >= 0x20 && c != '"' && c != '\\') continue;
+				out.append(str.substr(start, i - start));
+				switch (c) {
+				case '"': out += "\\\""; break;
+				case '\\': out += "\\\\"; break;
+				case '\n': out += "\\n"; break;
+				case '\r': out += "\\r"; break;
+				case '\t': out += "\\t"; break;
+				default: format_to(back_inserter(out), "\\u{:04x}", (unsigned)c);
+				}
+				start = i + 1;
+			}
+			out.append(str.substr(start));
+			out += '"';
+		}
+
+		/**
+		 * Bounds checked reader over a record body
+		 */
+		struct recordreader {
+			const char* p;
+			const char* end;
+
+			template <typename T>
+			T read() {
+				T val;
+				memcpy(&val, bytes(sizeof(T)).data(), sizeof(T));
+				return val;
+			}
+
+			string_view bytes(size_t len) {
+				if ((size_t)(end - p) < len) {
+					throw runtime_error("Corrupt log record: field exceeds the record size");
+				}
+				string_view str(p, len);
+				p += len;
+				return str;
+			}
+		};
+	}
+
+	/**
+	 * Renders text records
+	 *
+	 * ```
+	 * [ 12:00:00 - 01.01.2024 ]
+	 * [ INFO ]:
+	 * message
+	 * [ RUNTIME INFORMATION ]:    (only with debuginfo)
+	 * |-[ LOG CALLER STACK ]: Line (1) File (main.cc)
+	 * ```
+	 */
+	class LogTextEncoder {
+	public:
+		explicit LogTextEncoder(bool debug) : debug(debug) {}
+
+		/**
+		 * Append a record to `out`, `render` appends the message text to the string passed to it
+		 */
+		template <typename Render>
+		void Append(string& out, LOGLEVEL level, int64_t timestamp, string_view file, int line, Render&& render) {
+			out += timestampCache.Format(timestamp);
+			out += LogLevelBanner(level);
+			render(out);
+			out += '\n';
+			if (debug) {
+				out += "[ RUNTIME INFORMATION ]:\n";
+				format_to(back_inserter(out), "|-[ LOG CALLER STACK ]: Line ({}) File ({})\n", line, file);
+			}
+			out += '\n';
+		}
+
+		void Append(string& out, const LogMessage& msg) {
+			Append(out, msg.loglevel, msg.timestamp, msg.file, msg.line, [&](string& text) {
+				if (msg.render) msg.render(msg, text);
+			});
+		}
+
+	private:
+		bool debug;
+		LogTimestamp timestampCache;
+	};
+
+	/**
+	 * Renders JSON-lines records
+	 *
+	 * ```
+	 * {"timestamp":1704067200000000000,"level":"INFO","thread":42,"file":"main.cc","line":1,"message":"..."}
+	 * ```
+	 */
+	class LogJsonEncoder {
+	public:
+		/**
+		 * Append a record to `out`, `render` appends the message text to the string passed to it
+		 */
+		template <typename Render>
+		void Append(string& out, LOGLEVEL level, int64_t timestamp, uint64_t thread,
+								string_view file, int line, Render&& render) {
+			messageBuffer.clear();
+			render(messageBuffer);
+			format_to(back_inserter(out), "{{\"timestamp\":{},\"level\":\"{}\",\"thread\":{},\"file\":",
+								timestamp, LogLevelName(level), thread);
+			detail::appendJsonString(out, file);
+			format_to(back_inserter(out), ",\"line\":{},\"message\":", line);
+			detail::appendJsonString(out, messageBuffer);
+			out += "}\n";
+		}
+
+		void Append(string& out, const LogMessage& msg) {
+			Append(out, msg.loglevel, msg.timestamp, msg.thread, msg.file, msg.line, [&](string& text) {
+				if (msg.render) msg.render(msg, text);
+			});
+		}
+
+	private:
+		string messageBuffer;
+	};
+
+	/**
+	 * Encodes LogMessages into the binary log format
+	 *
+	 * The message text is not rendered, the payload of the LogMessage is written as is.
+	 * The encoder remembers which callsites were written, call AppendHeader() when starting a new file.
+	 */
+	class LogBinaryEncoder {
+	public:
+		/**
+		 * Append the HEADER record and forget all written callsites
+		 */
+		void AppendHeader(string& out) {
+			callsites.clear();
+			nextCallsiteId = 1;
+			size_t start = beginRecord(out, RECORD_HEADER);
+			out.append(LOG_BINARY_MAGIC, sizeof(LOG_BINARY_MAGIC));
+			detail::appendRaw<uint16_t>(out, LOG_BINARY_VERSION);
+			endRecord(out, start);
+		}
+
+		/**
+		 * Append the MESSAGE record (and the CALLSITE record if the callsite is new)
+		 */
+		void Append(string& out, const LogMessage& msg) {
+			bool eager = msg.render == &detail::renderFormatted;
+			uint32_t callsite = callsiteId(out, msg, eager);
+
+			size_t start = beginRecord(out, RECORD_MESSAGE);
+			detail::appendRaw<uint32_t>(out, callsite);
+			detail::appendRaw<uint8_t>(out, msg.loglevel);
+			detail::appendRaw<int64_t>(out, msg.timestamp);
+			detail::appendRaw<uint64_t>(out, msg.thread);
+			if (eager) {
+				// Eagerly formatted messages are written as single string argument of a "{}" callsite
+				detail::appendRaw<uint8_t>(out, 1);
+				detail::appendRaw<uint8_t>(out, ARG_STRING);
+				detail::appendRaw<uint32_t>(out, msg.message.size());
+				out += msg.message;
+			} else {
+				detail::appendRaw<uint8_t>(out, msg.argCount);
+				out.append(msg.payload, msg.payloadSize);
+			}
+			endRecord(out, start);
+		}
+
+	private:
+		struct callsitekey {
+			const char* format;
+			const char* file;
+			int line;
+			bool eager;
+
+			bool operator==(const callsitekey&) const = default;
+		};
+
+		struct callsitehash {
+			size_t operator()(const callsitekey& key) const {
+				size_t h = hash<const void*>()(key.format);
+				h ^= hash<const void*>()(key.file) + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+				h ^= hash<int>()(key.line * 2 + key.eager) + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+				return h;
+			}
+		};
+
+		// Format strings are literals, so the callsites are identified by the addresses
+		unordered_map<callsitekey, uint32_t, callsitehash> callsites;
+		uint32_t nextCallsiteId = 1;
+
+		uint32_t callsiteId(string& out, const LogMessage& msg, bool eager) {
+			callsitekey key{msg.format.data(), msg.file, msg.line, eager};
+			auto it = callsites.find(key);
+			if (it != callsites.end()) return it->second;
+
+			uint32_t id = nextCallsiteId++;
+			callsites.emplace(key, id);
+			string_view file = string_view(msg.file).substr(0, UINT16_MAX);
+			string_view format = (eager ? string_view("{}") : msg.format).substr(0, UINT16_MAX);
+
+			size_t start = beginRecord(out, RECORD_CALLSITE);
+			detail::appendRaw<uint32_t>(out, id);
+			detail::appendRaw<uint32_t>(out, msg.line);
+			detail::appendRaw<uint16_t>(out, file.size());
+			out.append(file);
+			detail::appendRaw<uint16_t>(out, format.size());
+			out.append(format);
+			endRecord(out, start);
+			return id;
+		}
+
+		static size_t beginRecord(string& out, LOGRECORDTYPE type) {
+			size_t start = out.size();
+			// Size is patched by endRecord
+			detail::appendRaw<uint32_t>(out, 0);
+			detail::appendRaw<uint8_t>(out, type);
+			return start;
+		}
+
+		static void endRecord(string& out, size_t start) {
+			uint32_t size = out.size() - start - sizeof(uint32_t);
+			memcpy(out.data() + start, &size, sizeof(size));
+		}
+	};
+
+	/**
+	 * Decoded log argument
+	 */
+	using LogArg = variant<bool, char, long long, unsigned long long, float, double, const void*, string>;
+
+	/**
+	 * Decoded callsite
+	 */
+	struct LogCallsite {
+		string file;
+		int line = 0;
+		string format;
+	};
+
+	/**
+	 * Decoded MESSAGE record
+	 *
+	 * The callsite is owned by the decoder and valid until the next call to Next().
+	 */
+	struct LogRecord {
+		LOGLEVEL loglevel = INFO;
+		int64_t timestamp = 0;
+		uint64_t thread = 0;
+		const LogCallsite* callsite = nullptr;
+		vector<LogArg> args;
+	};
+
+	namespace detail {
+		/**
+		 * Parse the explicit argument index of a field, returns `invalid` if it is not a number
+		 */
+		inline size_t parseArgIndex(string_view index, size_t invalid) {
+			size_t argIndex = 0;
+			for (char c : index) {
+				if (c < '0' || c > '9') return invalid;
+				argIndex = argIndex * 10 + (c - '0');
+			}
+			return argIndex;
+		}
+	}
+
+	/**
+	 * Render the format string with the decoded arguments
+	 *
+	 * The format string is walked at runtime and every replacement field is formatted on its own.
+	 * Nested fields in the spec (dynamic width / precision like "{:{}}" or "{:.{}f}") consume
+	 * their arguments like std::format does and are replaced by the integer value before formatting.
+	 * Fields that can not be formatted are copied as is.
+	 */
+	inline void RenderLogArgs(string& out, string_view format, const vector<LogArg>& args) {
+		size_t nextArg = 0;
+		size_t i = 0;
+		while (i < format.size()) {
+			size_t brace = format.find_first_of("{}", i);
+			if (brace == string_view::npos) {
+				out.append(format.substr(i));
+				return;
+			}
+			out.append(format.substr(i, brace - i));
+			// Escaped braces
+			if (brace + 1 < format.size() && format[brace + 1] == format[brace]) {
+				out += format[brace];
+				i = brace + 2;
+				continue;
+			}
+			if (format[brace] == '}') {
+				out += '}';
+				i = brace + 1;
+				continue;
+			}
+			// Find the end of the field, specs may contain nested fields
+			size_t end = brace + 1;
+			for (int depth = 1; end < format.size(); end++) {
+				if (format[end] == '{') depth++;
+				else if (format[end] == '}' && --depth == 0) break;
+			}
+			if (end >= format.size()) {
+				out.append(format.substr(brace));
+				return;
+			}
+			string_view field = format.substr(brace + 1, end - brace - 1);
+			string_view raw = format.substr(brace, end - brace + 1);
+			i = end + 1;
+
+			size_t colon = field.find(':');
+			string_view index = field.substr(0, colon);
+			// The field takes its argument before the nested fields take theirs
+			size_t argIndex = index.empty() ? nextArg++ : detail::parseArgIndex(index, args.size());
+			bool valid = argIndex < args.size();
+
+			string spec = "{";
+			if (colon != string_view::npos) {
+				string_view specs = field.substr(colon);
+				size_t j = 0;
+				while (j < specs.size()) {
+					size_t open = specs.find('{', j);
+					if (open == string_view::npos) {
+						spec += specs.substr(j);
+						break;
+					}
+					spec += specs.substr(j, open - j);
+					size_t close = specs.find('}', open);
+					if (close == string_view::npos) {
+						valid = false;
+						break;
+					}
+					string_view nested = specs.substr(open + 1, close - open - 1);
+					size_t nestedIndex = nested.empty() ? nextArg++ : detail::parseArgIndex(nested, args.size());
+					j = close + 1;
+					// Width and precision must be non-negative integers
+					if (nestedIndex >= args.size()) {
+						valid = false;
+					} else if (auto* value = get_if<long long>(&args[nestedIndex]); value && *value >= 0) {
+						spec += to_string(*value);
+					} else if (auto* value = get_if<unsigned long long>(&args[nestedIndex])) {
+						spec += to_string(*value);
+					} else {
+						valid = false;
+					}
+				}
+			}
+			spec += '}';
+			if (!valid) {
+				out.append(raw);
+				continue;
+			}
+			visit([&](const auto& arg) {
+				size_t mark = out.size();
+				try {
+					vformat_to(back_inserter(out), spec, make_format_args(arg));
+				} catch (const format_error&) {
+					out.resize(mark);
+					out.append(raw);
+				}
+			}, args[argIndex]);
+		}
+	}
+
+	/**
+	 * Decodes a binary log stream
+	 */
+	class LogBinaryDecoder {
+	public:
+		/**
+		 * Read the next MESSAGE record from the stream
+		 *
+		 * HEADER and CALLSITE records are consumed internally.
+		 * Returns false at the end of the stream, throws runtime_error on corrupt or truncated data.
+		 */
+		bool Next(istream& in, LogRecord& record) {
+			while (true) {
+				uint32_t size;
+				if (!in.read((char*)&size, sizeof(size))) {
+					if (in.gcount() == 0) return false;
+					throw runtime_error("Truncated log record");
+				}
+				if (size == 0 || size > LOG_MAX_RECORD_SIZE) {
+					throw runtime_error("Corrupt log record: invalid size");
+				}
+				body.resize(size);
+				if (!in.read(body.data(), size)) {
+					throw runtime_error("Truncated log record");
+				}
+
+				detail::recordreader reader{body.data(), body.data() + body.size()};
+				uint8_t type = reader.read<uint8_t>();
+				if (type == RECORD_HEADER) {
+					if (reader.bytes(sizeof(LOG_BINARY_MAGIC)) != string_view(LOG_BINARY_MAGIC, sizeof(LOG_BINARY_MAGIC))) {
+						throw runtime_error("Not a binary log: invalid magic");
+					}
+					uint16_t version = reader.read<uint16_t>();
+					if (version > LOG_BINARY_VERSION) {
+						throw runtime_error(format("Unsupported binary log version: {}", version));
+					}
+					callsites.clear();
+					headerRead = true;
+					continue;
+				}
+				if (!headerRead) {
+					throw runtime_error("Not a binary log: missing header");
+				}
+				if (type == RECORD_CALLSITE) {
+					uint32_t id = reader.read<uint32_t>();
+					LogCallsite& callsite = callsites[id];
+					callsite.line = reader.read<uint32_t>();
+					callsite.file = reader.bytes(reader.read<uint16_t>());
+					callsite.format = reader.bytes(reader.read<uint16_t>());
+					continue;
+				}
+				if (type == RECORD_MESSAGE) {
+					decodeMessage(reader, record);
+					return true;
+				}
+			}
+		}
+
+	private:
+		bool headerRead = false;
+		unordered_map<uint32_t, LogCallsite> callsites;
+		vector<char> body;
+
+		void decodeMessage(detail::recordreader& reader, LogRecord& record) {
+			auto it = callsites.find(reader.read<uint32_t>());
+			if (it == callsites.end()) {
+				throw runtime_error("Corrupt log record: unknown callsite");
+			}
+			record.callsite = &it->second;
+			record.loglevel = (LOGLEVEL)reader.read<uint8_t>();
+			record.timestamp = reader.read<int64_t>();
+			record.thread = reader.read<uint64_t>();
+			record.args.clear();
+			uint8_t argCount = reader.read<uint8_t>();
+			for (uint8_t i = 0; i < argCount; i++) {
+				switch (reader.read<uint8_t>()) {
+				case ARG_BOOL: {
+					// Any byte other than 0 or 1 is not a valid bool representation
+					uint8_t value = reader.read<uint8_t>();
+					if (value > 1) {
+						throw runtime_error("Corrupt log record: invalid bool argument");
+					}
+					record.args.emplace_back(value == 1);
+					break;
+				}
+				case ARG_CHAR: record.args.emplace_back(reader.read<char>()); break;
+				case ARG_INT: record.args.emplace_back(reader.read<long long>()); break;
+				case ARG_UINT: record.args.emplace_back(reader.read<unsigned long long>()); break;
+				case ARG_FLOAT: record.args.emplace_back(reader.read<float>()); break;
+				case ARG_DOUBLE: record.args.emplace_back(reader.read<double>()); break;
+				case ARG_POINTER: record.args.emplace_back(reader.read<const void*>()); break;
+				case ARG_STRING: record.args.emplace_back(string(reader.bytes(reader.read<uint32_t>()))); break;
+				default:
+					throw runtime_error("Corrupt log record: unknown argument type");
+				}
+			}
+		}
+	};
+};
+
+#endif
@@ -27,17 +27,20 @@ import (
 	"runtime"
 )
 
+// Values match the C++ logger, they are written to binary logs
 type LOGLEVEL int
 const (
-	ERROR LOGLEVEL = iota
+	ERROR LOGLEVEL = iota + 1
 	WARN
 	INFO
 )
 
 type LogMessage struct {
 	message string
-	debuginfo string
+	file string
+	line int
 	loglevel LOGLEVEL
+	timestamp time.Time
 }
 
 type Logger struct {
@@ -47,9 +50,17 @@ type Logger struct {
 	logDebug bool
 	logChanThreshold int
 	logChan chan *LogMessage
+	logFormat LOGFORMAT
+	binaryEncoder binaryEncoder
 }
 
 func InitLogger(logLevel LOGLEVEL, logPath string, logToStd bool, logDebug bool, logQueueSize int8) error {
+	return InitLoggerWithFormat(logLevel, logPath, logToStd, logDebug, logQueueSize, TEXT)
+}
+
+// InitLoggerWithFormat initializes the logger with the logfile format of the C++ logger (see logformat.hpp),
+// binary logs can be rendered with the logdecode tool. Std output is written as TEXT if the logfile is BINARY.
+func InitLoggerWithFormat(logLevel LOGLEVEL, logPath string, logToStd bool, logDebug bool, logQueueSize int8, logFormat LOGFORMAT) error {
 	// Create Logfile path if not existent
 	logPathParent, _ := filepath.Split(logPath)
 	if err := os.MkdirAll(logPathParent, 0755); err!=nil {
@@ -69,6 +80,11 @@ func InitLogger(logLevel LOGLEVEL, logPath string, logToStd bool, logDebug bool,
 	// Queue threshold is set to 50%. If it goes beyond, this is already very critical
 	logger.logChanThreshold = int(logQueueSize) / 2
 	logger.logChan = make(chan *LogMessage, logQueueSize)
+	logger.logFormat = logFormat
+	if logFormat == BINARY {
+		// Every logger session starts with a header, so appended sessions can be decoded
+		logger.logFile.Write(logger.binaryEncoder.appendHeader(nil))
+	}
 
 	logger.startLogWorker()
 	
@@ -81,75 +97,82 @@ func (l* Logger) CloseLogger() {
 }
 
 func (l* Logger) LogError(msg string) {
-	debuginfo := ""
-	if l.logDebug {
-		debuginfo = l.getDebugInfo(2)
-	}
-	l.logChan<-&LogMessage{msg, debuginfo, ERROR}
+	l.logChan<-l.newMessage(msg, ERROR, 2)
 }
 
 func (l* Logger) LogWarn(msg string) {
 	if l.logLevel>ERROR {
-		debuginfo := ""
-		if l.logDebug {
-			debuginfo = l.getDebugInfo(2)
-		}
-		l.logChan<-&LogMessage{msg, debuginfo, WARN}
+		l.logChan<-l.newMessage(msg, WARN, 2)
 	}
 }
 
 func (l* Logger) LogInfo(msg string) {
 	if l.logLevel>WARN {
-		debuginfo := ""
-		if l.logDebug {
-			debuginfo = l.getDebugInfo(2)
+		l.logChan<-l.newMessage(msg, INFO, 2)
+	}
+}
+
+func (l* Logger) newMessage(msg string, loglevel LOGLEVEL, stackdepth int) *LogMessage {
+	logMsg := &LogMessage{message: msg, loglevel: loglevel, timestamp: time.Now()}
+	// Binary and JSON records always carry the caller, text records only with debuginfo
+	if l.logDebug || l.logFormat == BINARY || l.logFormat == JSON {
+		// Get stack information from the callerstack + stackdepth
+		_, file, line, ok := runtime.Caller(stackdepth)
+		if ok {
+			logMsg.file = file
+			logMsg.line = line
 		}
-		l.logChan<-&LogMessage{msg, debuginfo, INFO}
 	}
+	return logMsg
 }
 
-func (l* Logger) getDebugInfo(stackdepth int) string {
+func (l* Logger) getDebugInfo(msg *LogMessage) string {
 	debuginfo := "[ RUNTIME INFORMATION ]:\n"
-	// Get stack information from the callerstack + stackdepth
-	_, file, line, ok := runtime.Caller(stackdepth+1)
-	if ok {
-		debuginfo += fmt.Sprintf("|-[ LOG CALLER STACK ]: Line (%d) File (%s)\n", line, file)
+	if msg.file != "" {
+		debuginfo += fmt.Sprintf("|-[ LOG CALLER STACK ]: Line (%d) File (%s)\n", msg.line, msg.file)
 	}
 	return debuginfo
 }
 
-func (l* Logger) log(msg *LogMessage) {
-	outstr := time.Now().Format("\n[ 05:04:15 - 02.01.2006 ]\n")
+func (l* Logger) formatText(msg *LogMessage) []byte {
+	outstr := msg.timestamp.Format("\n[ 05:04:15 - 02.01.2006 ]\n")
 	switch msg.loglevel {
 	case ERROR:
 		outstr += "[ ERROR ]:\n"
-		outstr += msg.message
-		outstr += "\n"
-		outstr += msg.debuginfo
-		outstr += "\n"
-		l.logFile.Write([]byte(outstr))
-		if l.logToStd {
-			os.Stderr.Write([]byte(outstr))
-		}
 	case WARN:
 		outstr += "[ WARNING ]:\n"
-		outstr += msg.message
-		outstr += "\n"
-		outstr += msg.debuginfo
-		outstr += "\n"
-		l.logFile.Write([]byte(outstr))
-		if l.logToStd {
-			os.Stderr.Write([]byte(outstr))
-		}
-	case INFO:
+	default:
 		outstr += "[ INFORMATION ]:\n"
-		outstr += msg.message
-		outstr += "\n"
-		outstr += msg.debuginfo
-		outstr += "\n"
-		l.logFile.Write([]byte(outstr))
-		if l.logToStd {
-			os.Stdout.Write([]byte(outstr))
+	}
+	outstr += msg.message
+	outstr += "\n"
+	if l.logDebug {
+		outstr += l.getDebugInfo(msg)
+	}
+	outstr += "\n"
+	return []byte(outstr)
+}
+
+func (l* Logger) log(msg *LogMessage) {
+	var out []byte
+	switch l.logFormat {
+	case BINARY:
+		out = l.binaryEncoder.append(nil, msg)
+	case JSON:
+		out = appendJson(nil, msg)
+	default:
+		out = l.formatText(msg)
+	}
+	l.logFile.Write(out)
+	if l.logToStd {
+		// Binary records are not readable on a terminal
+		if l.logFormat == BINARY {
+			out = l.formatText(msg)
+		}
+		if msg.loglevel == INFO {
+			os.Stdout.Write(out)
+		} else {
+			os.Stderr.Write(out)
 		}
 	}
 }
@@ -161,11 +184,7 @@ func (l* Logger) startLogWorker() {
 		case msg, ok := <-l.logChan:
 			if ok {
 				if len(l.logChan) > l.logChanThreshold {
-					l.log(&LogMessage{
-						"Log Queue is under high pressure!",
-						l.getDebugInfo(1),
-						WARN,
-					})
+					l.log(l.newMessage("Log Queue is under high pressure!", WARN, 1))
 				}
 				l.log(msg)
 			} else {
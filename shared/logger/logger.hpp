@@ -20,230 +20,759 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
-#include <ctime>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
-#include <iomanip>
 #include <stdexcept>
-#include <fstream>
 #include <string>
+#include <sys/stat.h>
 #include <format>
-#include <iostream>
+#include <memory_resource>
+#include <mutex>
 #include <thread>
+#include <unistd.h>
+#include <vector>
 
+#include "shared/logger/logcrash.hpp"
+#include "shared/logger/logformat.hpp"
+#include "shared/logger/logmessage.hpp"
+#include "shared/logger/logratelimit.hpp"
+#include "shared/logger/logrotate.hpp"
+#include "shared/logger/logsink.hpp"
+#include "shared/metrics/metrics.hpp"
 #include "shared/util/chan.hpp"
+#include "shared/util/ringchan.hpp"
+#include "shared/util/threadchan.hpp"
+#include "shared/util/trace.hpp"
 
 using namespace std;
 
 namespace logger {
 
-	enum LOGLEVEL {
-		ERROR = 1,
-		WARN = 2,
-		INFO = 3,
+	// Maximum number of messages the worker fetches per wakeup if the queue is unbounded
+	inline constexpr size_t LOG_BATCH_SIZE = 256;
+
+	// Highest level compiled into the loggers, compile with -DCTHULHU_LOG_LEVEL=1 (ERROR) or 2 (WARN)
+	// to remove the calls of higher levels (bazel build --define log_level=error|warn)
+#ifdef CTHULHU_LOG_LEVEL
+	inline constexpr LOGLEVEL LOG_COMPILED_LEVEL = static_cast<LOGLEVEL>(CTHULHU_LOG_LEVEL);
+#else
+	inline constexpr LOGLEVEL LOG_COMPILED_LEVEL = INFO;
+#endif
+
+	// Compile with -DCTHULHU_LOG_STD_DISABLED to remove the std output of the loggers (bazel build --define log_std=false)
+#ifdef CTHULHU_LOG_STD_DISABLED
+	inline constexpr bool LOG_COMPILED_STD = false;
+#else
+	inline constexpr bool LOG_COMPILED_STD = true;
+#endif
+
+	/**
+	 * Optional settings of the Logger
+	 */
+	struct LogOptions {
+		// Buffering of the log output
+		LogFlushPolicy Flush;
+		// Format of the logfile (std output is written as TEXT if the logfile is BINARY)
+		LOGFORMAT Format = TEXT;
+		// Rotation and retention of the logfile
+		LogRotationPolicy Rotation;
+		// Rate limiting and deduplication of repeated messages
+		LogRateLimit RateLimit;
+		// Maximum time Close() (and the destructor) spends writing the queued messages
+		chrono::milliseconds CloseTimeout = chrono::milliseconds(5000);
+		// Write the buffered output if the process receives a fatal signal (see RegisterCrashFlush)
+		bool CrashFlush = false;
 	};
 
-	struct LogMessage {
-		string message;
-		string debuginfo;
-		LOGLEVEL loglevel;
-	}; 
+	/**
+	 * Asynchronous logger that writes messages on a seperate worker thread
+	 *
+	 * The LogChan template parameter selects the queue between the callers and the worker.
+	 * It must provide the push() / get_batch() / get_batch_until() / drain() / shutdown() / close() / isclosed()
+	 * interface of util::chan and has to support multiple writers (the worker is the only reader).
+	 *
+	 * Use the Logger (util::chan), RingLogger (lock-free util::mpscchan) or ThreadLogger (util::threadchan) alias.
+	 *
+	 * MaxLevel and StdOutput remove levels and the std output at compile time (the runtime settings can only
+	 * restrict them further). Calls of removed levels compile to nothing, their arguments are still evaluated.
+	 * The aliases use LOG_COMPILED_LEVEL and LOG_COMPILED_STD, so release builds can strip them with a define.
+	 */
+	template <typename LogChan, LOGLEVEL MaxLevel = LOG_COMPILED_LEVEL, bool StdOutput = LOG_COMPILED_STD>
+	class BasicLogger {
+		static_assert(MaxLevel >= ERROR && MaxLevel <= INFO, "MaxLevel must be ERROR, WARN or INFO");
 
-	class Logger {
 	public:
-		Logger(LOGLEVEL logLevel, string logPath, bool logToStd, bool logDebug, int logQueueThreshold) {
-			// Create Logfile path if not existent
-			filesystem::create_directories(filesystem::path(logPath).parent_path());
-			// Before logger is initalized, errors are just thrown to top level
-			logFile.open(logPath, ios::out | ios::app);
-			if (!logFile.is_open()) {
-				throw runtime_error("Failed to open logfile at: " + logPath);
-			}
-
-			this->logToStd = logToStd;
-			this->logDebug = logDebug;
-			this->logLevel = logLevel;
-			// Queue threshold is halved to mimic the Go logger behavior, the C++ channel can grow indefinitely.
-			// The threshold is only for defining a warn-threshold after which a warning is emitted.
-			this->logChanThreshold = logQueueThreshold / 2;
-
-			startLogWorker();
+		BasicLogger(LOGLEVEL logLevel, string logPath, bool logToStd, bool logDebug, int logQueueSize,
+								LogOptions options = LogOptions())
+			: state(make_shared<logstate>(logLevel, logPath, logToStd, logDebug, logQueueSize, options)) {
+			state->startLogWorker();
+			if (options.CrashFlush) {
+				crashSlot = RegisterCrashFlush(state.get(), [](void* ctx) noexcept {
+					static_cast<logstate*>(ctx)->emergencyFlush();
+				});
+			}
 		}
-		virtual ~Logger() {
-			closeLogWorker();
-			logFile.close();
+		virtual ~BasicLogger() {
+			Close();
+			UnregisterCrashFlush(crashSlot);
+		}
+
+		/**
+		 * Stop the logger, queued messages are written and flushed before the worker exits
+		 *
+		 * Messages logged after Close() are dropped.
+		 * Draining is bounded by LogOptions::CloseTimeout, messages still queued after the timeout are dropped.
+		 * Dropped messages are counted as lines_dropped.
+		 *
+		 * Close() returns at the latest after the timeout, also if the worker is blocked in a write (e.g. a full pipe):
+		 * the worker is then abandoned, it keeps the state (and the logFd) alive until its write returns.
+		 *
+		 * Returns false if messages were dropped because of the timeout.
+		 * Called by the destructor, calling it multiple times is allowed.
+		 */
+		bool Close() {
+			return state->close();
+		}
+
+		/**
+		 * Write the buffered output to the file descriptors, async-signal-safe
+		 *
+		 * Intended for crash handlers (enable LogOptions::CrashFlush to register it for fatal signals).
+		 * It does not lock anything, output the worker writes at the same time may appear twice.
+		 * Messages still queued are not written, because they are not rendered yet.
+		 */
+		void EmergencyFlush() noexcept {
+			state->emergencyFlush();
 		}
 
 		/**
 		 * Log an error
 		 *
-		 * FILE and LINE parameters are debuginfos and must be set to the respective C++ macros
-		 * at the stack where you want to get the information from.
+		 * The message is specified as std::format string, which is checked against the arguments at compile time.
+		 * Formatting is deferred to the log worker, the caller only captures the arguments (see LogMessage).
 		 *
-		 * FILE=__FILE__
-		 * LINE=__LINE__
+		 * The source location of the caller is captured automatically as debuginfo.
 		 */
-		void LogError(string msg, const string FILE, const int LINE) {
-			string debuginfo;
-			if (logDebug) {
-				debuginfo = getDebugInfo(FILE, LINE);
-			}
-			logChan.push({msg, debuginfo, ERROR});
+		template <typename... Args>
+		void LogError(LogFormat<type_identity_t<Args>...> fmt, Args&&... args) {
+			state->enqueue(ERROR, fmt.loc, fmt.fmt.get(), args...);
 		}
 
 		/**
 		 * Log a warning
 		 *
-		 * FILE and LINE parameters are debuginfos and must be set to the respective C++ macros
-		 * at the stack where you want to get the information from.
+		 * The message is specified as std::format string, which is checked against the arguments at compile time.
+		 * Formatting is deferred to the log worker, the caller only captures the arguments (see LogMessage).
 		 *
-		 * FILE=__FILE__
-		 * LINE=__LINE__
+		 * The source location of the caller is captured automatically as debuginfo.
 		 */
-		void LogWarn(string msg, const string FILE, const int LINE) {
-			if (logLevel>ERROR) {
-				string debuginfo;
-				if (logDebug) {
-					debuginfo = getDebugInfo(FILE, LINE);
+		template <typename... Args>
+		void LogWarn(LogFormat<type_identity_t<Args>...> fmt, Args&&... args) {
+			if constexpr (MaxLevel >= WARN) {
+				if (state->logLevel>ERROR) {
+					state->enqueue(WARN, fmt.loc, fmt.fmt.get(), args...);
 				}
-				logChan.push({msg, debuginfo, WARN});
 			}
 		}
 
 		/**
 		 * Log a information
 		 *
-		 * FILE and LINE parameters are debuginfos and must be set to the respective C++ macros
-		 * at the stack where you want to get the information from.
+		 * The message is specified as std::format string, which is checked against the arguments at compile time.
+		 * Formatting is deferred to the log worker, the caller only captures the arguments (see LogMessage).
 		 *
-		 * FILE=__FILE__
-		 * LINE=__LINE__
+		 * The source location of the caller is captured automatically as debuginfo.
 		 */
-		void LogInfo(string msg, const string FILE, const int LINE) {
-			if (logLevel>WARN) {
-				string debuginfo;
-				if (logDebug) {
-					debuginfo = getDebugInfo(FILE, LINE);
+		template <typename... Args>
+		void LogInfo(LogFormat<type_identity_t<Args>...> fmt, Args&&... args) {
+			if constexpr (MaxLevel >= INFO) {
+				if (state->logLevel>WARN) {
+					state->enqueue(INFO, fmt.loc, fmt.fmt.get(), args...);
 				}
-				logChan.push({msg, debuginfo, INFO});
 			}
 		}
 
-	private:
-		LOGLEVEL logLevel;
-		ofstream logFile;
-		bool logToStd;
-		bool logDebug;
-		int logChanThreshold;
-		util::chan<LogMessage> logChan;
-		// C++ IO operations like writes to ofstream are not thread-safe
-		// This lock synchronizes every io operation (writes to stdout / disk).
-		mutex ioMutex;
-		
 		/**
-		 * Get and format debuginformation
+		 * Write the metrics of the logger, the metrics are named `<prefix>_...`
 		 *
-		 * FILE and LINE parameters are debuginfos and must be set to the respective C++ macros
-		 * at the stack where you want to get the information from.
+		 * This is thread-safe, register it as metrics::MetricCollector to export it:
 		 *
-		 * FILE=__FILE__
-		 * LINE=__LINE__
+		 * ```
+		 * registry.Register([&](metrics::MetricWriter& writer) { logger.WriteMetrics(writer); });
+		 * ```
 		 */
-		string getDebugInfo(const string FILE, const int LINE) {
-			string debuginfo = "[ RUNTIME INFORMATION ]:\n";
-			debuginfo += format("|-[ LOG CALLER STACK ]: Line ({}) File ({})\n", LINE, FILE);
-			return debuginfo;
+		void WriteMetrics(metrics::MetricWriter& writer, string_view prefix = "cthulhu_logger") {
+			string p(prefix);
+			writer.WriteCounter(p + "_lines_written_total", "Log records written to the logfile.", state->linesWritten.Value());
+			writer.WriteCounter(p + "_lines_dropped_total", "Log messages dropped by the rate limiter or a closed queue.", state->linesDropped.Value());
+			writer.WriteCounter(p + "_queue_pressure_total", "Worker wakeups with a queue above the pressure threshold.", state->pressureEvents.Value());
+			writer.WriteHistogram(p + "_write_latency_seconds", "Time from the log call until the record is written to the sinks.", state->writeLatency);
+			writer.WriteHistogram(p + "_flush_duration_seconds", "Duration of the writes of buffered output to the file descriptors.", state->flushDuration);
+			// Only util::chan keeps queue statistics
+			if constexpr (requires { state->logChan.getstats(); }) {
+				util::chanstats stats = state->logChan.getstats();
+				writer.WriteGauge(p + "_queue_depth", "Messages currently queued.", state->logChan.size());
+				writer.WriteGauge(p + "_queue_high_water", "Maximum number of messages queued at once.", stats.highWater);
+				writer.WriteCounter(p + "_queue_push_waits_total", "Log calls that waited for space in the queue.", stats.blocked);
+				writer.WriteCounter(p + "_queue_push_wait_seconds_total", "Time log calls waited for space in the queue.", stats.blockedNs / 1000000000.0);
+				writer.WriteCounter(p + "_queue_get_waits_total", "Worker fetches that waited for a message.", stats.waited);
+				writer.WriteCounter(p + "_queue_get_wait_seconds_total", "Time the worker waited for messages.", stats.waitedNs / 1000000000.0);
+			}
 		}
 
+	private:
 		/**
-		 * Writes a message directly to the log (and optionally to std)
+		 * State of the logger, shared by the logger and its worker
 		 *
-		 * Synchronisation is handled through the ioMutex
+		 * The worker owns a reference, so a worker abandoned by Close() never uses a destroyed logger or a closed logFd.
 		 */
-		void log(const LogMessage &msg) {
-			stringstream outstream;
-			string outstr;
-			
-			time_t now = chrono::system_clock::to_time_t(chrono::system_clock::now());
-			outstream << put_time(localtime(&now), "\n[ %H:%M:%S - %d.%m.%Y ]\n");
-
-			lock_guard<mutex> lock(ioMutex);
-			switch (msg.loglevel) {
-			case ERROR:
-				outstream << "[ ERROR ]:\n";
-				outstream << msg.message << "\n";
-				outstream << msg.debuginfo;
-				
-				outstr = outstream.str();
-				logFile << outstr << endl;
-				if (logToStd) {
-					cerr << outstr << endl;
+		class logstate : public enable_shared_from_this<logstate> {
+		public:
+			logstate(LOGLEVEL logLevel, string logPath, bool logToStd, bool logDebug, int logQueueSize, LogOptions options)
+				// Chan is bounded to the queue size and blocks the caller when full to mimic the Go logger behavior.
+				: logFd(openLogFile(logPath)),
+					logChan(makeLogChan(logQueueSize, &queueMemory)),
+					flushPolicy(options.Flush),
+					fileSink(logFd, options.Flush.BufferSize),
+					stdoutSink(STDOUT_FILENO, options.Flush.BufferSize),
+					stderrSink(STDERR_FILENO, options.Flush.BufferSize),
+					logFormat(options.Format),
+					textEncoder(logDebug),
+					logPath(logPath),
+					rotator(logPath, options.Rotation),
+					rateLimit(options.RateLimit),
+					rateLimiter(options.RateLimit),
+					closeTimeout(options.CloseTimeout) {
+				this->logToStd = logToStd;
+				this->logDebug = logDebug;
+				this->logLevel = logLevel;
+				// Queue threshold is set to 50%. If it goes beyond, this is already very critical
+				this->logChanThreshold = logQueueSize / 2;
+				// Worker fetches up to a full queue per wakeup
+				this->logBatchSize = logQueueSize > 0 ? logQueueSize : LOG_BATCH_SIZE;
+
+				fileSink.SetFlushHistogram(&flushDuration);
+				stdoutSink.SetFlushHistogram(&flushDuration);
+				stderrSink.SetFlushHistogram(&flushDuration);
+
+				struct stat fileStat;
+				if (fstat(logFd, &fileStat) == 0) fileSize = fileStat.st_size;
+				int64_t now = chrono::duration_cast<chrono::nanoseconds>(
+					chrono::system_clock::now().time_since_epoch()).count();
+				// A existing logfile keeps its age, otherwise restarts within the Interval would postpone the rotation forever
+				fileOpenedAt = fileSize > 0 ? fileCreatedAt(logFd, now) : now;
+				writeHeader();
+			}
+
+			~logstate() {
+				::close(logFd);
+			}
+
+			/**
+			 * Shut down the logChan and wait for the worker until the close timeout, see BasicLogger::Close()
+			 */
+			bool close() {
+				lock_guard<mutex> closeGuard(closeLock);
+				if (logWorker.joinable()) {
+					auto deadline = chrono::steady_clock::now() + closeTimeout;
+					closeDeadline.store(deadline.time_since_epoch().count(), memory_order_relaxed);
+					logChan.shutdown();
+					bool done;
+					{
+						unique_lock<mutex> lock(workerMutex);
+						done = workerCond.wait_until(lock, deadline, [this]() { return workerDone; });
+					}
+					if (done) {
+						logWorker.join();
+					} else {
+						// The worker holds a reference to the state, it exits after its current write returned
+						logWorker.detach();
+						closeDrained = false;
+					}
+					logChan.close();
 				}
-				break;
-			case WARN:
-				outstream << "[ WARN ]:\n";
-				outstream << msg.message << "\n";
-				outstream << msg.debuginfo;
-				
-				outstr = outstream.str();
-				logFile << outstr << endl;
-				if (logToStd) {
-					cerr << outstr << endl;
+				return closeDrained;
+			}
+
+			void emergencyFlush() noexcept {
+				fileSink.EmergencyFlush();
+				stdoutSink.EmergencyFlush();
+				stderrSink.EmergencyFlush();
+			}
+
+			LOGLEVEL logLevel;
+			int logFd;
+			bool logToStd;
+			bool logDebug;
+			int logChanThreshold;
+			size_t logBatchSize;
+			// Recycles the queue nodes if the logChan is a util::pmrchan (must be declared before the logChan)
+			pmr::unsynchronized_pool_resource queueMemory;
+			LogChan logChan;
+			// Sinks buffer output and are not thread-safe
+			// This lock synchronizes every io operation (writes to stdout / disk).
+			mutex ioMutex;
+			LogFlushPolicy flushPolicy;
+			LogSink fileSink;
+			LogSink stdoutSink;
+			LogSink stderrSink;
+			// Encoders and buffers for rendering a record (only used by the worker)
+			LOGFORMAT logFormat;
+			LogTextEncoder textEncoder;
+			LogJsonEncoder jsonEncoder;
+			LogBinaryEncoder binaryEncoder;
+			string recordBuffer;
+			string stdBuffer;
+			// Rotation state of the logfile (only used by the worker)
+			string logPath;
+			LogRotator rotator;
+			size_t fileSize = 0;
+			int64_t fileOpenedAt = 0;
+			// Rate limiter is checked by the callers, it is thread-safe
+			LogRateLimit rateLimit;
+			LogRateLimiter rateLimiter;
+			// Deduplication and report state (only used by the worker)
+			LogMessage lastMessage;
+			bool hasLastMessage = false;
+			uint64_t repeatCount = 0;
+			int64_t lastRepeatAt = 0;
+			uint64_t pressureCount = 0;
+			chrono::steady_clock::time_point pressureReportedAt = chrono::steady_clock::time_point::min();
+			chrono::steady_clock::time_point reportDeadline = chrono::steady_clock::now();
+			// Metrics, updated lock-free by the callers and the worker
+			metrics::Counter linesWritten;
+			metrics::Counter linesDropped;
+			metrics::Counter pressureEvents;
+			metrics::Histogram writeLatency;
+			metrics::Histogram flushDuration;
+			// Shutdown state, the deadline is set by Close() (steady clock ticks)
+			thread logWorker;
+			mutex closeLock;
+			// Set by the worker after its final flush, Close() waits for it until the deadline
+			mutex workerMutex;
+			condition_variable workerCond;
+			bool workerDone = false;
+			chrono::milliseconds closeTimeout;
+			atomic<int64_t> closeDeadline = chrono::steady_clock::time_point::max().time_since_epoch().count();
+			// Only written by the worker before it signals workerDone, or by Close() after the worker was abandoned
+			atomic<bool> closeDrained = true;
+
+			/**
+			 * Create the logChan, a util::pmrchan allocates its queue nodes from `memory`
+			 */
+			static LogChan makeLogChan(int logQueueSize, pmr::memory_resource* memory) {
+				size_t capacity = logQueueSize > 0 ? logQueueSize : 0;
+				if constexpr (is_constructible_v<LogChan, size_t, util::OVERFLOWPOLICY, pmr::memory_resource*>) {
+					return LogChan(capacity, util::BLOCK, memory);
+				} else {
+					return LogChan(capacity);
 				}
-				break;
-			case INFO:
-				outstream << "[ INFO ]:\n";
-				outstream << msg.message << "\n";
-				outstream << msg.debuginfo;
-				
-				outstr = outstream.str();
-				logFile << outstr << endl;
-				if (logToStd) {
-					cout << outstr << endl;
+			}
+
+			/**
+			 * Open the logfile in append mode and create its path if not existent
+			 *
+			 * Before logger is initalized, errors are just thrown to top level
+			 */
+			static int openLogFile(const string& logPath) {
+				filesystem::create_directories(filesystem::path(logPath).parent_path());
+				int fd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+				if (fd < 0) {
+					throw runtime_error("Failed to open logfile at: " + logPath);
 				}
-				break;
-			}			
-		}
+				return fd;
+			}
 
-		/**
-		 * Start seperate thread to write logs
-		 *
-		 * Reads messages from the logChan
-		 */
-		void startLogWorker() {
-			thread worker([this]() {
-				pair<LogMessage, bool> res;
-				while (true) {
-					res = logChan.get();
-					if (res.second) {
-						if (logChan.size() > logChanThreshold) {
-							log({
-									"Log Queue is under high pressure!",
-									getDebugInfo(__FILE__, __LINE__),
-									WARN,
-								});
+			/**
+			 * Write the header of the logfile format (only BINARY has one)
+			 *
+			 * Every logger session and every rotated file starts with a header, so the file can be decoded on its own.
+			 */
+			/**
+			 * Creation time of the file in nanoseconds since the unix epoch, never later than `now`
+			 *
+			 * Filesystems without birth time fall back to the last modification.
+			 */
+			static int64_t fileCreatedAt(int fd, int64_t now) {
+				struct statx fileStat;
+				if (statx(fd, "", AT_EMPTY_PATH, STATX_BTIME | STATX_MTIME, &fileStat) != 0) return now;
+				const struct statx_timestamp* time;
+				if (fileStat.stx_mask & STATX_BTIME) time = &fileStat.stx_btime;
+				else if (fileStat.stx_mask & STATX_MTIME) time = &fileStat.stx_mtime;
+				else return now;
+				return min<int64_t>(now, time->tv_sec * 1000000000ll + time->tv_nsec);
+			}
+
+			void writeHeader() {
+				if (logFormat!=BINARY) return;
+				string header;
+				binaryEncoder.AppendHeader(header);
+				writeFile(header);
+			}
+
+			/**
+			 * Append a record to the logfile
+			 */
+			void writeFile(string_view record) {
+				fileSink.Write(record);
+				fileSize += record.size();
+			}
+
+			/**
+			 * Rotate the logfile and continue logging into a new file at logPath
+			 *
+			 * If the rotation fails, logging continues in the current file
+			 * and the next rotation is attempted after the next MaxSize bytes / Interval.
+			 * Must be called while holding the ioMutex
+			 */
+			void rotateLogFile(int64_t now) {
+				TRACE_SPAN("logger.rotate");
+				fileSink.Flush();
+				fileSize = 0;
+				fileOpenedAt = now;
+				if (!rotator.Rotate(now)) return;
+
+				int fd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+				// The renamed file is still open, so nothing is lost if the new file can not be opened
+				if (fd < 0) return;
+				::close(logFd);
+				logFd = fd;
+				fileSink.SetFd(fd);
+				writeHeader();
+			}
+
+			/**
+			 * Encode the message in the logfile format and append it to `out`
+			 */
+			void encode(string& out, const LogMessage& msg) {
+				switch (logFormat) {
+				case BINARY:
+					binaryEncoder.Append(out, msg);
+					break;
+				case JSON:
+					jsonEncoder.Append(out, msg);
+					break;
+				default:
+					textEncoder.Append(out, msg);
+				}
+			}
+
+			/**
+			 * Capture the log call and push it to the logChan
+			 */
+			template <typename... Args>
+			void enqueue(LOGLEVEL level, const source_location& loc, string_view fmt, const Args&... args) {
+				if (rateLimiter.Enabled()) {
+					int64_t now = chrono::duration_cast<chrono::nanoseconds>(
+						chrono::steady_clock::now().time_since_epoch()).count();
+					// Limited messages are counted and reported by the worker
+					if (!rateLimiter.Allow(loc.file_name(), loc.line(), now)) {
+						linesDropped.Add();
+						return;
+					}
+				}
+				LogMessage msg;
+				CaptureLogMessage(msg, level, loc, fmt, args...);
+				if (!logChan.push(move(msg))) linesDropped.Add();
+			}
+		
+			/**
+			 * Writes a message to the log sinks (and optionally to std)
+			 *
+			 * Must be called while holding the ioMutex
+			 */
+			void log(const LogMessage &msg) {
+				recordBuffer.clear();
+				encode(recordBuffer, msg);
+				if (rotator.Enabled() && rotator.ShouldRotate(fileSize, recordBuffer.size(), fileOpenedAt, msg.timestamp)) {
+					rotateLogFile(msg.timestamp);
+					// Binary records may refer to callsites written to the previous file
+					recordBuffer.clear();
+					encode(recordBuffer, msg);
+				}
+
+				writeFile(recordBuffer);
+				linesWritten.Add();
+				// Timestamps are taken from the system clock when the message is captured
+				writeLatency.Observe(chrono::duration_cast<chrono::nanoseconds>(
+					chrono::system_clock::now().time_since_epoch()).count() - msg.timestamp);
+				if constexpr (StdOutput) {
+					if (logToStd) {
+						// Binary records are not readable on a terminal
+						string_view out = recordBuffer;
+						if (logFormat==BINARY) {
+							stdBuffer.clear();
+							textEncoder.Append(stdBuffer, msg);
+							out = stdBuffer;
 						}
-						log(res.first);
+						if (msg.loglevel==INFO) stdoutSink.Write(out);
+						else stderrSink.Write(out);
+					}
+				}
+				if (msg.loglevel==ERROR && flushPolicy.FlushOnError) {
+					flushSinks();
+				}
+			}
+
+			/**
+			 * Writes a message or collapses it into the previous one if it is a repetition
+			 *
+			 * Must be called while holding the ioMutex
+			 */
+			void process(const LogMessage &msg) {
+				if (!rateLimit.Deduplicate) {
+					log(msg);
+					return;
+				}
+				if (hasLastMessage && sameMessage(lastMessage, msg)) {
+					repeatCount++;
+					lastRepeatAt = msg.timestamp;
+					return;
+				}
+				reportRepeats();
+				log(msg);
+				lastMessage = msg;
+				hasLastMessage = true;
+			}
+
+			/**
+			 * Returns true if both messages have the same callsite, level and arguments
+			 *
+			 * Compares the captured arguments, the messages are not rendered.
+			 */
+			static bool sameMessage(const LogMessage& a, const LogMessage& b) {
+				return a.line == b.line && a.file == b.file && a.loglevel == b.loglevel
+					&& a.format.data() == b.format.data() && a.render == b.render
+					&& a.payloadSize == b.payloadSize && memcmp(a.payload, b.payload, a.payloadSize) == 0
+					&& a.message == b.message;
+			}
+
+			/**
+			 * Write "Last message repeated N times" if the last message was collapsed
+			 *
+			 * The report refers to the callsite of the repeated message.
+			 */
+			void reportRepeats() {
+				if (repeatCount == 0) return;
+				LogMessage report;
+				CaptureLogMessage(report, lastMessage.loglevel, source_location::current(),
+													"Last message repeated {} times", repeatCount);
+				report.timestamp = lastRepeatAt;
+				report.file = lastMessage.file;
+				report.line = lastMessage.line;
+				log(report);
+				repeatCount = 0;
+			}
+
+			/**
+			 * Write the counts of messages suppressed by the rate limiter
+			 */
+			void reportSuppressed() {
+				rateLimiter.CollectSuppressed([this](const char* file, int line, uint64_t count) {
+					LogMessage report;
+					CaptureLogMessage(report, WARN, source_location::current(),
+														"Suppressed {} messages from {}:{} (rate limited)", count, file, line);
+					report.file = file;
+					report.line = line;
+					log(report);
+				});
+			}
+
+			/**
+			 * Write the queue pressure warning, at most once per report interval
+			 *
+			 * Must be called while holding the ioMutex
+			 */
+			void reportPressure(chrono::steady_clock::time_point now) {
+				pressureCount++;
+				pressureEvents.Add();
+				if (pressureReportedAt != chrono::steady_clock::time_point::min() &&
+						now - pressureReportedAt < rateLimit.ReportInterval) return;
+				LogMessage warning;
+				CaptureLogMessage(warning, WARN, source_location::current(),
+													"Log Queue is under high pressure! (threshold exceeded {} times)", pressureCount);
+				log(warning);
+				pressureCount = 0;
+				pressureReportedAt = now;
+			}
+
+			/**
+			 * Returns true if the worker has to report periodically
+			 */
+			bool reportsPending() const {
+				return rateLimiter.Enabled() || repeatCount > 0;
+			}
+
+			/**
+			 * Flush all sinks
+			 *
+			 * Must be called while holding the ioMutex
+			 */
+			void flushSinks() {
+				TRACE_SPAN("logger.flush");
+				fileSink.Flush();
+				stdoutSink.Flush();
+				stderrSink.Flush();
+			}
+
+			/**
+			 * Returns true if a sink holds buffered output
+			 */
+			bool sinksPending() const {
+				return fileSink.Pending() || stdoutSink.Pending() || stderrSink.Pending();
+			}
+
+			/**
+			 * Get the time at which the oldest buffered output must be flushed
+			 */
+			chrono::steady_clock::time_point flushDeadline() const {
+				auto since = chrono::steady_clock::time_point::max();
+				if (fileSink.Pending()) since = min(since, fileSink.PendingSince());
+				if (stdoutSink.Pending()) since = min(since, stdoutSink.PendingSince());
+				if (stderrSink.Pending()) since = min(since, stderrSink.PendingSince());
+				return since + flushPolicy.Interval;
+			}
+
+			static bool lessByTimestamp(const LogMessage& a, const LogMessage& b) {
+				return a.timestamp < b.timestamp;
+			}
+
+			/**
+			 * Returns true if Close() is waiting and its timeout passed
+			 */
+			bool closeExpired() const {
+				return chrono::steady_clock::now().time_since_epoch().count() >= closeDeadline.load(memory_order_relaxed);
+			}
+
+			/**
+			 * Drop all queued messages, used if draining exceeds the close timeout
+			 */
+			void dropQueued(vector<LogMessage>& batch) {
+				closeDrained = false;
+				batch.clear();
+				while (logChan.drain(batch, logBatchSize) > 0) {
+					linesDropped.Add(batch.size());
+					batch.clear();
+				}
+			}
+
+			/**
+			 * Start seperate thread to write logs
+			 *
+			 * Reads messages from the logChan until it is shut down and drained (see Close())
+			 */
+			void startLogWorker() {
+				logWorker = thread([self = this->shared_from_this()]() {
+					self->runLogWorker();
+					// Remaining output is written by the worker, so a blocked write can not block Close()
+					{
+						lock_guard<mutex> lock(self->ioMutex);
+						self->reportRepeats();
+						self->reportSuppressed();
+						self->flushSinks();
+					}
+					lock_guard<mutex> lock(self->workerMutex);
+					self->workerDone = true;
+					self->workerCond.notify_all();
+				});
+			}
+
+			/**
+			 * Write batches until the logChan is drained or the close timeout passed
+			 */
+			void runLogWorker() {
+				vector<LogMessage> batch;
+				batch.reserve(logBatchSize);
+				while (true) {
+					// Fetch all queued messages at once, this takes the chan lock only once per wakeup
+					// If output is buffered, the worker wakes up at the latest when it must be flushed
+					// Suppressed and repeated messages are reported at the latest after the report interval
+					batch.clear();
+					auto deadline = chrono::steady_clock::time_point::max();
+					if (sinksPending()) deadline = flushDeadline();
+					if (reportsPending()) deadline = min(deadline, reportDeadline);
+					if (deadline != chrono::steady_clock::time_point::max()) {
+						logChan.get_batch_until(batch, logBatchSize, deadline);
 					} else {
-						// Exit if channel was closed
+						logChan.get_batch(batch, logBatchSize);
+					}
+					if (batch.empty() && logChan.isclosed()) {
+						// Exit if channel was shut down and drained
 						return;
 					}
+					if (closeExpired()) {
+						linesDropped.Add(batch.size());
+						dropQueued(batch);
+						return;
+					}
+					// Timestamps are taken before the push, so messages of racing threads may be queued slightly out of order
+					if (!is_sorted(batch.begin(), batch.end(), lessByTimestamp)) {
+						stable_sort(batch.begin(), batch.end(), lessByTimestamp);
+					}
+
+					TRACE_SPAN("logger.batch");
+					lock_guard<mutex> lock(ioMutex);
+					auto now = chrono::steady_clock::now();
+					if ((int)batch.size() > logChanThreshold) {
+						reportPressure(now);
+					}
+					for (const auto &msg : batch) {
+						process(msg);
+					}
+					if (now >= reportDeadline) {
+						reportRepeats();
+						reportSuppressed();
+						reportDeadline = now + rateLimit.ReportInterval;
+					}
+					if (sinksPending() && chrono::steady_clock::now() >= flushDeadline()) {
+						flushSinks();
+					}
 				}
-			});
+			}
+		};
 
-			worker.detach();
-		}
+		shared_ptr<logstate> state;
+		int crashSlot = -1;
+	};
 
-		/**
-		 * Stop logworker
-		 *
-		 * This function waits until the worker has fully exited
-		 * so it can be savely used in destructor.
-		 */
-		void closeLogWorker() {
-			logChan.close();
+	/**
+	 * Logger using the mutex based util::chan as queue
+	 *
+	 * The queue nodes are recycled by a memory pool, so logging in steady state does not allocate.
+	 */
+	using Logger = BasicLogger<util::pmrchan<LogMessage>>;
+
+	/**
+	 * Logger using the lock-free util::mpscchan as queue
+	 *
+	 * The queue has a fixed capacity, so logQueueSize must be greater than 0.
+	 */
+	using RingLogger = BasicLogger<util::mpscchan<LogMessage>>;
+
+	/**
+	 * Orders log messages by their timestamp
+	 */
+	struct LogTimestampOrder {
+		bool operator()(const LogMessage& a, const LogMessage& b) const {
+			return a.timestamp < b.timestamp;
 		}
 	};
+
+	/**
+	 * Logger using a util::threadchan as queue
+	 *
+	 * Every logging thread writes into its own lock-free buffer, so threads never contend on the queue.
+	 * The worker merges the buffers by the timestamp of their oldest message,
+	 * so messages are written in timestamp order across threads and batches.
+	 * As with the shared queue of Logger, a message that is pushed after a newer one was written still follows it.
+	 * The buffers have a fixed capacity per thread, so logQueueSize must be greater than 0.
+	 */
+	using ThreadLogger = BasicLogger<util::threadchan<LogMessage, LogTimestampOrder>>;
 };
 
 #endif
@@ -0,0 +1,301 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOGMESSAGE_H
+#define LOGMESSAGE_H
+
+#include <chrono>
+#include <concepts>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <iterator>
+#include <source_location>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unistd.h>
+
+using namespace std;
+
+namespace logger {
+
+	enum LOGLEVEL {
+		ERROR = 1,
+		WARN = 2,
+		INFO = 3,
+	};
+
+	// Size of the inline buffer that holds the arguments of a LogMessage
+	inline constexpr size_t LOG_PAYLOAD_SIZE = 256;
+
+	/**
+	 * Type tags of the arguments stored in the LogMessage payload
+	 *
+	 * Every argument is encoded as one tag byte followed by the raw value,
+	 * strings are encoded as a uint32_t length followed by the characters.
+	 */
+	enum LOGARGTYPE : uint8_t {
+		ARG_BOOL = 1,
+		ARG_CHAR,
+		ARG_INT,
+		ARG_UINT,
+		ARG_FLOAT,
+		ARG_DOUBLE,
+		ARG_POINTER,
+		ARG_STRING,
+	};
+
+	/**
+	 * Log record passed from the caller to the log worker
+	 *
+	 * The message is not formatted by the caller, only the format string and the arguments are captured
+	 * into the inline payload. The worker renders the text with the render function.
+	 * A LogMessage does not own any heap memory unless the arguments did not fit into the payload,
+	 * in this case the message is formatted eagerly into `message`.
+	 */
+	struct LogMessage {
+		LOGLEVEL loglevel = INFO;
+		// Time of the log call in nanoseconds since the unix epoch
+		int64_t timestamp = 0;
+		// Kernel thread id of the caller
+		uint64_t thread = 0;
+		// Source location of the log call
+		const char* file = "";
+		int line = 0;
+		// Format string (checked at compile time, it always refers to a string literal)
+		string_view format;
+		// Function that renders the message text into `out`
+		void (*render)(const LogMessage& msg, string& out) = nullptr;
+		// Number of arguments and bytes used in the payload
+		uint8_t argCount = 0;
+		uint16_t payloadSize = 0;
+		// Eagerly formatted message (only used if the arguments can not be deferred)
+		string message;
+		// Encoded arguments
+		char payload[LOG_PAYLOAD_SIZE];
+	};
+
+	/**
+	 * Format string of a log call
+	 *
+	 * Captures the source location of the caller, so the FILE / LINE macros are not required.
+	 * The format string is checked against the arguments at compile time like with std::format.
+	 */
+	template <typename... Args>
+	struct LogFormat {
+		format_string<Args...> fmt;
+		source_location loc;
+
+		template <typename S>
+			requires convertible_to<const S&, string_view>
+		consteval LogFormat(const S& str, source_location loc = source_location::current())
+			: fmt(str), loc(loc) {};
+	};
+
+	namespace detail {
+		/**
+		 * Describes how a argument type is stored in the payload
+		 *
+		 * Only types with a specialization are deferred, all other types are formatted eagerly.
+		 */
+		template <typename T>
+		struct logarg;
+
+		template <>
+		struct logarg<bool> {
+			using stored = bool;
+			static constexpr LOGARGTYPE tag = ARG_BOOL;
+		};
+
+		template <>
+		struct logarg<char> {
+			using stored = char;
+			static constexpr LOGARGTYPE tag = ARG_CHAR;
+		};
+
+		template <signed_integral T>
+			requires (!same_as<T, char>)
+		struct logarg<T> {
+			using stored = long long;
+			static constexpr LOGARGTYPE tag = ARG_INT;
+		};
+
+		template <unsigned_integral T>
+			requires (!same_as<T, char> && !same_as<T, bool>)
+		struct logarg<T> {
+			using stored = unsigned long long;
+			static constexpr LOGARGTYPE tag = ARG_UINT;
+		};
+
+		template <>
+		struct logarg<float> {
+			using stored = float;
+			static constexpr LOGARGTYPE tag = ARG_FLOAT;
+		};
+
+		template <>
+		struct logarg<double> {
+			using stored = double;
+			static constexpr LOGARGTYPE tag = ARG_DOUBLE;
+		};
+
+		template <typename T>
+			requires (same_as<T, void*> || same_as<T, const void*> || same_as<T, nullptr_t>)
+		struct logarg<T> {
+			using stored = const void*;
+			static constexpr LOGARGTYPE tag = ARG_POINTER;
+		};
+
+		template <typename T>
+			requires (same_as<T, char*> || same_as<T, const char*> || same_as<T, string> || same_as<T, string_view>)
+		struct logarg<T> {
+			using stored = string_view;
+			static constexpr LOGARGTYPE tag = ARG_STRING;
+		};
+
+		template <typename T>
+		concept deferrable = requires { typename logarg<T>::stored; };
+
+		// Type under which a argument is stored (char arrays decay to const char*)
+		template <typename T>
+		using argtype = decay_t<const T&>;
+
+		/**
+		 * Returns the number of payload bytes required for the argument
+		 */
+		template <typename T>
+		size_t argSize(const T& arg) {
+			using stored = typename logarg<T>::stored;
+			if constexpr (is_same_v<stored, string_view>) {
+				return 1 + sizeof(uint32_t) + string_view(arg).size();
+			} else {
+				return 1 + sizeof(stored);
+			}
+		}
+
+		/**
+		 * Encodes the argument into the payload at `p` and advances `p`
+		 */
+		template <typename T>
+		void encodeArg(char*& p, const T& arg) {
+			using stored = typename logarg<T>::stored;
+			*p++ = (char)logarg<T>::tag;
+			if constexpr (is_same_v<stored, string_view>) {
+				string_view str(arg);
+				uint32_t len = str.size();
+				memcpy(p, &len, sizeof(len));
+				p += sizeof(len);
+				memcpy(p, str.data(), len);
+				p += len;
+			} else {
+				stored val = (stored)arg;
+				memcpy(p, &val, sizeof(val));
+				p += sizeof(val);
+			}
+		}
+
+		/**
+		 * Decodes the next argument from the payload at `p` and advances `p`
+		 *
+		 * Strings are returned as view into the payload.
+		 */
+		template <typename Stored>
+		Stored decodeArg(const char*& p) {
+			// Skip type tag
+			p++;
+			if constexpr (is_same_v<Stored, string_view>) {
+				uint32_t len;
+				memcpy(&len, p, sizeof(len));
+				p += sizeof(len);
+				string_view str(p, len);
+				p += len;
+				return str;
+			} else {
+				Stored val;
+				memcpy(&val, p, sizeof(val));
+				p += sizeof(val);
+				return val;
+			}
+		}
+
+		/**
+		 * Render a message from its payload
+		 */
+		template <typename... Stored>
+		void renderPayload(const LogMessage& msg, string& out) {
+			[[maybe_unused]] const char* p = msg.payload;
+			// Braced initialization guarantees that the arguments are decoded from left to right
+			tuple<Stored...> args{decodeArg<Stored>(p)...};
+			apply([&](auto&... arg) {
+				vformat_to(back_inserter(out), msg.format, make_format_args(arg...));
+			}, args);
+		}
+
+		/**
+		 * Returns the kernel thread id of the calling thread (cached, gettid is a syscall)
+		 */
+		inline uint64_t currentThreadId() {
+			static thread_local const uint64_t tid = gettid();
+			return tid;
+		}
+
+		/**
+		 * Render a message that was formatted eagerly
+		 */
+		inline void renderFormatted(const LogMessage& msg, string& out) {
+			out += msg.message;
+		}
+	}
+
+	/**
+	 * Fill the LogMessage with the log call information
+	 *
+	 * Arguments are stored in the payload, which requires no heap allocation.
+	 * If a argument type can not be deferred or the payload is too small, the message is formatted eagerly.
+	 */
+	template <typename... Args>
+	void CaptureLogMessage(LogMessage& msg, LOGLEVEL level, const source_location& loc,
+												 string_view fmt, const Args&... args) {
+		msg.loglevel = level;
+		msg.timestamp = chrono::duration_cast<chrono::nanoseconds>(
+			chrono::system_clock::now().time_since_epoch()).count();
+		msg.thread = detail::currentThreadId();
+		msg.file = loc.file_name();
+		msg.line = loc.line();
+		msg.format = fmt;
+
+		if constexpr ((detail::deferrable<detail::argtype<Args>> && ...)) {
+			size_t size = (detail::argSize<detail::argtype<Args>>(args) + ... + 0);
+			if (size <= LOG_PAYLOAD_SIZE) {
+				[[maybe_unused]] char* p = msg.payload;
+				(detail::encodeArg<detail::argtype<Args>>(p, args), ...);
+				msg.argCount = sizeof...(Args);
+				msg.payloadSize = size;
+				msg.render = &detail::renderPayload<typename detail::logarg<detail::argtype<Args>>::stored...>;
+				return;
+			}
+		}
+		msg.message = vformat(fmt, make_format_args(args...));
+		msg.render = &detail::renderFormatted;
+	}
+};
+
+#endif
@@ -0,0 +1,154 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOGRATELIMIT_H
+#define LOGRATELIMIT_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+using namespace std;
+
+namespace logger {
+
+	// Number of callsites the rate limiter can track, further callsites are not limited
+	inline constexpr size_t LOG_RATELIMIT_SLOTS = 1024;
+	// Number of slots probed to find the slot of a callsite
+	inline constexpr size_t LOG_RATELIMIT_PROBES = 8;
+
+	/**
+	 * Limits repeated log messages
+	 */
+	struct LogRateLimit {
+		// Messages per second allowed for every callsite (0 disables rate limiting)
+		double Rate = 0;
+		// Messages a callsite can emit at once before it is limited to Rate
+		size_t Burst = 10;
+		// Collapse consecutive identical messages into "Last message repeated N times"
+		bool Deduplicate = false;
+		// Interval in which suppressed and repeated messages are reported
+		chrono::milliseconds ReportInterval = chrono::milliseconds(10000);
+
+		bool Enabled() const {
+			return Rate > 0;
+		}
+	};
+
+	/**
+	 * Per-callsite token bucket
+	 *
+	 * Callers are checked before the message is captured, so limited messages never reach the queue.
+	 * The bucket of every callsite is a single atomic "theoretical arrival time" (GCRA),
+	 * a message is allowed if it does not arrive earlier than Burst messages ahead of the rate.
+	 * Callsites are stored in a fixed open addressing table, the check is lock-free.
+	 */
+	class LogRateLimiter {
+	public:
+		explicit LogRateLimiter(LogRateLimit limit) : limit(limit) {
+			if (limit.Enabled()) {
+				emissionInterval = (int64_t)(1e9 / limit.Rate);
+				burstTolerance = emissionInterval * (int64_t)(limit.Burst > 0 ? limit.Burst - 1 : 0);
+				slots = make_unique<slot[]>(LOG_RATELIMIT_SLOTS);
+			}
+		}
+
+		bool Enabled() const {
+			return limit.Enabled();
+		}
+
+		/**
+		 * Returns true if the callsite may log at `now` (steady clock in nanoseconds)
+		 *
+		 * If the message is limited, it is counted as suppressed for the callsite.
+		 */
+		bool Allow(const char* file, int line, int64_t now) {
+			slot* s = find(file, line);
+			// Table is full, the callsite is not limited
+			if (!s) return true;
+
+			int64_t tat = s->tat.load(memory_order_relaxed);
+			while (true) {
+				int64_t next = max(tat, now) + emissionInterval;
+				if (next - now > burstTolerance + emissionInterval) {
+					s->suppressed.fetch_add(1, memory_order_relaxed);
+					return false;
+				}
+				if (s->tat.compare_exchange_weak(tat, next, memory_order_relaxed)) return true;
+			}
+		}
+
+		/**
+		 * Call `report(file, line, count)` for every callsite with suppressed messages and reset the counts
+		 */
+		template <typename Report>
+		void CollectSuppressed(Report&& report) {
+			if (!slots) return;
+			for (size_t i = 0; i < LOG_RATELIMIT_SLOTS; i++) {
+				slot& s = slots[i];
+				if (s.suppressed.load(memory_order_relaxed) == 0) continue;
+				int line = s.line.load(memory_order_acquire);
+				if (line == 0) continue;
+				uint64_t count = s.suppressed.exchange(0, memory_order_relaxed);
+				if (count > 0) report(s.file.load(memory_order_relaxed), line, count);
+			}
+		}
+
+	private:
+		struct slot {
+			// Identifies the callsite, 0 marks a free slot
+			atomic<uint64_t> key = 0;
+			// Published after the key is claimed (line != 0 once set)
+			atomic<const char*> file = nullptr;
+			atomic<int> line = 0;
+			atomic<int64_t> tat = 0;
+			atomic<uint64_t> suppressed = 0;
+		};
+
+		LogRateLimit limit;
+		int64_t emissionInterval = 0;
+		int64_t burstTolerance = 0;
+		unique_ptr<slot[]> slots;
+
+		slot* find(const char* file, int line) {
+			// File names are string literals, the address identifies them
+			uint64_t key = hash<const void*>()(file) * 31 + (uint64_t)line;
+			if (key == 0) key = 1;
+			size_t index = (key ^ (key >> 29)) * 0x9e3779b97f4a7c15 >> 32;
+			for (size_t i = 0; i < LOG_RATELIMIT_PROBES; i++) {
+				slot& s = slots[(index + i) % LOG_RATELIMIT_SLOTS];
+				uint64_t current = s.key.load(memory_order_acquire);
+				if (current == key) return &s;
+				if (current == 0 && s.key.compare_exchange_strong(current, key, memory_order_acq_rel)) {
+					s.file.store(file, memory_order_relaxed);
+					s.line.store(line, memory_order_release);
+					return &s;
+				}
+				// Claimed concurrently by the same callsite
+				if (current == key) return &s;
+			}
+			return nullptr;
+		}
+	};
+};
+
+#endif
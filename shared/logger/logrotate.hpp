@@ -0,0 +1,248 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOGROTATE_H
+#define LOGROTATE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+#include "shared/util/chan.hpp"
+
+#define COMPRESSED_FILE_EXTENSION ".gz"
+#ifndef TMP_FILE_EXTENSION
+#define TMP_FILE_EXTENSION ".tmp"
+#endif
+
+using namespace std;
+
+namespace logger {
+
+	/**
+	 * Determines when the logfile is rotated and how long rotated segments are kept
+	 *
+	 * Rotation is disabled if both MaxSize and Interval are 0.
+	 */
+	struct LogRotationPolicy {
+		// Rotate if the logfile would exceed this size in bytes (0 disables size based rotation)
+		size_t MaxSize = 0;
+		// Rotate if the logfile was created longer ago than this interval, also across restarts (0 disables time based rotation)
+		chrono::seconds Interval = chrono::seconds(0);
+		// Compress rotated segments with gzip
+		bool Compress = false;
+		// Number of rotated segments that are kept (0 keeps all)
+		size_t RetainSegments = 0;
+		// Rotated segments older than this are deleted (0 keeps them forever)
+		chrono::seconds RetainAge = chrono::seconds(0);
+
+		bool Enabled() const {
+			return MaxSize > 0 || Interval.count() > 0;
+		}
+	};
+
+	/**
+	 * Rotates the logfile into segments
+	 *
+	 * The logfile is rotated by renaming it to `<logPath>.<YYYYmmdd-HHMMSS>` (UTC of the rotation),
+	 * the rename is atomic, so the logfile is never truncated or copied.
+	 * Compression and deletion of old segments run on a background thread,
+	 * they never block the log worker.
+	 *
+	 * Compressed segments are written to a .tmp file first and renamed after,
+	 * so a crash never leaves a partially compressed segment behind.
+	 */
+	class LogRotator {
+	public:
+		LogRotator(string logPath, LogRotationPolicy policy) : logPath(logPath), policy(policy) {
+			if (policy.Enabled()) {
+				worker = thread([this]() { runWorker(); });
+			}
+		}
+
+		virtual ~LogRotator() {
+			// Pending segments are still processed, this may take a moment with compression enabled
+			jobs.shutdown();
+			if (worker.joinable()) worker.join();
+		}
+
+		LogRotator(const LogRotator&) = delete;
+		LogRotator& operator=(const LogRotator&) = delete;
+
+		/**
+		 * Returns true if the policy rotates the logfile
+		 */
+		bool Enabled() const {
+			return policy.Enabled();
+		}
+
+		/**
+		 * Returns true if the logfile must be rotated before appending `next` bytes
+		 *
+		 * `fileSize` is the current size of the logfile,
+		 * `openedAt` and `now` are timestamps in nanoseconds since the unix epoch.
+		 * A empty logfile is never rotated, so a single record larger than MaxSize does not rotate endlessly.
+		 */
+		bool ShouldRotate(size_t fileSize, size_t next, int64_t openedAt, int64_t now) const {
+			if (fileSize == 0) return false;
+			if (policy.MaxSize > 0 && fileSize + next > policy.MaxSize) return true;
+			if (policy.Interval.count() > 0 &&
+					now - openedAt >= chrono::duration_cast<chrono::nanoseconds>(policy.Interval).count()) return true;
+			return false;
+		}
+
+		/**
+		 * Rename the logfile to a new segment
+		 *
+		 * The caller must flush and reopen the logfile afterwards.
+		 * The segment is handed to the background thread for compression and retention.
+		 * Returns false if the logfile could not be renamed.
+		 */
+		bool Rotate(int64_t now) {
+			string segment = segmentPath(now);
+			error_code ec;
+			filesystem::rename(logPath, segment, ec);
+			if (ec) return false;
+			jobs.push(move(segment));
+			return true;
+		}
+
+	private:
+		string logPath;
+		LogRotationPolicy policy;
+		util::chan<string> jobs;
+		thread worker;
+
+		/**
+		 * Get a unused segment path, a counter is appended if multiple rotations happen in the same second
+		 */
+		string segmentPath(int64_t now) const {
+			time_t sec = now / 1000000000;
+			tm utc;
+			gmtime_r(&sec, &utc);
+			char stamp[32];
+			strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &utc);
+
+			string base = logPath + "." + stamp;
+			string path = base;
+			for (int i = 1; exists(path) || exists(path + COMPRESSED_FILE_EXTENSION); i++) {
+				path = format("{}.{}", base, i);
+			}
+			return path;
+		}
+
+		static bool exists(const string& path) {
+			error_code ec;
+			return filesystem::exists(path, ec);
+		}
+
+		void runWorker() {
+			while (true) {
+				auto [segment, ok] = jobs.get();
+				if (!ok) return;
+				if (policy.Compress) compress(segment);
+				prune();
+			}
+		}
+
+		/**
+		 * Compress the segment to `<segment>.gz` and remove the uncompressed segment
+		 *
+		 * If compression fails, the uncompressed segment is kept.
+		 */
+		void compress(const string& segment) {
+			string target = segment + COMPRESSED_FILE_EXTENSION;
+			string tmp = target + TMP_FILE_EXTENSION;
+
+			int in = open(segment.c_str(), O_RDONLY | O_CLOEXEC);
+			if (in < 0) return;
+			gzFile out = gzopen(tmp.c_str(), "wb");
+			if (!out) {
+				::close(in);
+				return;
+			}
+			bool ok = true;
+			char buffer[64 * 1024];
+			while (true) {
+				ssize_t n = read(in, buffer, sizeof(buffer));
+				if (n < 0 && errno == EINTR) continue;
+				if (n < 0) { ok = false; break; }
+				if (n == 0) break;
+				if (gzwrite(out, buffer, n) != n) { ok = false; break; }
+			}
+			::close(in);
+			if (gzclose(out) != Z_OK) ok = false;
+
+			error_code ec;
+			if (ok) filesystem::rename(tmp, target, ec);
+			if (!ok || ec) {
+				filesystem::remove(tmp, ec);
+				return;
+			}
+			filesystem::remove(segment, ec);
+		}
+
+		/**
+		 * Delete segments exceeding the retention policy
+		 *
+		 * Segments are ordered by their name, which starts with the rotation timestamp.
+		 */
+		void prune() {
+			if (policy.RetainSegments == 0 && policy.RetainAge.count() == 0) return;
+
+			filesystem::path path(logPath);
+			string prefix = path.filename().string() + ".";
+			filesystem::path dir = path.has_parent_path() ? path.parent_path() : filesystem::path(".");
+
+			vector<filesystem::path> segments;
+			error_code ec;
+			for (auto& entry : filesystem::directory_iterator(dir, ec)) {
+				string name = entry.path().filename().string();
+				if (!name.starts_with(prefix) || name.ends_with(TMP_FILE_EXTENSION)) continue;
+				// Only touch files that look like segments (timestamp after the prefix)
+				if (name.size() < prefix.size() + 15 || !isdigit((unsigned char)name[prefix.size()])) continue;
+				segments.push_back(entry.path());
+			}
+			// Newest first
+			sort(segments.begin(), segments.end(), greater<filesystem::path>());
+
+			auto now = filesystem::file_time_type::clock::now();
+			for (size_t i = 0; i < segments.size(); i++) {
+				bool expired = policy.RetainSegments > 0 && i >= policy.RetainSegments;
+				if (!expired && policy.RetainAge.count() > 0) {
+					auto mtime = filesystem::last_write_time(segments[i], ec);
+					expired = !ec && now - mtime > policy.RetainAge;
+				}
+				if (expired) filesystem::remove(segments[i], ec);
+			}
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,231 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOGSINK_H
+#define LOGSINK_H
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "shared/metrics/metrics.hpp"
+
+using namespace std;
+
+namespace logger {
+
+	/**
+	 * Determines when buffered log output is written to the file descriptors
+	 *
+	 * Output is flushed if one of the conditions is met.
+	 */
+	struct LogFlushPolicy {
+		// Flush if the buffered output exceeds this size (0 writes every message directly)
+		size_t BufferSize = 64 * 1024;
+		// Flush if the oldest buffered output is older than this interval
+		chrono::milliseconds Interval = chrono::milliseconds(1000);
+		// Flush immediately after a ERROR message
+		bool FlushOnError = true;
+	};
+
+	/**
+	 * Formats the timestamp banner of log messages
+	 *
+	 * The banner only has a resolution of one second,
+	 * so it is rendered once per second and reused for all messages logged in the same second.
+	 * Uses localtime_r, because localtime is not thread-safe.
+	 */
+	class LogTimestamp {
+	public:
+		/**
+		 * Get the timestamp banner for a timestamp in nanoseconds since the unix epoch
+		 */
+		string_view Format(int64_t timestamp) {
+			time_t sec = timestamp / 1000000000;
+			if (sec != cachedSecond || cachedLen == 0) {
+				tm local;
+				localtime_r(&sec, &local);
+				cachedLen = strftime(cached, sizeof(cached), "\n[ %H:%M:%S - %d.%m.%Y ]\n", &local);
+				cachedSecond = sec;
+			}
+			return string_view(cached, cachedLen);
+		}
+
+	private:
+		time_t cachedSecond = 0;
+		char cached[64];
+		size_t cachedLen = 0;
+	};
+
+	/**
+	 * Buffered output to a file descriptor
+	 *
+	 * Records are appended to a reusable buffer and written with a single write / writev syscall.
+	 * The sink is not synchronized, it is expected to be used by the log worker only
+	 * (except EmergencyFlush(), which may be called from a signal handler).
+	 *
+	 * The sink does not own the file descriptor.
+	 */
+	class LogSink {
+	public:
+		LogSink(int fd, size_t bufferSize) : sinkFd(fd), bufferSize(bufferSize) {
+			// The buffer never grows beyond bufferSize, so its storage is never reallocated
+			buffer.reserve(bufferSize);
+			bufferData = buffer.data();
+		}
+
+		/**
+		 * Append a record to the sink
+		 *
+		 * If the record does not fit into the buffer, the buffer and the record are written together.
+		 */
+		void Write(string_view record) {
+			if (buffer.size() + record.size() <= bufferSize) {
+				if (buffer.empty()) pendingSince = chrono::steady_clock::now();
+				buffer.append(record);
+				committed.store(buffer.size(), memory_order_release);
+				return;
+			}
+			iovec iov[2] = {
+				{ buffer.data(), buffer.size() },
+				{ (void*)record.data(), record.size() },
+			};
+			writeAll(iov, 2);
+			clear();
+		}
+
+		/**
+		 * Write all buffered output to the file descriptor
+		 */
+		void Flush() {
+			if (buffer.empty()) return;
+			iovec iov = { buffer.data(), buffer.size() };
+			writeAll(&iov, 1);
+			clear();
+		}
+
+		/**
+		 * Write the buffered output without synchronization, async-signal-safe
+		 *
+		 * Intended for crash handlers only: the buffer is neither locked nor cleared,
+		 * output the worker writes at the same time may appear twice.
+		 */
+		void EmergencyFlush() const noexcept {
+			const char* data = bufferData;
+			size_t size = committed.load(memory_order_acquire);
+			int fd = sinkFd.load(memory_order_relaxed);
+			while (size > 0) {
+				ssize_t n = ::write(fd, data, size);
+				if (n < 0) {
+					if (errno == EINTR) continue;
+					return;
+				}
+				data += n;
+				size -= n;
+			}
+		}
+
+		/**
+		 * Switch the sink to another file descriptor
+		 *
+		 * Buffered output is written to the new file descriptor, flush the sink before to avoid this.
+		 */
+		void SetFd(int fd) {
+			sinkFd.store(fd, memory_order_relaxed);
+		}
+
+		/**
+		 * Record the duration of every write to the file descriptor in `histogram` (nullptr disables it)
+		 */
+		void SetFlushHistogram(metrics::Histogram* histogram) {
+			flushHistogram = histogram;
+		}
+
+		/**
+		 * Returns true if the sink holds buffered output
+		 */
+		bool Pending() const {
+			return !buffer.empty();
+		}
+
+		/**
+		 * Returns the time when the oldest buffered output was appended
+		 */
+		chrono::steady_clock::time_point PendingSince() const {
+			return pendingSince;
+		}
+
+	private:
+		atomic<int> sinkFd;
+		size_t bufferSize;
+		string buffer;
+		// Published size and storage of the buffer for EmergencyFlush()
+		atomic<size_t> committed = 0;
+		const char* bufferData = nullptr;
+		chrono::steady_clock::time_point pendingSince;
+		metrics::Histogram* flushHistogram = nullptr;
+
+		void clear() {
+			buffer.clear();
+			committed.store(0, memory_order_release);
+		}
+
+		/**
+		 * Write the vectors and record the duration in the flush histogram
+		 */
+		void writeAll(iovec* iov, int iovcnt) {
+			auto start = flushHistogram ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+			writeVectors(iov, iovcnt);
+			if (flushHistogram) flushHistogram->Observe(chrono::steady_clock::now() - start);
+		}
+
+		/**
+		 * Write the vectors completely, retrying on partial writes and interrupts
+		 *
+		 * Write errors are ignored, there is no place left to report them to.
+		 */
+		void writeVectors(iovec* iov, int iovcnt) {
+			while (iovcnt > 0) {
+				ssize_t n = writev(sinkFd.load(memory_order_relaxed), iov, iovcnt);
+				if (n < 0) {
+					if (errno == EINTR) continue;
+					return;
+				}
+				// Skip fully written vectors and advance into the partially written one
+				while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+					n -= iov->iov_len;
+					iov++;
+					iovcnt--;
+				}
+				if (iovcnt > 0) {
+					iov->iov_base = (char*)iov->iov_base + n;
+					iov->iov_len -= n;
+				}
+			}
+		}
+	};
+};
+
+#endif
@@ -220,11 +220,7 @@ func (m* MetaConfig) SetBool(key *string, value *bool) {
 	m.configLock.Lock()
 	defer m.configLock.Unlock()
 
-	if *value {
-		m.config[*key] = "true"
-	} else {
-		m.config[*key] = "false"
-	}
+	m.config[*key] = FormatBool(*value)
 }
 
 /**
@@ -236,7 +232,7 @@ func (m* MetaConfig) SetDouble(key *string, value *float64) {
 	m.configLock.Lock()
 	defer m.configLock.Unlock()
 
-	m.config[*key] = strconv.FormatFloat(*value, 'f', -1, 64)
+	m.config[*key] = FormatDouble(*value)
 }
 
 
@@ -249,12 +245,77 @@ func (m* MetaConfig) SetList(key *string, value *[]string) {
 	m.configLock.Lock()
 	defer m.configLock.Unlock()
 
+	m.config[*key] = FormatList(*value)
+}
+
+/**
+ * Set multiple values at once
+ *
+ * The values are validated before anything is applied (all-or-nothing),
+ * all of them are set under one lock acquisition.
+ * Use the Format* functions to create the values of typed fields.
+ *
+ * This operation does not write anything to disk!
+ */
+func (m* MetaConfig) SetValues(values map[string]string) error {
+	for key, value := range values {
+		if err := ValidateEntry(key, value); err!=nil {
+			return err
+		}
+	}
+
+	m.configLock.Lock()
+	defer m.configLock.Unlock()
+
+	if m.config == nil {
+		m.config = make(map[string]string)
+	}
+	for key, value := range values {
+		m.config[key] = value
+	}
+	return nil
+}
+
+/**
+ * Returns an error if the entry cannot be written in the config syntax
+ */
+func ValidateEntry(key string, value string) error {
+	if key=="" {
+		return fmt.Errorf("Empty key in batch")
+	}
+	if strings.ContainsAny(key[:1], " \t\r#/") {
+		return fmt.Errorf("Invalid start of key: %s", key)
+	}
+	if strings.ContainsAny(key, "=\n") {
+		return fmt.Errorf("Invalid character in key: %s", key)
+	}
+	if strings.Contains(value, "\"") {
+		return fmt.Errorf("Invalid character '\"' in value of key: %s", key)
+	}
+	return nil
+}
+
+// String representation of a bool value
+func FormatBool(value bool) string {
+	if value {
+		return "true"
+	}
+	return "false"
+}
+
+// String representation of a double value
+func FormatDouble(value float64) string {
+	return strconv.FormatFloat(value, 'f', -1, 64)
+}
+
+// String representation of a list value
+func FormatList(value []string) string {
 	outstr := ""
-	for _,val := range *value {
+	for _,val := range value {
 		outstr+=val
 		outstr+=","
 	}
-	m.config[*key] = outstr
+	return outstr
 }
 
 /**
@@ -20,21 +20,511 @@
 #ifndef METACONFIG_H
 #define METACONFIG_H
 
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <iterator>
+#include <cstring>
 #include <string>
+#include <string_view>
+#include <span>
+#include <charconv>
+#include <functional>
+#include <stdexcept>
 #include <fstream>
 #include <filesystem>
 #include <unordered_map>
 #include <shared_mutex>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
+#include "shared/metrics/metrics.hpp"
 #include "shared/util/strutil.hpp"
+#include "shared/util/trace.hpp"
 
 #define TMP_FILE_EXTENSION ".tmp"
+#define JOURNAL_FILE_EXTENSION ".journal"
+// Comment line in the header of the config file and the journal, a journal only applies to the config of its generation
+#define GENERATION_MARKER "# Generation "
 
 using namespace std;
 
 namespace metaconfig {
 
+	/**
+	 * Types a config value can be expected to have
+	 */
+	enum CONFIGTYPE {
+		STRING = 1,
+		BOOL = 2,
+		DOUBLE = 3,
+		LIST = 4
+	};
+
+	inline string ConfigTypeName(CONFIGTYPE type) {
+		switch (type) {
+		case BOOL: return "BOOL";
+		case DOUBLE: return "DOUBLE";
+		case LIST: return "LIST";
+		default: return "STRING";
+		}
+	}
+
+	/**
+	 * Config value with its parsed representations
+	 *
+	 * Values are untyped in the config file, so the scalar representations are parsed once when the value is set.
+	 * The list is only split on the first List() call, so values that are never read as list keep Raw as their only copy.
+	 * Reading a value never parses or allocates (except the first List() call).
+	 */
+	struct ConfigValue {
+		string Raw;
+		// True if Raw is "true" or "yes" (ignoring case)
+		bool Bool = false;
+		// True if Raw is "true", "yes", "false" or "no" (ignoring case)
+		bool ValidBool = false;
+		// Leading double of Raw (like stod), 0 if Raw does not start with a double
+		double Double = 0.0;
+		// True if Raw is a double without trailing characters
+		bool ValidDouble = false;
+
+		ConfigValue() = default;
+		explicit ConfigValue(string raw) : Raw(move(raw)) {
+			Bool = util::strutil::cmpIgnoreCaseAscii(Raw, "true") || util::strutil::cmpIgnoreCaseAscii(Raw, "yes");
+			ValidBool = Bool || util::strutil::cmpIgnoreCaseAscii(Raw, "false") || util::strutil::cmpIgnoreCaseAscii(Raw, "no");
+			parseDouble();
+		}
+
+		// Copies do not take the split list, it is split again if they are read as list
+		ConfigValue(const ConfigValue& other)
+			: Raw(other.Raw), Bool(other.Bool), ValidBool(other.ValidBool), Double(other.Double), ValidDouble(other.ValidDouble) {}
+
+		ConfigValue(ConfigValue&& other) noexcept
+			: Raw(move(other.Raw)), Bool(other.Bool), ValidBool(other.ValidBool), Double(other.Double), ValidDouble(other.ValidDouble),
+				list(other.list.exchange(nullptr, memory_order_relaxed)) {}
+
+		ConfigValue& operator=(const ConfigValue& other) {
+			if (this != &other) *this = ConfigValue(other);
+			return *this;
+		}
+
+		ConfigValue& operator=(ConfigValue&& other) noexcept {
+			Raw = move(other.Raw);
+			Bool = other.Bool;
+			ValidBool = other.ValidBool;
+			Double = other.Double;
+			ValidDouble = other.ValidDouble;
+			delete list.exchange(other.list.exchange(nullptr, memory_order_relaxed), memory_order_relaxed);
+			return *this;
+		}
+
+		~ConfigValue() {
+			delete list.load(memory_order_relaxed);
+		}
+
+		/**
+		 * Raw splitted based on ',', empty fields ("") are omitted
+		 *
+		 * The list is split on the first call and cached, concurrent readers of a snapshot may call this.
+		 */
+		const vector<string>& List() const {
+			const vector<string>* cached = list.load(memory_order_acquire);
+			if (cached) return *cached;
+			auto* parsed = new vector<string>();
+			for (string_view token : util::strutil::splitView(Raw, ',')) {
+				parsed->emplace_back(token);
+			}
+			// Another reader may have split it concurrently, the first one is kept
+			if (list.compare_exchange_strong(cached, parsed, memory_order_acq_rel, memory_order_acquire)) return *parsed;
+			delete parsed;
+			return *cached;
+		}
+
+		/**
+		 * Returns true if the value is valid for the type
+		 */
+		bool Is(CONFIGTYPE type) const {
+			switch (type) {
+			case BOOL: return ValidBool;
+			case DOUBLE: return ValidDouble;
+			default: return true;
+			}
+		}
+
+	private:
+		// Split list, owned by the value (nullptr until List() is called)
+		mutable atomic<const vector<string>*> list = nullptr;
+
+		void parseDouble() {
+			const char* begin = Raw.data();
+			const char* end = Raw.data() + Raw.size();
+			// Accept the same leading characters as stod
+			while (begin != end && isspace((unsigned char)*begin)) begin++;
+			if (begin != end && *begin == '+') begin++;
+			auto [ptr, ec] = from_chars(begin, end, Double);
+			if (ec != errc()) {
+				Double = 0.0;
+				return;
+			}
+			while (ptr != end && isspace((unsigned char)*ptr)) ptr++;
+			ValidDouble = ptr == end;
+		}
+	};
+
+	/**
+	 * Hash enabling lookups by string_view without constructing a string
+	 */
+	struct confighash {
+		using is_transparent = void;
+		size_t operator()(string_view key) const {
+			return hash<string_view>()(key);
+		}
+	};
+
+	// Keys per shard of ConfigValues, the shard count doubles once the shards hold twice as many
+	inline constexpr size_t CONFIG_SHARD_KEYS = 128;
+
+	/**
+	 * Map of the config values, copies share the values
+	 *
+	 * Keys are distributed over shards by their hash, the shards are shared by all copies of the map.
+	 * Changing a key copies only its shard (copy-on-write), so publishing a change of a large config
+	 * copies about CONFIG_SHARD_KEYS values and one pointer per shard instead of the whole configuration.
+	 * A shard is only modified in place by the map that created it, shards received by a copy are never modified.
+	 *
+	 * Values are stored in the shards, so pointers returned by get() are valid as long as the map
+	 * (or a copy that shares the shard) is alive and the key is not changed in that map.
+	 */
+	class ConfigValues {
+		/**
+		 * Key with its hash, so a lookup hashes the key once for the shard and the buckets of the shard
+		 */
+		struct hashedkey {
+			string_view key;
+			size_t hash;
+		};
+
+		struct shardhash {
+			using is_transparent = void;
+			size_t operator()(string_view key) const { return confighash()(key); }
+			size_t operator()(const hashedkey& key) const { return key.hash; }
+		};
+
+		struct shardequal {
+			using is_transparent = void;
+			bool operator()(string_view a, string_view b) const { return a == b; }
+			bool operator()(const hashedkey& a, string_view b) const { return a.key == b; }
+			bool operator()(string_view a, const hashedkey& b) const { return a == b.key; }
+		};
+
+	public:
+		using shard = unordered_map<string, ConfigValue, shardhash, shardequal>;
+		using value_type = shard::value_type;
+
+		/**
+		 * Iterates the keys shard by shard (in no particular order)
+		 */
+		class const_iterator {
+		public:
+			using iterator_category = forward_iterator_tag;
+			using value_type = shard::value_type;
+			using difference_type = ptrdiff_t;
+			using pointer = const value_type*;
+			using reference = const value_type&;
+
+			const_iterator() = default;
+			const_iterator(const vector<shared_ptr<shard>>* shards, size_t index) : shards(shards), index(index) {
+				skipEmpty();
+			}
+
+			reference operator*() const { return *it; }
+			pointer operator->() const { return &*it; }
+
+			const_iterator& operator++() {
+				if (++it == (*shards)[index]->end()) {
+					index++;
+					skipEmpty();
+				}
+				return *this;
+			}
+
+			const_iterator operator++(int) {
+				const_iterator prev = *this;
+				++*this;
+				return prev;
+			}
+
+			bool operator==(const const_iterator& other) const {
+				if (index != other.index) return false;
+				return !shards || index >= shards->size() || it == other.it;
+			}
+
+		private:
+			const vector<shared_ptr<shard>>* shards = nullptr;
+			size_t index = 0;
+			shard::const_iterator it;
+
+			void skipEmpty() {
+				for (; index < shards->size(); index++) {
+					const auto& s = (*shards)[index];
+					if (s && !s->empty()) {
+						it = s->begin();
+						return;
+					}
+				}
+			}
+		};
+
+		ConfigValues() : shards(1), owned(1, false) {}
+
+		// Copies share all shards, a shard is copied once the copy changes one of its keys
+		ConfigValues(const ConfigValues& other)
+			: shards(other.shards), owned(other.shards.size(), false), count(other.count), shardBits(other.shardBits) {}
+
+		ConfigValues(ConfigValues&&) noexcept = default;
+
+		ConfigValues& operator=(const ConfigValues& other) {
+			if (this != &other) *this = ConfigValues(other);
+			return *this;
+		}
+
+		ConfigValues& operator=(ConfigValues&&) noexcept = default;
+
+		const_iterator begin() const { return const_iterator(&shards, 0); }
+		const_iterator end() const { return const_iterator(&shards, shards.size()); }
+
+		size_t size() const { return count; }
+		bool empty() const { return count == 0; }
+
+		/**
+		 * Get the value of the key, nullptr if the key is not found
+		 */
+		const ConfigValue* get(string_view key) const {
+			hashedkey hashed{key, confighash()(key)};
+			const auto& s = shards[shardOf(hashed.hash)];
+			if (!s) return nullptr;
+			auto it = s->find(hashed);
+			return it != s->end() ? &it->second : nullptr;
+		}
+
+		bool contains(string_view key) const {
+			return get(key) != nullptr;
+		}
+
+		/**
+		 * Prepare the shards for `keys` keys, only has an effect on an empty map
+		 */
+		void reserve(size_t keys) {
+			if (count > 0) return;
+			size_t n = bit_ceil(max<size_t>(keys / CONFIG_SHARD_KEYS, 1));
+			shards.assign(n, nullptr);
+			owned.assign(n, false);
+			shardBits = countr_zero(n);
+		}
+
+		void insert_or_assign(string key, ConfigValue value) {
+			shard& s = mutableShard(key);
+			size_t before = s.size();
+			s.insert_or_assign(move(key), move(value));
+			count += s.size() - before;
+			grow();
+		}
+
+		/**
+		 * Insert the value constructed from `args` if the key is not set yet, returns true if it was inserted
+		 *
+		 * The value is not constructed if the key exists.
+		 */
+		template <typename... Args>
+		bool try_emplace(string key, Args&&... args) {
+			if (contains(key)) return false;
+			mutableShard(key).try_emplace(move(key), forward<Args>(args)...);
+			count++;
+			grow();
+			return true;
+		}
+
+	private:
+		vector<shared_ptr<shard>> shards;
+		// True if the shard was created by this map and is not shared
+		vector<bool> owned;
+		size_t count = 0;
+		int shardBits = 0;
+
+		size_t shardOf(size_t hash) const {
+			// Fibonacci hashing, the high bits select the shard so they do not correlate with the buckets of the shard
+			return shardBits == 0 ? 0 : (hash * 0x9e3779b97f4a7c15ull) >> (64 - shardBits);
+		}
+
+		shard& mutableShard(string_view key) {
+			size_t i = shardOf(confighash()(key));
+			if (!owned[i]) {
+				shards[i] = shards[i] ? make_shared<shard>(*shards[i]) : make_shared<shard>();
+				owned[i] = true;
+			}
+			return *shards[i];
+		}
+
+		/**
+		 * Double the shards once they hold more than twice CONFIG_SHARD_KEYS keys on average
+		 *
+		 * All values are copied, this happens once per doubling of the size, so it is amortized over the inserts.
+		 */
+		void grow() {
+			if (count <= shards.size() * 2 * CONFIG_SHARD_KEYS) return;
+			ConfigValues grown;
+			grown.reserve(shards.size() * 2 * CONFIG_SHARD_KEYS);
+			for (const auto& [key, value] : *this) {
+				grown.mutableShard(key).try_emplace(key, value);
+			}
+			grown.count = count;
+			*this = move(grown);
+		}
+	};
+
+	/**
+	 * Handle of a key registered with MetaConfig::RegisterKey()
+	 *
+	 * Lookups on a handle index a flat array of the snapshot instead of hashing and comparing the key.
+	 * A handle is only valid for the MetaConfig that registered it.
+	 */
+	struct ConfigKey {
+		uint32_t Index = 0;
+		// Owned by the MetaConfig, used for snapshots published before the key was registered
+		string_view Name;
+	};
+
+	/**
+	 * Immutable version of the inmem configuration
+	 *
+	 * A snapshot is never modified after it was published, it can be read without synchronization.
+	 * Views returned by the accessors are valid as long as the snapshot is alive.
+	 * Accessors take the key as string_view or as ConfigKey handle.
+	 */
+	struct ConfigSnapshot {
+		// Incremented with every published configuration
+		uint64_t Version = 0;
+		ConfigValues Values;
+		// Values of the registered keys, indexed by ConfigKey::Index
+		vector<const ConfigValue*> Keys;
+
+		/**
+		 * Get the value of the key, nullptr if the key is not found
+		 */
+		const ConfigValue* Find(string_view key) const {
+			return Values.get(key);
+		}
+
+		const ConfigValue* Find(ConfigKey key) const {
+			if (key.Index < Keys.size()) return Keys[key.Index];
+			return Find(key.Name);
+		}
+
+		template <typename Key>
+		bool Exists(const Key& key) const {
+			return Find(key) != nullptr;
+		}
+
+		/**
+		 * Get string value of specific key, empty if the key is not found
+		 */
+		template <typename Key>
+		string_view GetString(const Key& key) const {
+			const ConfigValue* value = Find(key);
+			return value ? string_view(value->Raw) : string_view();
+		}
+
+		/**
+		 * Get bool value of specific key, false if the key is not found
+		 */
+		template <typename Key>
+		bool GetBool(const Key& key) const {
+			const ConfigValue* value = Find(key);
+			return value ? value->Bool : false;
+		}
+
+		/**
+		 * Get double value of specific key, 0 if the key is not found or invalid
+		 */
+		template <typename Key>
+		double GetDouble(const Key& key) const {
+			const ConfigValue* value = Find(key);
+			return value ? value->Double : 0.0;
+		}
+
+		/**
+		 * Get list value of specific key, empty if the key is not found
+		 */
+		template <typename Key>
+		span<const string> GetList(const Key& key) const {
+			const ConfigValue* value = Find(key);
+			return value ? span<const string>(value->List()) : span<const string>();
+		}
+	};
+
+	/**
+	 * Snapshots exchanged by ReadFromDisk()
+	 */
+	struct ConfigReload {
+		// Snapshot that was replaced by the config on disk
+		shared_ptr<const ConfigSnapshot> Previous;
+		// Snapshot of the config on disk
+		shared_ptr<const ConfigSnapshot> Loaded;
+	};
+
+	/**
+	 * Set of changes applied at once with MetaConfig::Apply()
+	 *
+	 * Values are parsed when they are added, so applying the batch only validates and publishes them.
+	 */
+	class ConfigBatch {
+	public:
+		void SetString(const string &key, const string &value) {
+			values.push_back({key, ConfigValue(value)});
+		}
+
+		void SetBool(const string &key, const bool &value) {
+			values.push_back({key, ConfigValue(value ? "true" : "false")});
+		}
+
+		void SetDouble(const string &key, const double &value) {
+			values.push_back({key, ConfigValue(to_string(value))});
+		}
+
+		void SetList(const string &key, const vector<string> &value) {
+			values.push_back({key, ConfigValue(util::strutil::unsplit(value, ','))});
+		}
+
+		bool Empty() const {
+			return values.empty();
+		}
+
+	private:
+		friend class MetaConfig;
+		vector<pair<string, ConfigValue>> values;
+	};
+
+	/**
+	 * Controls how the configuration is written to disk
+	 */
+	struct MetaConfigOptions {
+		// Append changed keys to `<path>.journal` instead of rewriting the config file on every write
+		bool Journal = false;
+		// Rewrite the config file (compaction) once the journal holds this many entries
+		size_t CompactAfter = 1024;
+		// Fsync the written file and the parent directory, so a completed write survives a crash
+		bool Fsync = false;
+		// Write to disk after every Set* / SetConfig (concurrent writes are committed together)
+		bool Persist = false;
+	};
+
 	/**
 	 * Object holding a inmem configuration
 	 *
@@ -42,6 +532,24 @@ namespace metaconfig {
 	 *
 	 * All operations that are fully thread-safe (synchronized).
 	 *
+	 * Reads are lock-free: the configuration is published as immutable ConfigSnapshot,
+	 * every thread caches the current snapshot and only reloads it if the version changed.
+	 * Writers copy the configuration, modify it and publish a new snapshot (copy-on-write).
+	 * Snapshots share the shards of their values (see ConfigValues), so a single Set* operation
+	 * only copies the shard of the key, not the whole configuration.
+	 * Use Apply() to change many keys at once.
+	 *
+	 * Values are parsed when they are set (see ConfigValue), getters return the cached representation.
+	 * Keys declared with ExpectType() are validated on every write,
+	 * invalid values are rejected instead of being read as 0 / false later.
+	 * Hot paths can register keys with RegisterKey() and read them with the returned handle.
+	 *
+	 * With MetaConfigOptions::Journal, WriteToDisk() appends only the keys changed since the last write
+	 * to `<path>.journal` (same syntax, later entries override the config file), the journal is
+	 * compacted into the config file once it grows beyond CompactAfter entries.
+	 * Config file and journal carry a generation (a comment in their header), every rewrite of the config file
+	 * increments it, so a journal left over by a crash before its removal is not replayed over the new config.
+	 *
 	 * Uses a custom parser, that parses a kind of a key-value config file (example):
 	 *
 	 * ```
@@ -60,8 +568,11 @@ namespace metaconfig {
 		/**
 		 * Initializes MetaConfig and creates the config file if not existent
 		 */
-		MetaConfig(string path) {
+		MetaConfig(string path, MetaConfigOptions options = MetaConfigOptions())
+			: configId(nextConfigId.fetch_add(1, memory_order_relaxed)), options(options) {
+			currentSnapshot.store(make_shared<const ConfigSnapshot>(), memory_order_release);
 			configPath = path;
+			journalPath = path + JOURNAL_FILE_EXTENSION;
 			// Generate file path recursively
 			filesystem::path fspath(configPath);
 			if (fspath.has_parent_path()) {
@@ -77,8 +588,7 @@ namespace metaconfig {
 		 * This operation does not read / parse anything from disk!
 		 */
 		bool Exists(const string &key) {
-			shared_lock<shared_mutex> confLock(configLock);
-			return config.find(key) != config.end();
+			return snapshot()->Exists(key);
 		}
 
 		/**
@@ -87,10 +597,25 @@ namespace metaconfig {
 		 * This operation does not read / parse anything from disk!
 		 */
 		unordered_map<string, string> GetConfig() {
-			shared_lock<shared_mutex> confLock(configLock);
+			unordered_map<string, string> config;
+			for (const auto& kv : snapshot()->Values) {
+				config.insert({kv.first, kv.second.Raw});
+			}
 			return config;
 		};
 
+		/**
+		 * Get the current configuration snapshot
+		 *
+		 * Use this to read multiple keys consistently, the snapshot is not affected by later writes.
+		 * The accessors of the snapshot return views (string_view, span) and do not allocate.
+		 *
+		 * This operation does not read / parse anything from disk!
+		 */
+		shared_ptr<const ConfigSnapshot> GetSnapshot() {
+			return currentSnapshot.load(memory_order_acquire);
+		}
+
 		/**
 		 * Get string value of specific key
 		 *
@@ -99,10 +624,7 @@ namespace metaconfig {
 		 * This operation does not read / parse anything from disk!
 		 */
 		string GetString(const string &key) {
-			shared_lock<shared_mutex> confLock(configLock);
-			auto it = config.find(key);
-			if (it != config.end()) return it->second;
-			else return "";
+			return string(snapshot()->GetString(key));
 		};
 
 		/**
@@ -115,33 +637,21 @@ namespace metaconfig {
 		 * This operation does not read / parse anything from disk!
 		 */
 		bool GetBool(const string &key) {
-			shared_lock<shared_mutex> confLock(configLock);
-		  auto it = config.find(key);
-			if (it != config.end())
-				return util::strutil::cmpIgnoreCase(it->second, "true")
-					|| util::strutil::cmpIgnoreCase(it->second, "yes");
-			else return false;
+			return snapshot()->GetBool(key);
 		}
 
 		/**
 		 * Get double value of specific key
 		 *
-		 * If the conversion fails (invalid double in config) it will return 0
+		 * If the conversion fails (invalid double in config) it will return 0,
+		 * declare the key with ExpectType() to reject invalid doubles when they are set.
 		 *
 		 * If key is not found, it will return 0 aswell
 		 *
 		 * This operation does not read / parse anything from disk!
 		 */
 		double GetDouble(const string &key) {
-			shared_lock<shared_mutex> confLock(configLock);
-			auto it = config.find(key);
-			if (it != config.end()) {
-				try {
-					return stod(it->second);
-				} catch (...) {
-					return 0.0;
-				}
-			} else return 0.0;
+			return snapshot()->GetDouble(key);
 		}
 
 		/**
@@ -155,202 +665,855 @@ namespace metaconfig {
 		 * This operation does not read / parse anything from disk!
 		 */
 		vector<string> GetList(const string &key) {
-			shared_lock<shared_mutex> confLock(configLock);
-			auto it = config.find(key);
-			if (it != config.end())
-				return util::strutil::split(it->second, ',');
-			else return vector<string>();
+			auto list = snapshot()->GetList(key);
+			return vector<string>(list.begin(), list.end());
+		}
+
+		/**
+		 * Declare the expected type of a key
+		 *
+		 * Every later write (Set*, SetConfig, ReadFromDisk) that assigns a invalid value to the key
+		 * throws a runtime error and leaves the configuration unchanged.
+		 * Missing keys are valid, use Exists() to check for required keys.
+		 *
+		 * Function will throw a runtime error if the current value is invalid
+		 */
+		void ExpectType(const string &key, CONFIGTYPE type) {
+			auto writeLock = lockWriter();
+			const ConfigValue* value = currentSnapshot.load(memory_order_acquire)->Find(key);
+			if (value && !value->Is(type)) {
+				throw runtime_error(invalidMessage(key, type));
+			}
+			schema[key] = type;
+		}
+
+		/**
+		 * Register a key and get a handle for fast lookups
+		 *
+		 * Registered keys are required: registration fails if the key is not in the configuration
+		 * and every later write (SetConfig, ReadFromDisk) that removes the key is rejected.
+		 * A `type` other than STRING is validated like ExpectType().
+		 * Registering a key multiple times returns the same handle.
+		 *
+		 * Function will throw a runtime error if the key is missing or its value is invalid
+		 */
+		ConfigKey RegisterKey(const string &key, CONFIGTYPE type = STRING) {
+			auto writeLock = lockWriter();
+			auto snap = currentSnapshot.load(memory_order_acquire);
+			const ConfigValue* value = snap->Find(key);
+			if (!value) {
+				throw runtime_error(missingMessage(key));
+			}
+			if (!value->Is(type)) {
+				throw runtime_error(invalidMessage(key, type));
+			}
+			if (type != STRING) schema[key] = type;
+
+			auto it = keyIndex.find(key);
+			if (it != keyIndex.end()) return ConfigKey{it->second, keyNames[it->second]};
+			uint32_t index = keyNames.size();
+			keyNames.push_back(key);
+			keyIndex.insert({key, index});
+			// Republish, so the current snapshot contains the slot of the new key
+			publish(snap->Values);
+			return ConfigKey{index, keyNames[index]};
+		}
+
+		bool Exists(ConfigKey key) {
+			return snapshot()->Exists(key);
+		}
+
+		string GetString(ConfigKey key) {
+			return string(snapshot()->GetString(key));
+		}
+
+		bool GetBool(ConfigKey key) {
+			return snapshot()->GetBool(key);
+		}
+
+		double GetDouble(ConfigKey key) {
+			return snapshot()->GetDouble(key);
+		}
+
+		vector<string> GetList(ConfigKey key) {
+			auto list = snapshot()->GetList(key);
+			return vector<string>(list.begin(), list.end());
+		}
+
+		/**
+		 * Apply all changes of the batch at once
+		 *
+		 * The batch is validated before anything is applied (all-or-nothing):
+		 * keys must be unique, non-empty and representable in the config syntax,
+		 * values must match the types declared with ExpectType().
+		 * All changes are published as one snapshot and written to disk at once.
+		 *
+		 * This operation does not write anything to disk (unless MetaConfigOptions::Persist is set)!
+		 *
+		 * Function will throw a runtime error if the batch is invalid, the configuration is unchanged then
+		 */
+		void Apply(const ConfigBatch &batch) {
+			TRACE_SPAN("metaconfig.apply");
+			{
+				auto writeLock = lockWriter();
+				unordered_map<string_view, bool> seen;
+				for (const auto& [key, value] : batch.values) {
+					if (!seen.insert({key, true}).second) {
+						throw runtime_error("Duplicate key in batch: " + key);
+					}
+					string invalid = invalidEntry(key, value);
+					if (!invalid.empty()) {
+						throw runtime_error(invalid);
+					}
+					auto it = schema.find(key);
+					if (it != schema.end() && !value.Is(it->second)) {
+						throw runtime_error(invalidMessage(key, it->second));
+					}
+				}
+				ConfigValues values = currentSnapshot.load(memory_order_acquire)->Values;
+				for (const auto& [key, value] : batch.values) {
+					values.insert_or_assign(key, value);
+					pendingKeys.push_back(key);
+				}
+				publish(move(values));
+			}
+			if (options.Persist) WriteToDisk();
 		}
 
 		/**
 		 * Set full configuration object
 		 *
-		 * This operation does not write anything to disk!
+		 * This operation does not write anything to disk (unless MetaConfigOptions::Persist is set)!
 		 */
 		void SetConfig(unordered_map<string, string>& map) {
-			unique_lock<shared_mutex> confLock(configLock);
-			config = map;
+			TRACE_SPAN("metaconfig.setconfig");
+			ConfigValues values;
+			values.reserve(map.size());
+			for (const auto& kv : map) {
+				values.try_emplace(kv.first, kv.second);
+			}
+			{
+				auto writeLock = lockWriter();
+				validate(values, "");
+				publish(move(values));
+				rewritePending = true;
+			}
+			if (options.Persist) WriteToDisk();
 		};
 
 		/**
 		 * Set string value to specific key
 		 *
-		 * This operation does not write anything to disk!
+		 * This operation does not write anything to disk (unless MetaConfigOptions::Persist is set)!
 		 */
 		void SetString(const string &key, const string &value) {
-			unique_lock<shared_mutex> confLock(configLock);
-			config[key] = value;
+			update(key, ConfigValue(value));
 		}
 
 		/**
 		 * Set bool value to specific key
 		 *
-		 * This operation does not write anything to disk!
+		 * This operation does not write anything to disk (unless MetaConfigOptions::Persist is set)!
 		 */
 		void SetBool(const string &key, const bool &value) {
-			unique_lock<shared_mutex> confLock(configLock);
-			if (value)
-				config[key] = "true";
-			else
-				config[key] = "false";
+			update(key, ConfigValue(value ? "true" : "false"));
 		}
 
 		/**
 		 * Set double value to specific key
 		 *
-		 * This operation does not write anything to disk!
+		 * This operation does not write anything to disk (unless MetaConfigOptions::Persist is set)!
 		 */
 		void SetDouble(const string &key, const double &value) {
-			unique_lock<shared_mutex> confLock(configLock);
-			config[key] = to_string(value);
+			update(key, ConfigValue(to_string(value)));
 		}
 
 		/**
 		 * Set list value to specific key
 		 *
-		 * This operation does not write anything to disk!
+		 * This operation does not write anything to disk (unless MetaConfigOptions::Persist is set)!
 		 */
 		void SetList(const string& key, const vector<string> &value) {
-			unique_lock<shared_mutex> confLock(configLock);
-			config[key] = util::strutil::unsplit(value, ',');
+			update(key, ConfigValue(util::strutil::unsplit(value, ',')));
 		}
 		
 		/**
 		 * Read and Parse configuration directly from disk to inmem config
 		 *
-		 * If a key is placed multiple times, only the first one is evaluated
+		 * If a key is placed multiple times, only the first one is evaluated.
+		 * Entries of the journal (if existent) override the config file, the last entry is evaluated.
+		 *
+		 * The file is read at once, keys and values are scanned as views into the buffer.
+		 *
+		 * Returns the replaced and the loaded snapshot, both taken while publishing,
+		 * so writes of other threads are not attributed to the config on disk.
 		 *
 		 * Function will throw a runtime error if it fails
 		 */
-	  void ReadFromDisk() {
+	  ConfigReload ReadFromDisk() {
+			TRACE_SPAN("metaconfig.read");
+			auto start = chrono::steady_clock::now();
 			// Read lock the file config lock
 			shared_lock<shared_mutex> fileLock(configFileLock);
-			
-			unordered_map<string, string> mapBuffer;
-			// Read config file
-			ifstream file(configPath);
-			if (!file.is_open()) {
+			fileLockWait.Observe(chrono::steady_clock::now() - start);
+
+			// Taken before reading, so a change while reading is detected as change on disk
+			diskstamp readStamp = stamp();
+			string buffer;
+			if (!readFile(configPath, buffer)) {
 				throw runtime_error("Failed to open config file at: " + configPath);
 			}
+			ConfigValues mapBuffer;
+			// Every entry has an '=', so this reserves enough buckets for all keys
+			mapBuffer.reserve(count(buffer.begin(), buffer.end(), '='));
+			bool torn = false;
+			parse(buffer, configPath, mapBuffer, false, torn);
+			uint64_t generation = readGeneration(buffer);
+
+			size_t entries = 0;
+			// A journal of another generation is already contained in the config file (or older than it)
+			bool staleJournal = false;
+			if (readFile(journalPath, buffer)) {
+				if (readGeneration(buffer) == generation) {
+					entries = parse(buffer, journalPath, mapBuffer, true, torn);
+				} else {
+					staleJournal = true;
+				}
+			}
+
+			// Publish the parsed config as new snapshot
+			auto writeLock = lockWriter();
+			validate(mapBuffer, "Failed to parse config file at: " + configPath + "\n");
+			ConfigReload reload;
+			reload.Previous = currentSnapshot.load(memory_order_acquire);
+			publish(move(mapBuffer));
+			reload.Loaded = currentSnapshot.load(memory_order_acquire);
+			// Disk and memory are equal now
+			pendingKeys.clear();
+			// Appending behind a incomplete entry would corrupt the journal, appending to a stale one would lose the entries
+			rewritePending = torn || staleJournal;
+			journalEntries = entries;
+			configGeneration = generation;
+			diskStamp = readStamp;
+			durableVersion.store(currentVersion.load(memory_order_relaxed), memory_order_release);
+			diskReads.Add();
+			diskReadDuration.Observe(chrono::steady_clock::now() - start);
+			return reload;
+		}
+		
+		/**
+		 * Writes inmem configuration directly to disk
+		 *
+		 * The configuration is taken as snapshot, writers are not blocked during the I/O.
+		 * Concurrent calls are committed together: a call returns without I/O
+		 * if another call already wrote a configuration that contains its changes.
+		 *
+		 * With MetaConfigOptions::Journal only the keys changed since the last write are appended.
+		 * The full config is rewritten to a .tmp file and renamed,
+		 * with MetaConfigOptions::Fsync the file and the parent directory are synced before returning.
+		 *
+		 * Function will throw a runtime error if it fails
+		 */ 
+		void WriteToDisk() {
+			TRACE_SPAN("metaconfig.write");
+			uint64_t target = currentVersion.load(memory_order_acquire);
+			lock_guard<mutex> commitLock(configCommitLock);
+			// Group commit, the changes of this call were written by a concurrent call
+			if (target > 0 && durableVersion.load(memory_order_acquire) >= target) {
+				groupCommits.Add();
+				return;
+			}
+
+			auto start = chrono::steady_clock::now();
+			// Write lock the file config lock
+			unique_lock<shared_mutex> fileLock(configFileLock);
+			fileLockWait.Observe(chrono::steady_clock::now() - start);
+			// Take the snapshot and its changes, the I/O is done without holding the write lock
+			shared_ptr<const ConfigSnapshot> snap;
+			vector<string> keys;
+			bool replace, compact;
+			uint64_t generation;
+			{
+				auto writeLock = lockWriter();
+				snap = currentSnapshot.load(memory_order_acquire);
+				generation = configGeneration;
+				keys.swap(pendingKeys);
+				replace = !options.Journal || rewritePending;
+				compact = journalEntries + keys.size() > options.CompactAfter;
+				rewritePending = false;
+			}
+
+			try {
+				if (replace) {
+					// The journal does not describe the new config (e.g. removed keys),
+					// it is removed after the new config is durable and ignored (older generation) if that fails
+					writeConfig(*snap, generation + 1);
+					removeJournal();
+				} else if (compact) {
+					// Journal and config stay consistent if the process crashes before the journal is removed
+					appendJournal(*snap, keys, generation);
+					writeConfig(*snap, generation + 1);
+					removeJournal();
+				} else {
+					appendJournal(*snap, keys, generation);
+				}
+			} catch (...) {
+				// The changes are lost for the journal, the next write rewrites the full config
+				auto writeLock = lockWriter();
+				rewritePending = true;
+				throw;
+			}
+			durableVersion.store(snap->Version, memory_order_release);
+			diskstamp writeStamp = stamp();
+			auto writeLock = lockWriter();
+			diskStamp = writeStamp;
+			diskWrites.Add();
+			diskWriteDuration.Observe(chrono::steady_clock::now() - start);
+		}
+
+		/**
+		 * Returns true if the config file or the journal changed on disk since the last ReadFromDisk / WriteToDisk
+		 *
+		 * Changes are detected by inode, size and modification time of the files.
+		 */
+		bool ChangedOnDisk() {
+			shared_lock<shared_mutex> fileLock(configFileLock);
+			diskstamp current = stamp();
+			auto writeLock = lockWriter();
+			return current != diskStamp;
+		}
+
+		/**
+		 * Get the path of the config file
+		 */
+		const string& GetPath() const {
+			return configPath;
+		}
+
+		/**
+		 * Write the metrics of the config, the metrics are named `<prefix>_...`
+		 *
+		 * This is thread-safe, register it as metrics::MetricCollector to export it.
+		 */
+		void WriteMetrics(metrics::MetricWriter& writer, string_view prefix = "cthulhu_metaconfig") const {
+			string p(prefix);
+			uint64_t reads = 0;
+			{
+				lock_guard<mutex> lock(readersLock);
+				for (const auto& [_, counter] : readers) reads += counter->value.load(memory_order_relaxed);
+			}
+			writer.WriteCounter(p + "_reads_total", "Reads of config values.", reads);
+			writer.WriteCounter(p + "_writes_total", "Published changes of the inmem configuration.", writes.Value());
+			writer.WriteGauge(p + "_keys", "Keys in the current configuration.", currentSnapshot.load(memory_order_acquire)->Values.size());
+			writer.WriteHistogram(p + "_write_lock_wait_seconds", "Time writers waited for the write lock.", writeLockWait);
+			writer.WriteHistogram(p + "_file_lock_wait_seconds", "Time disk reads and writes waited for the file lock.", fileLockWait);
+			writer.WriteCounter(p + "_disk_reads_total", "Completed ReadFromDisk calls.", diskReads.Value());
+			writer.WriteCounter(p + "_disk_writes_total", "WriteToDisk calls that wrote to disk.", diskWrites.Value());
+			writer.WriteCounter(p + "_disk_group_commits_total", "WriteToDisk calls committed by a concurrent call.", groupCommits.Value());
+			writer.WriteHistogram(p + "_disk_read_duration_seconds", "Duration of ReadFromDisk.", diskReadDuration);
+			writer.WriteHistogram(p + "_disk_write_duration_seconds", "Duration of WriteToDisk.", diskWriteDuration);
+		}
+
+	private:
+		/**
+		 * Identity of a file on disk
+		 */
+		struct filestamp {
+			bool exists = false;
+			ino_t inode = 0;
+			off_t size = 0;
+			int64_t mtime = 0;
+			bool operator==(const filestamp&) const = default;
+		};
+
+		struct diskstamp {
+			filestamp config;
+			filestamp journal;
+			bool operator==(const diskstamp&) const = default;
+		};
+
+		/**
+		 * Reads of one thread, only written by that thread (no atomic read-modify-write)
+		 */
+		struct alignas(64) readcounter {
+			atomic<uint64_t> value = 0;
+
+			void add() {
+				value.store(value.load(memory_order_relaxed) + 1, memory_order_relaxed);
+			}
+		};
+
+		/**
+		 * Snapshot cached by a thread
+		 */
+		struct snapshotref {
+			uint64_t configId;
+			shared_ptr<const ConfigSnapshot> snap;
+			shared_ptr<readcounter> reads;
+		};
+
+		// Ids identify the MetaConfig in the thread local caches (addresses may be reused)
+		static inline atomic<uint64_t> nextConfigId = 1;
+		static inline thread_local vector<snapshotref> snapshotCache;
+
+		uint64_t configId;
+		// Mutex lock for the configuration file
+		shared_mutex configFileLock;
+		// Serializes writers of the inmem configuration (readers never lock)
+		mutex configWriteLock;
+		// Serializes WriteToDisk calls (group commit)
+		mutex configCommitLock;
+		MetaConfigOptions options;
+		// Path of the configuration
+		string configPath;
+		string journalPath;
+		// Keys changed since the last write to disk (guarded by the configWriteLock)
+		vector<string> pendingKeys;
+		// The next write must rewrite the full config, e.g. because keys were removed (guarded by the configWriteLock)
+		bool rewritePending = true;
+		// Entries in the journal file (guarded by the configWriteLock)
+		size_t journalEntries = 0;
+		// Generation of the config file on disk (guarded by the configWriteLock)
+		uint64_t configGeneration = 0;
+		// Files of the last ReadFromDisk / WriteToDisk (guarded by the configWriteLock)
+		diskstamp diskStamp;
+		// Version of the last snapshot written to or read from disk
+		atomic<uint64_t> durableVersion = 0;
+		// In memory configuration object
+		atomic<shared_ptr<const ConfigSnapshot>> currentSnapshot;
+		// Version of the currentSnapshot, readers compare it with their cached snapshot
+		// Loading this does not write to shared memory (unlike copying the shared_ptr)
+		atomic<uint64_t> currentVersion = 0;
+		// Expected types of keys (guarded by the configWriteLock)
+		unordered_map<string, CONFIGTYPE> schema;
+		// Registered keys, deque keeps the names referenced by handles stable (guarded by the configWriteLock)
+		deque<string> keyNames;
+		unordered_map<string, uint32_t, confighash, equal_to<>> keyIndex;
+		// Read counters of the threads, summed by WriteMetrics (the map is only locked on a cache miss)
+		mutable mutex readersLock;
+		unordered_map<thread::id, shared_ptr<readcounter>> readers;
+		// Metrics, updated lock-free
+		metrics::Counter writes;
+		metrics::Counter diskReads;
+		metrics::Counter diskWrites;
+		metrics::Counter groupCommits;
+		metrics::Histogram writeLockWait;
+		metrics::Histogram fileLockWait;
+		metrics::Histogram diskReadDuration;
+		metrics::Histogram diskWriteDuration;
+
+		/**
+		 * Get the current snapshot from the cache of the calling thread
+		 *
+		 * The pointer is valid until the next call on the same thread.
+		 * A thread holds a outdated snapshot until its next read.
+		 */
+		const ConfigSnapshot* snapshot() {
+			uint64_t version = currentVersion.load(memory_order_acquire);
+			for (auto& ref : snapshotCache) {
+				if (ref.configId != configId) continue;
+				ref.reads->add();
+				if (ref.snap->Version != version) {
+					ref.snap = currentSnapshot.load(memory_order_acquire);
+				}
+				return ref.snap.get();
+			}
+			// Drop snapshots no longer published by any MetaConfig (outdated or destroyed)
+			erase_if(snapshotCache, [](const snapshotref& ref) { return ref.snap.use_count() == 1; });
+			shared_ptr<readcounter> counter;
+			{
+				// A dropped entry of this config is recreated with the counter it had
+				lock_guard<mutex> lock(readersLock);
+				auto& slot = readers[this_thread::get_id()];
+				if (!slot) slot = make_shared<readcounter>();
+				counter = slot;
+			}
+			counter->add();
+			snapshotCache.push_back({configId, currentSnapshot.load(memory_order_acquire), move(counter)});
+			return snapshotCache.back().snap.get();
+		}
+
+		/**
+		 * Publish a new snapshot of the configuration
+		 *
+		 * Must be called while holding the configWriteLock
+		 */
+		void publish(ConfigValues values) {
+			auto snap = make_shared<ConfigSnapshot>();
+			snap->Version = currentVersion.load(memory_order_relaxed) + 1;
+			snap->Values = move(values);
+			snap->Keys.reserve(keyNames.size());
+			for (const auto& name : keyNames) {
+				snap->Keys.push_back(snap->Find(name));
+			}
+			uint64_t version = snap->Version;
+			// Snapshot is stored before the version, so readers that see the version get the snapshot
+			currentSnapshot.store(move(snap), memory_order_release);
+			currentVersion.store(version, memory_order_release);
+			writes.Add();
+		}
+
+		/**
+		 * Lock the configWriteLock, the time waited for it is recorded in the writeLockWait histogram
+		 *
+		 * The clock is only read if the lock is contended.
+		 */
+		unique_lock<mutex> lockWriter() {
+			unique_lock<mutex> lock(configWriteLock, try_to_lock);
+			if (lock.owns_lock()) {
+				writeLockWait.Observe(0);
+				return lock;
+			}
+			auto start = chrono::steady_clock::now();
+			lock.lock();
+			writeLockWait.Observe(chrono::steady_clock::now() - start);
+			return lock;
+		}
+
+		/**
+		 * Copy the configuration, set the key and publish it
+		 *
+		 * The copy shares the values with the current snapshot, only the shard of the key is copied.
+		 * The key is recorded for the journal of the next WriteToDisk().
+		 */
+		void update(const string &key, ConfigValue value) {
+			TRACE_SPAN("metaconfig.set");
+			{
+				auto writeLock = lockWriter();
+				auto it = schema.find(key);
+				if (it != schema.end() && !value.Is(it->second)) {
+					throw runtime_error(invalidMessage(key, it->second));
+				}
+				ConfigValues values = currentSnapshot.load(memory_order_acquire)->Values;
+				values.insert_or_assign(key, move(value));
+				publish(move(values));
+				pendingKeys.push_back(key);
+			}
+			if (options.Persist) WriteToDisk();
+		}
+
+		/**
+		 * Throws a runtime error (prefixed with `context`) if a registered key is missing or a value does not match its expected type
+		 *
+		 * Must be called while holding the configWriteLock
+		 */
+		void validate(const ConfigValues& values, const string& context) {
+			for (const auto& name : keyNames) {
+				if (!values.contains(name)) {
+					throw runtime_error(context + missingMessage(name));
+				}
+			}
+			for (const auto& [key, type] : schema) {
+				const ConfigValue* value = values.get(key);
+				if (value && !value->Is(type)) {
+					throw runtime_error(context + invalidMessage(key, type));
+				}
+			}
+		}
 
-			// Char buffer
-			char c;
+		/**
+		 * Read the whole file into the buffer, returns false if the file cannot be opened
+		 */
+		static bool readFile(const string &path, string &buffer) {
+			ifstream file(path, ios::binary);
+			if (!file.is_open()) return false;
+			file.seekg(0, ios::end);
+			buffer.assign(max<streamoff>(file.tellg(), 0), '\0');
+			file.seekg(0, ios::beg);
+			file.read(buffer.data(), buffer.size());
+			buffer.resize(file.gcount());
+			return true;
+		}
+
+		/**
+		 * Parse the buffer into the values, returns the number of parsed entries
+		 *
+		 * Entries of the config file do not override existing keys, entries of the `journal` do.
+		 * A incomplete last entry of the journal (crash while appending) is ignored and reported as `torn`.
+		 */
+		size_t parse(const string &buffer, const string &path, ConfigValues &values, bool journal, bool &torn) {
+			const char* cur = buffer.data();
+			const char* end = buffer.data() + buffer.size();
 			// Keeps track of lines for debug messages
 			int lineCount = 0;
-			// Current key buffer
-			string curKey;
-			// Current value buffer
-			string curVal;
+			size_t entries = 0;
+			torn = false;
 
-			// Iterate over chars
-			while (file.get(c)) {
+			while (cur != end) {
+				char c = *cur;
 				// Skip newline
 				if (c=='\n') {
 					lineCount++;
+					cur++;
 					continue;
 				}
 				// Skip space, tab
 				if (c==' '||c=='\t'||c=='\r') {
+					cur++;
 					continue;
 				}
 				// # | / indicate a comment
 				if (c=='#'||c=='/') {
 					// Skip til EOF or newline
-					while (file.get(c)&&c!='\n');
+					const char* newline = scan(cur, end, '\n');
+					cur = newline == end ? end : newline + 1;
 					lineCount++;
 					continue;
 				}
 
-				// Eat key
-				curKey = "";
-				do {
-					curKey+=c;
-					// EOF or newline in key is not allowed
-					if (!file.get(c)||c=='\n') {
-						throw runtime_error(
-							"Failed to parse config file at: "
-							+ configPath + "\n"
-							+ "Unexpected EOF or newline on line: " + to_string(lineCount)
-						);
-					}
-					// Read until '=' char
-				} while (c!='=');
+				// Eat key, it starts with the current char and ends before the next '=' char
+				const char* keyEnd = scan(cur + 1, end, '=');
+				const char* newline = scan(cur + 1, keyEnd, '\n');
+				if (journal && keyEnd == end && newline == end) {
+					torn = true;
+					break;
+				}
+				// EOF or newline in key is not allowed
+				if (keyEnd == end || newline != keyEnd) {
+					throw runtime_error(
+						"Failed to parse config file at: "
+						+ path + "\n"
+						+ "Unexpected EOF or newline on line: " + to_string(lineCount)
+					);
+				}
+				string_view curKey(cur, keyEnd - cur);
 
-				// Read next char which is expected to be '"'
-				if (!file.get(c)||c!='"') {
+				// Next char is expected to be '"'
+				cur = keyEnd + 1;
+				if (journal && cur == end) {
+					torn = true;
+					break;
+				}
+				if (cur == end || *cur != '"') {
 					throw runtime_error(
 					 	"Failed to parse config file at: "
-					  + configPath + "\n"
+					  + path + "\n"
 						+ "Expected '\"' after '=' on line: " + to_string(lineCount)
 					);
 				}
-				
-				// Eat value
-				curVal = "";
-				while (true) {
-					// EOF is not expected in value, every other char can be used
-					if (!file.get(c)) {
-						throw runtime_error(
-							"Failed to parse config file at: "
-							+ configPath + "\n"
-							+ "Unexpected EOF on line: " + to_string(lineCount)
-					  );
-						// Read until '"' char 
-					} else if (c=='"') break;
-					// Add linecount
-					if (c=='\n') lineCount++;
-					curVal+=c;
-				};
-				// Use insert, first key inserted is valid, other same keys are invalidated
-				mapBuffer.insert({curKey, curVal});
-			}
-			// Write lock the inmem config lock
-			unique_lock<shared_mutex> confLock(configLock);
-			config = mapBuffer;
+				cur++;
+
+				// Eat value, every char except '"' can be used
+				const char* valEnd = scan(cur, end, '"');
+				if (journal && valEnd == end) {
+					torn = true;
+					break;
+				}
+				// Add linecount
+				lineCount += count(cur, valEnd, '\n');
+				// EOF is not expected in value
+				if (valEnd == end) {
+					throw runtime_error(
+						"Failed to parse config file at: "
+						+ path + "\n"
+						+ "Unexpected EOF on line: " + to_string(lineCount)
+					);
+				}
+				string_view curVal(cur, valEnd - cur);
+				cur = valEnd + 1;
+				entries++;
+
+				if (journal) {
+					values.insert_or_assign(string(curKey), ConfigValue(string(curVal)));
+				} else {
+					// Use try_emplace, first key inserted is valid, other same keys are invalidated (and not parsed)
+					values.try_emplace(string(curKey), string(curVal));
+				}
+			}
+			return entries;
 		}
-		
+
 		/**
-		 * Writes inmem configuration directly to disk
+		 * Get the generation of a config file or journal, 0 if it has none (written by older versions)
 		 *
-		 * Function will throw a runtime error if it fails
-		 */ 
-		void WriteToDisk() {
-			// Write lock the file config lock
-			unique_lock<shared_mutex> fileLock(configFileLock);
-			// Read lock the inmem config lock
-			shared_lock<shared_mutex> confLock(configLock);
-			
-			// Open tmp config file
-			ofstream file(configPath + TMP_FILE_EXTENSION, ofstream::out | ofstream::trunc);
-			if (!file.is_open()) {
-				throw runtime_error("Failed to open config file at: " + configPath);
+		 * The marker is searched in the leading comment lines.
+		 */
+		static uint64_t readGeneration(const string &buffer) {
+			constexpr string_view marker = GENERATION_MARKER;
+			size_t pos = 0;
+			while (pos < buffer.size() && (buffer[pos] == '#' || buffer[pos] == '/')) {
+				size_t newline = buffer.find('\n', pos);
+				if (newline == string::npos) newline = buffer.size();
+				string_view line(buffer.data() + pos, newline - pos);
+				if (line.starts_with(marker)) {
+					uint64_t generation = 0;
+					from_chars(line.data() + marker.size(), line.data() + line.size(), generation);
+					return generation;
+				}
+				pos = newline + 1;
 			}
+			return 0;
+		}
 
-			// Insert deparsed configuration
-			file << "# Manual changes to configuration may be overwritten\n";
-			file << "# Consider using Meta Hook from the Cthulhu component\n";
-			for (auto kv : config) {
-				file << kv.first << "=" << "\"" << kv.second << "\"" << "\n";
-			}
-			file << "# End of config" << endl;
+		/**
+		 * Write the entry of a key in the config syntax
+		 */
+		static void appendEntry(string &out, const string &key, const ConfigValue &value) {
+			out += key;
+			out += "=\"";
+			out += value.Raw;
+			out += "\"\n";
+		}
 
-			// Close stream manually, because it will be accessed by the fs::rename below
-			file.close();
+		/**
+		 * Rewrite the config file with the snapshot (through a .tmp file and rename)
+		 *
+		 * With MetaConfigOptions::Fsync the file is synced before the rename and the directory after it,
+		 * so the config of the generation is durable when the function returns.
+		 * Must be called while holding the exclusive configFileLock
+		 */
+		void writeConfig(const ConfigSnapshot &snap, uint64_t generation) {
+			string out;
+			string header = "# Manual changes to configuration may be overwritten\n"
+				"# Consider using Meta Hook from the Cthulhu component\n"
+				GENERATION_MARKER + to_string(generation) + "\n";
+			string footer = "# End of config\n";
+			size_t size = header.size() + footer.size();
+			for (const auto& kv : snap.Values) {
+				size += kv.first.size() + kv.second.Raw.size() + 4;
+			}
+			out.reserve(size);
+			out += header;
+			for (const auto& kv : snap.Values) {
+				appendEntry(out, kv.first, kv.second);
+			}
+			out += footer;
 
+			string tmpPath = configPath + TMP_FILE_EXTENSION;
+			writeFile(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, out);
 			// Move tmp config to config
 			// This prevents file corruption on unexpected application crashes (e.g. shutdown while writing).
-			filesystem::rename(configPath + TMP_FILE_EXTENSION, configPath);
+			filesystem::rename(tmpPath, configPath);
+			if (options.Fsync) syncParent();
+			auto writeLock = lockWriter();
+			configGeneration = generation;
 		}
 
-	private:
-		// Mutex lock for the configuration file
-		shared_mutex configFileLock;
-		// Mutex lock for the inmem configuration
-		shared_mutex configLock;
-		// Path of the configuration
-		string configPath;
-		// In memory configuration object
-		unordered_map<string, string> config;
+		/**
+		 * Append the entries of the keys to the journal
+		 *
+		 * Must be called while holding the exclusive configFileLock
+		 */
+		void appendJournal(const ConfigSnapshot &snap, vector<string> &keys, uint64_t generation) {
+			if (keys.empty()) return;
+			sort(keys.begin(), keys.end());
+			keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+			bool created = !filesystem::exists(journalPath);
+			string out;
+			if (created) out += GENERATION_MARKER + to_string(generation) + "\n";
+			size_t entries = 0;
+			for (const auto& key : keys) {
+				const ConfigValue* value = snap.Find(key);
+				if (!value) continue;
+				appendEntry(out, key, *value);
+				entries++;
+			}
+			writeFile(journalPath, O_WRONLY | O_CREAT | O_APPEND, out);
+			if (options.Fsync && created) syncParent();
+
+			auto writeLock = lockWriter();
+			journalEntries += entries;
+		}
+
+		/**
+		 * Remove the journal, its entries must be contained in the config file
+		 *
+		 * Must be called while holding the exclusive configFileLock
+		 */
+		void removeJournal() {
+			error_code ec;
+			bool removed = filesystem::remove(journalPath, ec);
+			if (removed && options.Fsync) syncParent();
+			auto writeLock = lockWriter();
+			journalEntries = 0;
+			// A remaining journal is of an older generation, appending to it would lose the entries
+			if (ec) rewritePending = true;
+		}
+
+		/**
+		 * Write the data to the file opened with `flags`, syncs the file with MetaConfigOptions::Fsync
+		 */
+		void writeFile(const string &path, int flags, const string &data) {
+			int fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+			if (fd < 0) {
+				throw runtime_error("Failed to open config file at: " + path);
+			}
+			size_t written = 0;
+			while (written < data.size()) {
+				ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+				if (n < 0 && errno == EINTR) continue;
+				if (n < 0) {
+					::close(fd);
+					throw runtime_error("Failed to write config file at: " + path);
+				}
+				written += n;
+			}
+			if (options.Fsync && ::fsync(fd) != 0) {
+				::close(fd);
+				throw runtime_error("Failed to sync config file at: " + path);
+			}
+			if (::close(fd) != 0) {
+				throw runtime_error("Failed to write config file at: " + path);
+			}
+		}
+
+		static filestamp stampFile(const string &path) {
+			struct stat st;
+			if (::stat(path.c_str(), &st) != 0) return filestamp();
+			return filestamp{true, st.st_ino, st.st_size, (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec};
+		}
+
+		diskstamp stamp() const {
+			return diskstamp{stampFile(configPath), stampFile(journalPath)};
+		}
+
+		/**
+		 * Sync the parent directory, so renames and created files of the config are durable
+		 */
+		void syncParent() {
+			filesystem::path fspath(configPath);
+			string dir = fspath.has_parent_path() ? fspath.parent_path().string() : ".";
+			int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd < 0) {
+				throw runtime_error("Failed to open config directory at: " + dir);
+			}
+			int err = ::fsync(fd);
+			::close(fd);
+			if (err != 0) {
+				throw runtime_error("Failed to sync config directory at: " + dir);
+			}
+		}
+
+		/**
+		 * Find the first `c` in [begin, end) with memchr, returns end if there is none
+		 */
+		static const char* scan(const char* begin, const char* end, char c) {
+			const void* found = memchr(begin, c, end - begin);
+			return found ? static_cast<const char*>(found) : end;
+		}
+
+		/**
+		 * Returns the reason if the entry cannot be written in the config syntax, empty if it is valid
+		 */
+		static string invalidEntry(const string &key, const ConfigValue &value) {
+			if (key.empty()) return "Empty key in batch";
+			char first = key[0];
+			if (first == ' ' || first == '\t' || first == '\r' || first == '#' || first == '/') {
+				return "Invalid start of key: " + key;
+			}
+			if (key.find_first_of("=\n") != string::npos) return "Invalid character in key: " + key;
+			if (value.Raw.find('"') != string::npos) return "Invalid character '\"' in value of key: " + key;
+			return "";
+		}
+
+		static string missingMessage(const string &key) {
+			return "Missing registered key: " + key;
+		}
+
+		static string invalidMessage(const string &key, CONFIGTYPE type) {
+			return "Invalid " + ConfigTypeName(type) + " value for key: " + key;
+		}
 	};
 }
 
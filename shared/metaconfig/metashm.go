@@ -0,0 +1,308 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+package metaconfig
+
+import (
+	"encoding/binary"
+	"fmt"
+	"math"
+	"os"
+	"strings"
+	"sync/atomic"
+	"syscall"
+	"unsafe"
+)
+
+// Layout of the shared config file, see metashm.hpp
+const (
+	METASHM_MAGIC uint32 = 0x48534d43
+	METASHM_VERSION uint32 = 1
+	METASHM_HEADER_SIZE = 64
+	METASHM_SLOT_HEADER_SIZE = 32
+	METASHM_ENTRY_SIZE = 40
+	METASHM_LIST_ITEM_SIZE = 8
+	METASHM_FLAG_BOOL uint32 = 1
+	METASHM_FLAG_VALID_BOOL uint32 = 2
+	METASHM_FLAG_VALID_DOUBLE uint32 = 4
+)
+
+/**
+ * Read-only mapping of a shared config published by the C++ MetaShmWriter
+ *
+ * Reads never lock or parse, they only retry if the writer replaced the slot while it was read.
+ */
+type MetaShm struct {
+	path string
+	data []byte
+	slotSize uint64
+	ino uint64
+}
+
+/**
+ * View of one published configuration in the shared memory
+ *
+ * Strings returned by the snapshot point into the mapping (no copies),
+ * they are only consistent inside MetaShm.Read() and must not be kept.
+ */
+type ShmSnapshot struct {
+	slot []byte
+	count uint32
+	listCount uint32
+}
+
+/**
+ * Map the shared config at path read-only
+ */
+func OpenMetaShm(path string) (*MetaShm, error) {
+	file, err := os.Open(path)
+	if err!=nil {
+		return nil, err
+	}
+	defer file.Close()
+	info, err := file.Stat()
+	if err!=nil {
+		return nil, err
+	}
+	if info.Size() < METASHM_HEADER_SIZE {
+		return nil, fmt.Errorf("Invalid shared config at: %s", path)
+	}
+	data, err := syscall.Mmap(int(file.Fd()), 0, int(info.Size()), syscall.PROT_READ, syscall.MAP_SHARED)
+	if err!=nil {
+		return nil, err
+	}
+	m := &MetaShm{path: path, data: data}
+	if stat, ok := info.Sys().(*syscall.Stat_t); ok {
+		m.ino = stat.Ino
+	}
+	m.slotSize = binary.LittleEndian.Uint64(data[8:])
+	if binary.LittleEndian.Uint32(data[0:])!=METASHM_MAGIC || binary.LittleEndian.Uint32(data[4:])!=METASHM_VERSION ||
+		m.slotSize < METASHM_SLOT_HEADER_SIZE || uint64(len(data)) < METASHM_HEADER_SIZE+2*m.slotSize {
+		syscall.Munmap(data)
+		return nil, fmt.Errorf("Unsupported shared config layout at: %s", path)
+	}
+	return m, nil
+}
+
+/**
+ * Unmap the shared config, snapshots must not be used afterwards
+ */
+func (m* MetaShm) Close() error {
+	return syscall.Munmap(m.data)
+}
+
+func (m* MetaShm) atomicAt(off uint64) *uint64 {
+	return (*uint64)(unsafe.Pointer(&m.data[off]))
+}
+
+/**
+ * Call fn with a consistent snapshot
+ *
+ * fn is called again if the writer replaced the snapshot while it ran,
+ * so it must not have side effects and must not keep the strings of the snapshot.
+ */
+func (m* MetaShm) Read(fn func(snap *ShmSnapshot)) {
+	for {
+		generation := atomic.LoadUint64(m.atomicAt(16))
+		off := METASHM_HEADER_SIZE + (generation%2)*m.slotSize
+		seq := atomic.LoadUint64(m.atomicAt(off))
+		// The writer already moved on and overwrites the slot
+		if seq!=2*generation {
+			continue
+		}
+		slot := m.data[off : off+m.slotSize]
+		snap := &ShmSnapshot{slot: slot}
+		snap.count = binary.LittleEndian.Uint32(slot[16:])
+		if maxCount := uint32((m.slotSize - METASHM_SLOT_HEADER_SIZE) / METASHM_ENTRY_SIZE); snap.count > maxCount {
+			snap.count = maxCount
+		}
+		snap.listCount = binary.LittleEndian.Uint32(slot[20:])
+		fn(snap)
+		// Atomic loads are sequentially consistent in go, the data reads can not be moved after it
+		if atomic.LoadUint64(m.atomicAt(off))==seq {
+			return
+		}
+	}
+}
+
+/**
+ * Get the published generation, it is incremented with every publish
+ */
+func (m* MetaShm) Generation() uint64 {
+	return atomic.LoadUint64(m.atomicAt(16))
+}
+
+/**
+ * Returns true if the writer replaced the file (e.g. with another slot size), reopen the MetaShm then
+ */
+func (m* MetaShm) Stale() bool {
+	info, err := os.Stat(m.path)
+	if err!=nil {
+		return true
+	}
+	stat, ok := info.Sys().(*syscall.Stat_t)
+	return ok && stat.Ino!=m.ino
+}
+
+func (m* MetaShm) Exists(key *string) bool {
+	var exists bool
+	m.Read(func(snap *ShmSnapshot) { exists = snap.Exists(key) })
+	return exists
+}
+
+/**
+ * Get a copy of the string value of specific key, empty if the key is not found
+ */
+func (m* MetaShm) GetString(key *string) string {
+	var val string
+	m.Read(func(snap *ShmSnapshot) { val = strings.Clone(snap.GetString(key)) })
+	return val
+}
+
+func (m* MetaShm) GetBool(key *string) bool {
+	var val bool
+	m.Read(func(snap *ShmSnapshot) { val = snap.GetBool(key) })
+	return val
+}
+
+func (m* MetaShm) GetDouble(key *string) float64 {
+	var val float64
+	m.Read(func(snap *ShmSnapshot) { val = snap.GetDouble(key) })
+	return val
+}
+
+/**
+ * Get a copy of the list value of specific key, empty if the key is not found
+ */
+func (m* MetaShm) GetList(key *string) []string {
+	var val []string
+	m.Read(func(snap *ShmSnapshot) {
+		val = snap.GetList(key)
+		for i := range val {
+			val[i] = strings.Clone(val[i])
+		}
+	})
+	return val
+}
+
+/**
+ * Version of the MetaConfig snapshot that was published
+ */
+func (s* ShmSnapshot) Version() uint64 {
+	return binary.LittleEndian.Uint64(s.slot[8:])
+}
+
+/**
+ * Number of keys
+ */
+func (s* ShmSnapshot) Size() int {
+	return int(s.count)
+}
+
+func (s* ShmSnapshot) Exists(key *string) bool {
+	return s.find(*key) >= 0
+}
+
+/**
+ * Get string value of specific key, empty if the key is not found
+ */
+func (s* ShmSnapshot) GetString(key *string) string {
+	entry := s.find(*key)
+	if entry < 0 {
+		return ""
+	}
+	return s.str(entry+8)
+}
+
+/**
+ * Get bool value of specific key, false if the key is not found
+ */
+func (s* ShmSnapshot) GetBool(key *string) bool {
+	entry := s.find(*key)
+	return entry >= 0 && binary.LittleEndian.Uint32(s.slot[entry+24:])&METASHM_FLAG_BOOL!=0
+}
+
+/**
+ * Get double value of specific key, 0 if the key is not found or invalid
+ */
+func (s* ShmSnapshot) GetDouble(key *string) float64 {
+	entry := s.find(*key)
+	if entry < 0 {
+		return 0.0
+	}
+	return math.Float64frombits(binary.LittleEndian.Uint64(s.slot[entry+32:]))
+}
+
+/**
+ * Get list value of specific key, empty if the key is not found
+ */
+func (s* ShmSnapshot) GetList(key *string) []string {
+	list := []string{}
+	entry := s.find(*key)
+	if entry < 0 {
+		return list
+	}
+	first := binary.LittleEndian.Uint32(s.slot[entry+16:])
+	items := binary.LittleEndian.Uint32(s.slot[entry+20:])
+	if first > s.listCount || items > s.listCount-first {
+		return list
+	}
+	base := METASHM_SLOT_HEADER_SIZE + int(s.count)*METASHM_ENTRY_SIZE
+	for i := uint32(0); i < items; i++ {
+		off := base + int(first+i)*METASHM_LIST_ITEM_SIZE
+		if off+METASHM_LIST_ITEM_SIZE > len(s.slot) {
+			break
+		}
+		list = append(list, s.str(off))
+	}
+	return list
+}
+
+/**
+ * Read a (offset, length) pair and return the string it refers to (bounds checked against torn reads)
+ */
+func (s* ShmSnapshot) str(ref int) string {
+	off := uint64(binary.LittleEndian.Uint32(s.slot[ref:]))
+	length := uint64(binary.LittleEndian.Uint32(s.slot[ref+4:]))
+	if off > uint64(len(s.slot)) || length > uint64(len(s.slot))-off || length==0 {
+		return ""
+	}
+	return unsafe.String(&s.slot[off], int(length))
+}
+
+/**
+ * Binary search the entry offset of the key, -1 if the key is not found
+ */
+func (s* ShmSnapshot) find(key string) int {
+	low, high := 0, int(s.count)
+	for low < high {
+		mid := low + (high-low)/2
+		entry := METASHM_SLOT_HEADER_SIZE + mid*METASHM_ENTRY_SIZE
+		cur := s.str(entry)
+		if cur==key {
+			return entry
+		}
+		if cur < key {
+			low = mid + 1
+		} else {
+			high = mid
+		}
+	}
+	return -1
+}
@@ -0,0 +1,568 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef METASHM_H
+#define METASHM_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "shared/metaconfig/metaconfig.hpp"
+
+using namespace std;
+
+namespace metaconfig {
+
+	// Identifies a shared config file ("CMSH")
+	inline constexpr uint32_t METASHM_MAGIC = 0x48534d43;
+	// Version of the binary layout, readers reject files with another version
+	inline constexpr uint32_t METASHM_VERSION = 1;
+	inline constexpr size_t METASHM_HEADER_SIZE = 64;
+	inline constexpr size_t METASHM_SLOT_HEADER_SIZE = 32;
+	inline constexpr size_t METASHM_ENTRY_SIZE = 40;
+	inline constexpr size_t METASHM_LIST_ITEM_SIZE = 8;
+	// Entry flags, the parsed representations of ConfigValue
+	inline constexpr uint32_t METASHM_FLAG_BOOL = 1;
+	inline constexpr uint32_t METASHM_FLAG_VALID_BOOL = 2;
+	inline constexpr uint32_t METASHM_FLAG_VALID_DOUBLE = 4;
+
+	static_assert(endian::native == endian::little, "The shared config layout is little endian");
+
+	/*
+	 * Layout of the shared config file (little endian, offsets in bytes)
+	 *
+	 * Header (METASHM_HEADER_SIZE):
+	 *   0  u32 magic, 4 u32 version, 8 u64 slot size, 16 u64 generation (atomic), 24..63 reserved
+	 * Two slots of `slot size` bytes follow the header, generation g is stored in slot g % 2:
+	 *   0  u64 seq (atomic, 2g if the slot holds generation g, odd while it is written)
+	 *   8  u64 config version, 16 u32 entry count, 20 u32 list item count, 24..31 reserved
+	 *   32 entries sorted by key (bytewise), METASHM_ENTRY_SIZE each:
+	 *      0 u32 key offset, 4 u32 key length, 8 u32 raw offset, 12 u32 raw length,
+	 *      16 u32 first list item, 20 u32 list item count, 24 u32 flags, 28 reserved, 32 f64 double
+	 *   list items after the entries (u32 offset, u32 length), then the string data
+	 * String offsets are relative to the slot, list items refer to the tokens inside the raw value (they are not stored twice).
+	 *
+	 * The writer fills the slot of the next generation while readers keep using the current one
+	 * and publishes the generation afterwards. Readers validate the seq of their slot after reading (seqlock).
+	 */
+
+	namespace detail {
+		inline uint32_t shmLoad32(const char* p) {
+			uint32_t v;
+			memcpy(&v, p, sizeof(v));
+			return v;
+		}
+
+		inline double shmLoadDouble(const char* p) {
+			double v;
+			memcpy(&v, p, sizeof(v));
+			return v;
+		}
+
+		inline void shmStore32(char* p, uint32_t v) {
+			memcpy(p, &v, sizeof(v));
+		}
+
+		inline atomic_ref<uint64_t> shmAtomic(const char* p) {
+			return atomic_ref<uint64_t>(*reinterpret_cast<uint64_t*>(const_cast<char*>(p)));
+		}
+	}
+
+	/**
+	 * View of one published configuration in the shared memory
+	 *
+	 * Accessors return views into the mapping without copying or parsing anything.
+	 * A snapshot is only consistent inside MetaShmReader::Read(), the writer may reuse the slot afterwards.
+	 * Offsets are bounds checked, so reading a slot that is overwritten concurrently returns garbage but never faults.
+	 */
+	class ShmSnapshot {
+	public:
+		ShmSnapshot(const char* slot, size_t slotSize) : slot(slot), slotSize(slotSize) {
+			count = min<uint32_t>(detail::shmLoad32(slot + 16), (slotSize - METASHM_SLOT_HEADER_SIZE) / METASHM_ENTRY_SIZE);
+			listCount = detail::shmLoad32(slot + 20);
+		}
+
+		/**
+		 * Version of the MetaConfig snapshot that was published
+		 */
+		uint64_t Version() const {
+			uint64_t version;
+			memcpy(&version, slot + 8, sizeof(version));
+			return version;
+		}
+
+		/**
+		 * Number of keys
+		 */
+		size_t Size() const {
+			return count;
+		}
+
+		bool Exists(string_view key) const {
+			return find(key) != nullptr;
+		}
+
+		/**
+		 * Get string value of specific key, empty if the key is not found
+		 */
+		string_view GetString(string_view key) const {
+			const char* entry = find(key);
+			return entry ? str(entry + 8) : string_view();
+		}
+
+		/**
+		 * Get bool value of specific key, false if the key is not found
+		 */
+		bool GetBool(string_view key) const {
+			const char* entry = find(key);
+			return entry && (detail::shmLoad32(entry + 24) & METASHM_FLAG_BOOL);
+		}
+
+		/**
+		 * Get double value of specific key, 0 if the key is not found or invalid
+		 */
+		double GetDouble(string_view key) const {
+			const char* entry = find(key);
+			return entry ? detail::shmLoadDouble(entry + 32) : 0.0;
+		}
+
+		/**
+		 * Get list value of specific key, empty if the key is not found
+		 */
+		vector<string_view> GetList(string_view key) const {
+			vector<string_view> list;
+			const char* entry = find(key);
+			if (!entry) return list;
+			uint32_t first = detail::shmLoad32(entry + 16);
+			uint32_t items = detail::shmLoad32(entry + 20);
+			if (first > listCount || items > listCount - first) return list;
+			const char* base = slot + METASHM_SLOT_HEADER_SIZE + (size_t)count * METASHM_ENTRY_SIZE;
+			for (uint32_t i = 0; i < items; i++) {
+				size_t off = (base - slot) + (size_t)(first + i) * METASHM_LIST_ITEM_SIZE;
+				if (off + METASHM_LIST_ITEM_SIZE > slotSize) break;
+				list.push_back(str(slot + off));
+			}
+			return list;
+		}
+
+	private:
+		const char* slot;
+		size_t slotSize;
+		uint32_t count;
+		uint32_t listCount;
+
+		/**
+		 * Read a (offset, length) pair and return the string it refers to
+		 */
+		string_view str(const char* ref) const {
+			uint32_t off = detail::shmLoad32(ref);
+			uint32_t len = detail::shmLoad32(ref + 4);
+			if (off > slotSize || len > slotSize - off) return string_view();
+			return string_view(slot + off, len);
+		}
+
+		/**
+		 * Binary search the entry of the key, nullptr if the key is not found
+		 */
+		const char* find(string_view key) const {
+			size_t low = 0, high = count;
+			while (low < high) {
+				size_t mid = low + (high - low) / 2;
+				const char* entry = slot + METASHM_SLOT_HEADER_SIZE + mid * METASHM_ENTRY_SIZE;
+				int cmp = str(entry).compare(key);
+				if (cmp == 0) return entry;
+				if (cmp < 0) low = mid + 1;
+				else high = mid;
+			}
+			return nullptr;
+		}
+	};
+
+	/**
+	 * Publishes MetaConfig snapshots into a memory-mapped file for readers in other processes
+	 *
+	 * There is one writer per file (it is locked with flock), usually the process running the MetaHook.
+	 * Readers (MetaShmReader or metashm.go) map the file read-only and get consistent snapshots without parsing.
+	 *
+	 * Every snapshot must fit into a slot of `slotSize` bytes (keys, values and list items plus 40 bytes per key).
+	 * If the existing file has another layout, it is replaced, readers of the old file see Stale().
+	 */
+	class MetaShmWriter {
+	public:
+		MetaShmWriter(string path, size_t slotSize = 1024 * 1024) : shmPath(path) {
+			// Slots stay 8 byte aligned for the atomic seq
+			this->slotSize = max<size_t>((slotSize + 63) & ~size_t(63), 64);
+			size_t fileSize = METASHM_HEADER_SIZE + 2 * this->slotSize;
+
+			filesystem::path fspath(shmPath);
+			if (fspath.has_parent_path()) filesystem::create_directories(fspath.parent_path());
+			while (true) {
+				fd = open(shmPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+				if (fd < 0) {
+					throw runtime_error("Failed to open shared config at: " + shmPath);
+				}
+				if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+					::close(fd);
+					throw runtime_error("Shared config is already published by another process: " + shmPath);
+				}
+				// A writer that replaced the file released the lock of the old inode, which is no longer at the path
+				if (lockedPath()) break;
+				::close(fd);
+			}
+			if (!reusable(fileSize)) replaceFile(fileSize);
+
+			void* mapping = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (mapping == MAP_FAILED) {
+				::close(fd);
+				throw runtime_error("Failed to map shared config at: " + shmPath);
+			}
+			base = static_cast<char*>(mapping);
+			mappedSize = fileSize;
+			generation = detail::shmAtomic(base + 16).load(memory_order_acquire);
+		}
+
+		virtual ~MetaShmWriter() {
+			munmap(base, mappedSize);
+			::close(fd);
+		}
+
+		MetaShmWriter(const MetaShmWriter&) = delete;
+		MetaShmWriter& operator=(const MetaShmWriter&) = delete;
+
+		/**
+		 * Publish the snapshot as next generation
+		 *
+		 * Function will throw a runtime error if the snapshot does not fit into a slot
+		 */
+		void Publish(const ConfigSnapshot& snap) {
+			lock_guard<mutex> lock(publishLock);
+			publish(snap);
+		}
+
+		/**
+		 * Publish the current snapshot of the config if it is newer than the last published one
+		 *
+		 * Concurrent calls never publish a older snapshot after a newer one.
+		 * Returns true if a snapshot was published.
+		 * Function will throw a runtime error if the snapshot does not fit into a slot
+		 */
+		bool Sync(MetaConfig& config) {
+			lock_guard<mutex> lock(publishLock);
+			auto snap = config.GetSnapshot();
+			if (published && publishedVersion >= snap->Version) return false;
+			publish(*snap);
+			return true;
+		}
+
+		string GetPath() const {
+			return shmPath;
+		}
+
+	private:
+		string shmPath;
+		size_t slotSize;
+		int fd = -1;
+		char* base = nullptr;
+		size_t mappedSize = 0;
+		mutex publishLock;
+		uint64_t generation = 0;
+		// Version of the last snapshot published by this writer
+		bool published = false;
+		uint64_t publishedVersion = 0;
+
+		/**
+		 * Write the snapshot into the slot of the next generation and publish it
+		 *
+		 * Must be called while holding the publishLock
+		 */
+		void publish(const ConfigSnapshot& snap) {
+			vector<pair<string_view, const ConfigValue*>> entries;
+			entries.reserve(snap.Values.size());
+			size_t items = 0;
+			size_t bytes = 0;
+			for (const auto& [key, value] : snap.Values) {
+				entries.emplace_back(key, &value);
+				for ([[maybe_unused]] string_view token : util::strutil::splitView(value.Raw, ',')) items++;
+				bytes += key.size() + value.Raw.size();
+			}
+			size_t dataOffset = METASHM_SLOT_HEADER_SIZE + entries.size() * METASHM_ENTRY_SIZE + items * METASHM_LIST_ITEM_SIZE;
+			if (dataOffset + bytes > slotSize || dataOffset + bytes > UINT32_MAX) {
+				throw runtime_error("Config does not fit into the shared config slot (" + to_string(dataOffset + bytes) +
+														" > " + to_string(slotSize) + " bytes) at: " + shmPath);
+			}
+			sort(entries.begin(), entries.end());
+
+			uint64_t next = generation + 1;
+			char* slot = base + METASHM_HEADER_SIZE + (next % 2) * slotSize;
+			auto seq = detail::shmAtomic(slot);
+			seq.store(2 * next - 1, memory_order_relaxed);
+			// Readers that see the data of the new generation also see the odd seq
+			atomic_thread_fence(memory_order_release);
+
+			memcpy(slot + 8, &snap.Version, sizeof(snap.Version));
+			detail::shmStore32(slot + 16, entries.size());
+			detail::shmStore32(slot + 20, items);
+			char* entry = slot + METASHM_SLOT_HEADER_SIZE;
+			char* item = entry + entries.size() * METASHM_ENTRY_SIZE;
+			size_t data = dataOffset;
+			uint32_t itemIndex = 0;
+			auto append = [&](char* ref, string_view str) {
+				detail::shmStore32(ref, data);
+				detail::shmStore32(ref + 4, str.size());
+				memcpy(slot + data, str.data(), str.size());
+				data += str.size();
+			};
+			for (const auto& [key, value] : entries) {
+				memset(entry, 0, METASHM_ENTRY_SIZE);
+				append(entry, key);
+				size_t raw = data;
+				append(entry + 8, value->Raw);
+				uint32_t firstItem = itemIndex;
+				uint32_t flags = (value->Bool ? METASHM_FLAG_BOOL : 0) | (value->ValidBool ? METASHM_FLAG_VALID_BOOL : 0) |
+					(value->ValidDouble ? METASHM_FLAG_VALID_DOUBLE : 0);
+				detail::shmStore32(entry + 24, flags);
+				memcpy(entry + 32, &value->Double, sizeof(double));
+				// Split without allocating, the items are the offsets of the tokens in the raw value
+				for (string_view token : util::strutil::splitView(value->Raw, ',')) {
+					detail::shmStore32(item, raw + (token.data() - value->Raw.data()));
+					detail::shmStore32(item + 4, token.size());
+					item += METASHM_LIST_ITEM_SIZE;
+					itemIndex++;
+				}
+				detail::shmStore32(entry + 16, firstItem);
+				detail::shmStore32(entry + 20, itemIndex - firstItem);
+				entry += METASHM_ENTRY_SIZE;
+			}
+
+			seq.store(2 * next, memory_order_release);
+			detail::shmAtomic(base + 16).store(next, memory_order_release);
+			generation = next;
+			published = true;
+			publishedVersion = snap.Version;
+		}
+
+		/**
+		 * Returns true if the locked fd is still the file at the path
+		 */
+		bool lockedPath() {
+			struct stat fdStat, pathStat;
+			if (fstat(fd, &fdStat) != 0) {
+				::close(fd);
+				throw runtime_error("Failed to stat shared config at: " + shmPath);
+			}
+			return stat(shmPath.c_str(), &pathStat) == 0 &&
+				fdStat.st_dev == pathStat.st_dev && fdStat.st_ino == pathStat.st_ino;
+		}
+
+		/**
+		 * Returns true if the file already has the layout, the generation of the last writer is continued then
+		 */
+		bool reusable(size_t fileSize) {
+			struct stat st;
+			if (fstat(fd, &st) != 0 || (size_t)st.st_size != fileSize) return false;
+			char header[24];
+			if (pread(fd, header, sizeof(header), 0) != sizeof(header)) return false;
+			uint64_t size;
+			memcpy(&size, header + 8, sizeof(size));
+			return detail::shmLoad32(header) == METASHM_MAGIC && detail::shmLoad32(header + 4) == METASHM_VERSION &&
+				size == slotSize;
+		}
+
+		/**
+		 * Replace the file with a empty one of `fileSize` bytes
+		 *
+		 * The new file is renamed over the old one, so the mappings of readers never shrink (which would fault).
+		 */
+		void replaceFile(size_t fileSize) {
+			string tmpPath = shmPath + TMP_FILE_EXTENSION;
+			int tmpFd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (tmpFd < 0 || ftruncate(tmpFd, fileSize) != 0) {
+				if (tmpFd >= 0) ::close(tmpFd);
+				::close(fd);
+				throw runtime_error("Failed to create shared config at: " + tmpPath);
+			}
+			char header[METASHM_HEADER_SIZE] = {};
+			detail::shmStore32(header, METASHM_MAGIC);
+			detail::shmStore32(header + 4, METASHM_VERSION);
+			uint64_t size = slotSize;
+			memcpy(header + 8, &size, sizeof(size));
+			if (pwrite(tmpFd, header, sizeof(header), 0) != sizeof(header) || flock(tmpFd, LOCK_EX | LOCK_NB) != 0 ||
+					rename(tmpPath.c_str(), shmPath.c_str()) != 0) {
+				::close(tmpFd);
+				::close(fd);
+				throw runtime_error("Failed to replace shared config at: " + shmPath);
+			}
+			::close(fd);
+			fd = tmpFd;
+		}
+	};
+
+	/**
+	 * Maps a shared config published by a MetaShmWriter read-only
+	 *
+	 * Reads never lock or parse, they only retry if the writer replaced the slot while it was read.
+	 *
+	 * ```
+	 * metaconfig::MetaShmReader shm("/dev/shm/cthulhu/wave.shm");
+	 * double limit = shm.Read([](const metaconfig::ShmSnapshot& snap) { return snap.GetDouble("limit"); });
+	 * ```
+	 */
+	class MetaShmReader {
+	public:
+		/**
+		 * Map the shared config
+		 *
+		 * Function will throw a runtime error if the file does not exist or has a unsupported layout
+		 */
+		explicit MetaShmReader(string path) : shmPath(path) {
+			int fd = open(shmPath.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				throw runtime_error("Failed to open shared config at: " + shmPath);
+			}
+			struct stat st;
+			if (fstat(fd, &st) != 0 || (size_t)st.st_size < METASHM_HEADER_SIZE) {
+				::close(fd);
+				throw runtime_error("Invalid shared config at: " + shmPath);
+			}
+			mappedIno = st.st_ino;
+			void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			::close(fd);
+			if (mapping == MAP_FAILED) {
+				throw runtime_error("Failed to map shared config at: " + shmPath);
+			}
+			base = static_cast<const char*>(mapping);
+			mappedSize = st.st_size;
+			memcpy(&slotSize, base + 8, sizeof(slotSize));
+			if (detail::shmLoad32(base) != METASHM_MAGIC || detail::shmLoad32(base + 4) != METASHM_VERSION ||
+					slotSize < METASHM_SLOT_HEADER_SIZE || mappedSize < METASHM_HEADER_SIZE + 2 * slotSize) {
+				munmap(const_cast<char*>(base), mappedSize);
+				throw runtime_error("Unsupported shared config layout at: " + shmPath);
+			}
+		}
+
+		virtual ~MetaShmReader() {
+			munmap(const_cast<char*>(base), mappedSize);
+		}
+
+		MetaShmReader(const MetaShmReader&) = delete;
+		MetaShmReader& operator=(const MetaShmReader&) = delete;
+
+		/**
+		 * Call `fn` with a consistent snapshot and return its result
+		 *
+		 * `fn` is called again if the writer replaced the snapshot while it ran,
+		 * so it must not have side effects and must not keep the views returned by the snapshot.
+		 */
+		template <typename Fn>
+		auto Read(Fn&& fn) const {
+			while (true) {
+				uint64_t generation = detail::shmAtomic(base + 16).load(memory_order_acquire);
+				const char* slot = base + METASHM_HEADER_SIZE + (generation % 2) * slotSize;
+				uint64_t seq = detail::shmAtomic(slot).load(memory_order_acquire);
+				// The writer already moved on and overwrites the slot
+				if (seq != 2 * generation) continue;
+				ShmSnapshot snap(slot, slotSize);
+				if constexpr (is_void_v<invoke_result_t<Fn&, const ShmSnapshot&>>) {
+					fn(snap);
+					if (unchanged(slot, seq)) return;
+				} else {
+					auto result = fn(snap);
+					if (unchanged(slot, seq)) return result;
+				}
+			}
+		}
+
+		/**
+		 * Get the published generation, it is incremented with every publish
+		 */
+		uint64_t Generation() const {
+			return detail::shmAtomic(base + 16).load(memory_order_acquire);
+		}
+
+		bool Exists(string_view key) const {
+			return Read([&](const ShmSnapshot& snap) { return snap.Exists(key); });
+		}
+
+		/**
+		 * Get a copy of the string value of specific key, empty if the key is not found
+		 */
+		string GetString(string_view key) const {
+			return Read([&](const ShmSnapshot& snap) { return string(snap.GetString(key)); });
+		}
+
+		bool GetBool(string_view key) const {
+			return Read([&](const ShmSnapshot& snap) { return snap.GetBool(key); });
+		}
+
+		double GetDouble(string_view key) const {
+			return Read([&](const ShmSnapshot& snap) { return snap.GetDouble(key); });
+		}
+
+		/**
+		 * Get a copy of the list value of specific key, empty if the key is not found
+		 */
+		vector<string> GetList(string_view key) const {
+			return Read([&](const ShmSnapshot& snap) {
+				vector<string> list;
+				for (string_view item : snap.GetList(key)) list.emplace_back(item);
+				return list;
+			});
+		}
+
+		/**
+		 * Returns true if the writer replaced the file (e.g. with another slot size), reopen the reader then
+		 */
+		bool Stale() const {
+			struct stat st;
+			return stat(shmPath.c_str(), &st) != 0 || st.st_ino != mappedIno;
+		}
+
+	private:
+		string shmPath;
+		const char* base = nullptr;
+		size_t mappedSize = 0;
+		uint64_t slotSize = 0;
+		ino_t mappedIno = 0;
+
+		bool unchanged(const char* slot, uint64_t seq) const {
+			atomic_thread_fence(memory_order_acquire);
+			return detail::shmAtomic(slot).load(memory_order_relaxed) == seq;
+		}
+	};
+}
+
+#endif
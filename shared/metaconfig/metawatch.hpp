@@ -0,0 +1,228 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef METAWATCH_H
+#define METAWATCH_H
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "shared/metaconfig/metaconfig.hpp"
+
+using namespace std;
+
+namespace metaconfig {
+
+	/**
+	 * Called with the changed key and its new value (nullptr if the key was removed)
+	 */
+	using ConfigSubscriber = function<void(string_view key, const ConfigValue* value)>;
+
+	/**
+	 * Reloads a MetaConfig when its files change on disk and notifies subscribers of changed keys
+	 *
+	 * The parent directory of the config is watched with inotify, so replacements by rename
+	 * (e.g. the .tmp pattern of WriteToDisk or editors) are detected like in-place writes.
+	 * Events are debounced, the config is only reparsed if the config file or journal actually changed
+	 * (this skips the events of the own WriteToDisk calls).
+	 *
+	 * Subscribers run on the watcher thread, they should return quickly.
+	 * If a reload fails (e.g. invalid edit), the current configuration is kept and `onError` is called.
+	 */
+	class MetaWatcher {
+	public:
+		MetaWatcher(MetaConfig* config,
+								function<void(const exception&)> onError = nullptr,
+								chrono::milliseconds debounce = chrono::milliseconds(20))
+			: config(config), onError(onError), debounce(debounce) {
+			filesystem::path path(config->GetPath());
+			configName = path.filename().string();
+			journalName = configName + JOURNAL_FILE_EXTENSION;
+			string dir = path.has_parent_path() ? path.parent_path().string() : ".";
+
+			inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+			if (inotifyFd < 0) {
+				throw runtime_error("Failed to initialize inotify for config at: " + config->GetPath());
+			}
+			if (inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0) {
+				::close(inotifyFd);
+				throw runtime_error("Failed to watch config directory at: " + dir);
+			}
+			stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (stopFd < 0) {
+				::close(inotifyFd);
+				throw runtime_error("Failed to initialize config watcher at: " + config->GetPath());
+			}
+			worker = thread([this]() { runWorker(); });
+		}
+
+		virtual ~MetaWatcher() {
+			uint64_t one = 1;
+			[[maybe_unused]] ssize_t n = ::write(stopFd, &one, sizeof(one));
+			if (worker.joinable()) worker.join();
+			::close(stopFd);
+			::close(inotifyFd);
+		}
+
+		MetaWatcher(const MetaWatcher&) = delete;
+		MetaWatcher& operator=(const MetaWatcher&) = delete;
+
+		/**
+		 * Subscribe to changes of a key, returns a id for Unsubscribe()
+		 */
+		uint64_t Subscribe(const string &key, ConfigSubscriber subscriber) {
+			lock_guard<mutex> lock(subscriberLock);
+			uint64_t id = nextId++;
+			subscribers[key].push_back({id, move(subscriber)});
+			return id;
+		}
+
+		void Unsubscribe(uint64_t id) {
+			lock_guard<mutex> lock(subscriberLock);
+			for (auto it = subscribers.begin(); it != subscribers.end(); it++) {
+				erase_if(it->second, [id](const subscription& sub) { return sub.id == id; });
+				if (it->second.empty()) {
+					subscribers.erase(it);
+					return;
+				}
+			}
+		}
+
+		/**
+		 * Reload the config if it changed on disk and notify the subscribers
+		 *
+		 * Called by the watcher thread, can be called manually to force a check.
+		 * Function will throw a runtime error if the reload fails
+		 */
+		void Reload() {
+			lock_guard<mutex> lock(reloadLock);
+			if (!config->ChangedOnDisk()) return;
+			// The snapshots are exchanged under the write lock of the config,
+			// so Set* calls racing with the reload are not reported as changes on disk
+			auto reload = config->ReadFromDisk();
+			notify(*reload.Previous, *reload.Loaded);
+		}
+
+	private:
+		struct subscription {
+			uint64_t id;
+			ConfigSubscriber fn;
+		};
+
+		MetaConfig* config;
+		function<void(const exception&)> onError;
+		chrono::milliseconds debounce;
+		string configName;
+		string journalName;
+		int inotifyFd = -1;
+		int stopFd = -1;
+		thread worker;
+		// Serializes reloads of the watcher thread and manual Reload() calls
+		mutex reloadLock;
+		mutex subscriberLock;
+		uint64_t nextId = 1;
+		unordered_map<string, vector<subscription>> subscribers;
+
+		/**
+		 * Call the subscribers of keys that differ between the snapshots
+		 *
+		 * Only subscribed keys are compared, so the cost does not depend on the size of the config.
+		 */
+		void notify(const ConfigSnapshot& oldSnap, const ConfigSnapshot& newSnap) {
+			vector<pair<string, ConfigSubscriber>> calls;
+			{
+				lock_guard<mutex> lock(subscriberLock);
+				for (const auto& [key, subs] : subscribers) {
+					const ConfigValue* oldValue = oldSnap.Find(key);
+					const ConfigValue* newValue = newSnap.Find(key);
+					if (!oldValue && !newValue) continue;
+					if (oldValue && newValue && oldValue->Raw == newValue->Raw) continue;
+					for (const auto& sub : subs) calls.push_back({key, sub.fn});
+				}
+			}
+			// Subscribers are called without the lock, so they can (un)subscribe
+			for (const auto& [key, fn] : calls) {
+				fn(key, newSnap.Find(key));
+			}
+		}
+
+		/**
+		 * Read pending events, returns true if one of them affects the config or journal
+		 */
+		bool readEvents() {
+			alignas(inotify_event) char buffer[4096];
+			bool relevant = false;
+			while (true) {
+				ssize_t n = ::read(inotifyFd, buffer, sizeof(buffer));
+				if (n <= 0) return relevant;
+				for (char* cur = buffer; cur < buffer + n; ) {
+					auto* event = reinterpret_cast<inotify_event*>(cur);
+					// Overflowed queue, events may be lost
+					if (event->mask & IN_Q_OVERFLOW) relevant = true;
+					if (event->len > 0) {
+						string_view name(event->name);
+						if (name == configName || name == journalName) relevant = true;
+					}
+					cur += sizeof(inotify_event) + event->len;
+				}
+			}
+		}
+
+		void runWorker() {
+			pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+			while (true) {
+				if (poll(fds, 2, -1) < 0) {
+					if (errno == EINTR) continue;
+					return;
+				}
+				if (fds[1].revents) return;
+				if (!readEvents()) continue;
+
+				// Wait until the events settle, so a burst of writes is reloaded once
+				while (true) {
+					int ready = poll(fds, 2, debounce.count());
+					if (ready < 0 && errno == EINTR) continue;
+					if (ready <= 0) break;
+					if (fds[1].revents) return;
+					readEvents();
+				}
+				try {
+					Reload();
+				} catch (const exception& e) {
+					if (onError) onError(e);
+				}
+			}
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,263 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef HOOKPOOL_H
+#define HOOKPOOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "shared/util/chan.hpp"
+#include "shared/util/trace.hpp"
+
+using namespace std;
+
+namespace metahook {
+
+	// Number of finished jobs kept for polling, older jobs are forgotten
+	inline constexpr size_t HOOK_JOB_RETENTION = 1024;
+
+	/**
+	 * Hook invocation for a key
+	 */
+	struct HookCall {
+		string Key;
+		move_only_function<void()> Run;
+	};
+
+	/**
+	 * Status of a submitted job
+	 */
+	struct HookJobStatus {
+		uint64_t Id = 0;
+		// True if all hooks of the job returned (or timed out)
+		bool Done = false;
+		// Hooks that are queued or running
+		size_t Pending = 0;
+		vector<string> Errors;
+	};
+
+	/**
+	 * Bounded worker pool running hooks asynchronously
+	 *
+	 * Calls are assigned to a worker by their key, so hooks of the same key run in submission order,
+	 * hooks of different keys run in parallel.
+	 * A running hook exceeding the timeout is reported as failed, it cannot be interrupted,
+	 * so its worker (and the keys assigned to it) stay blocked until the hook returns.
+	 */
+	class HookPool {
+	public:
+		HookPool(size_t workers, size_t queueSize, chrono::milliseconds timeout) : timeout(timeout) {
+			if (workers == 0) {
+				throw runtime_error("HookPool requires at least one worker");
+			}
+			size_t capacity = max<size_t>(queueSize / workers, 1);
+			for (size_t i = 0; i < workers; i++) {
+				this->workers.push_back(make_unique<worker>(capacity));
+			}
+			for (auto& w : this->workers) {
+				w->thread = std::thread([this, w = w.get()]() { runWorker(*w); });
+			}
+			watchdog = std::thread([this]() { runWatchdog(); });
+		}
+
+		virtual ~HookPool() {
+			// Queued hooks are still executed
+			for (auto& w : workers) w->calls.shutdown();
+			for (auto& w : workers) {
+				if (w->thread.joinable()) w->thread.join();
+			}
+			{
+				lock_guard<mutex> lock(watchdogMutex);
+				stopped = true;
+			}
+			watchdogCond.notify_all();
+			if (watchdog.joinable()) watchdog.join();
+		}
+
+		HookPool(const HookPool&) = delete;
+		HookPool& operator=(const HookPool&) = delete;
+
+		/**
+		 * Queue the calls as one job and return its id
+		 *
+		 * Calls that do not fit into the queue of their worker are reported as errors of the job.
+		 */
+		uint64_t Submit(vector<HookCall> calls) {
+			auto j = make_shared<job>();
+			j->pending = calls.size();
+			uint64_t id;
+			{
+				lock_guard<mutex> lock(jobsMutex);
+				id = nextJobId++;
+				jobs.insert({id, j});
+			}
+			j->id = id;
+			if (calls.empty()) finish(*j, "");
+
+			for (auto& call : calls) {
+				string key = call.Key;
+				worker& w = *workers[hash<string>()(key) % workers.size()];
+				if (!w.calls.push(queuedcall{move(call), j})) {
+					finish(*j, "Hook queue is full for key: " + key);
+				}
+			}
+			return id;
+		}
+
+		/**
+		 * Get the status of a job, nullopt if the job is unknown (or was forgotten)
+		 */
+		optional<HookJobStatus> Status(uint64_t id) {
+			shared_ptr<job> j;
+			{
+				lock_guard<mutex> lock(jobsMutex);
+				auto it = jobs.find(id);
+				if (it == jobs.end()) return nullopt;
+				j = it->second;
+			}
+			lock_guard<mutex> lock(j->mutex);
+			return HookJobStatus{id, j->pending == 0, j->pending, j->errors};
+		}
+
+	private:
+		struct job {
+			uint64_t id = 0;
+			std::mutex mutex;
+			size_t pending = 0;
+			vector<string> errors;
+		};
+
+		struct queuedcall {
+			HookCall call;
+			shared_ptr<job> owner;
+		};
+
+		struct worker {
+			util::chan<queuedcall> calls;
+			std::thread thread;
+			// Running call, guarded by the mutex (checked by the watchdog)
+			std::mutex mutex;
+			shared_ptr<job> running;
+			string runningKey;
+			chrono::steady_clock::time_point runningSince;
+			bool timedOut = false;
+
+			explicit worker(size_t capacity) : calls(capacity, util::FAIL) {}
+		};
+
+		chrono::milliseconds timeout;
+		vector<unique_ptr<worker>> workers;
+
+		std::mutex jobsMutex;
+		uint64_t nextJobId = 1;
+		unordered_map<uint64_t, shared_ptr<job>> jobs;
+		deque<uint64_t> finishedJobs;
+
+		std::thread watchdog;
+		std::mutex watchdogMutex;
+		condition_variable watchdogCond;
+		bool stopped = false;
+
+		/**
+		 * Finish one call of the job, a non-empty `error` is recorded
+		 */
+		void finish(job& j, const string& error) {
+			bool done;
+			{
+				lock_guard<mutex> lock(j.mutex);
+				if (!error.empty()) j.errors.push_back(error);
+				if (j.pending > 0) j.pending--;
+				done = j.pending == 0;
+			}
+			if (!done) return;
+			lock_guard<mutex> lock(jobsMutex);
+			finishedJobs.push_back(j.id);
+			if (finishedJobs.size() > HOOK_JOB_RETENTION) {
+				jobs.erase(finishedJobs.front());
+				finishedJobs.pop_front();
+			}
+		}
+
+		void runWorker(worker& w) {
+			while (true) {
+				auto [queued, ok] = w.calls.get();
+				if (!ok) return;
+				{
+					lock_guard<mutex> lock(w.mutex);
+					w.running = queued.owner;
+					w.runningKey = queued.call.Key;
+					w.runningSince = chrono::steady_clock::now();
+					w.timedOut = false;
+				}
+				string error;
+				try {
+					TRACE_SPAN("metahook.hook");
+					queued.call.Run();
+				} catch (const exception& e) {
+					error = e.what();
+				} catch (...) {
+					error = "Hook failed for key: " + queued.call.Key;
+				}
+				bool timedOut;
+				{
+					lock_guard<mutex> lock(w.mutex);
+					timedOut = w.timedOut;
+					w.running.reset();
+				}
+				// Timed out calls were already finished by the watchdog
+				if (!timedOut) finish(*queued.owner, error);
+			}
+		}
+
+		void runWatchdog() {
+			auto interval = clamp<chrono::milliseconds>(timeout / 4, chrono::milliseconds(1), chrono::milliseconds(100));
+			unique_lock<mutex> lock(watchdogMutex);
+			while (!watchdogCond.wait_for(lock, interval, [this]() { return stopped; })) {
+				auto now = chrono::steady_clock::now();
+				for (auto& w : workers) {
+					shared_ptr<job> expired;
+					string key;
+					{
+						lock_guard<mutex> workerLock(w->mutex);
+						if (!w->running || w->timedOut || now - w->runningSince < timeout) continue;
+						w->timedOut = true;
+						expired = w->running;
+						key = w->runningKey;
+					}
+					finish(*expired, "Hook timed out for key: " + key + " after " + to_string(timeout.count()) + "ms");
+				}
+			}
+		}
+	};
+}
+
+#endif
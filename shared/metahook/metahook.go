@@ -21,6 +21,7 @@ package metahook
 
 import (
 	"encoding/json"
+	"fmt"
 	"io/fs"
 	"net"
 	"net/http"
@@ -64,6 +65,10 @@ type UpdateHooks struct {
  *
  * Main purpose for this API is that infrastructure controllers like juju
  * can manage the MetaConfig at runtime.
+ *
+ * /update sets every field on its own and calls its hook.
+ * /batch validates all fields and applies them at once (all-or-nothing),
+ * calls the hook of every key once and writes the config to disk once.
  */
 type MetaHook struct {
 	metaConfig *metaconfig.MetaConfig
@@ -72,6 +77,8 @@ type MetaHook struct {
 	socketPerm fs.FileMode
 	socketServer *http.Server
 	socketServerMux *http.ServeMux
+	// Serializes batches (apply, hooks, write)
+	batchLock sync.Mutex
 }
 
 /**
@@ -102,16 +109,17 @@ func CreateMetaHook(
 	}
 
 	metaHook := &MetaHook{
-		config,
-		updatehooks,
-		socketpath,
-		socketperm,
-		sockSrv,
-		sockMux,
+		metaConfig: config,
+		updateHooks: updatehooks,
+		socketPath: socketpath,
+		socketPerm: socketperm,
+		socketServer: sockSrv,
+		socketServerMux: sockMux,
 	}
 
 	// Register handlers
 	sockMux.HandleFunc("/update", metaHook.updateHandler)
+	sockMux.HandleFunc("/batch", metaHook.batchHandler)
 
 	return metaHook, nil
 }
@@ -175,7 +183,8 @@ type updateRequest struct {
 }
 
 type updateResponse struct {
-	Err []error `json:"err"`
+	// Errors are encoded as strings (error values encode as empty objects)
+	Err []string `json:"err"`
 }
 
 /**
@@ -206,7 +215,7 @@ func (m* MetaHook) updateHandler(w http.ResponseWriter, r *http.Request) {
 		if exists {
 			err := hook(field.Key, field.Value)
 			if err!=nil {
-				res.Err = append(res.Err, err)
+				res.Err = append(res.Err, err.Error())
 			}
 		}
 	}
@@ -218,7 +227,7 @@ func (m* MetaHook) updateHandler(w http.ResponseWriter, r *http.Request) {
 		if exists {
 			err := hook(field.Key, field.Value)
 			if err!=nil {
-				res.Err = append(res.Err, err)
+				res.Err = append(res.Err, err.Error())
 			}
 		}
 	}
@@ -230,7 +239,7 @@ func (m* MetaHook) updateHandler(w http.ResponseWriter, r *http.Request) {
 		if exists {
 			err := hook(field.Key, field.Value)
 			if err!=nil {
-				res.Err = append(res.Err, err)
+				res.Err = append(res.Err, err.Error())
 			}
 		}
 	}
@@ -242,7 +251,7 @@ func (m* MetaHook) updateHandler(w http.ResponseWriter, r *http.Request) {
 		if exists {
 			err := hook(field.Key, field.Value)
 			if err!=nil {
-				res.Err = append(res.Err, err)
+				res.Err = append(res.Err, err.Error())
 			}
 		}
 	}
@@ -250,3 +259,94 @@ func (m* MetaHook) updateHandler(w http.ResponseWriter, r *http.Request) {
 	w.Header().Set("Content-Type", "application/json")
 	json.NewEncoder(w).Encode(res)
 }
+
+/**
+ * Handler batch requests
+ *
+ * Validates all fields and sets them in the associated MetaConfig at once,
+ * then calls the updateHook of every key (if defined) and writes the config to disk once.
+ *
+ * If a field is invalid, nothing is applied and the request fails with StatusBadRequest.
+ */
+func (m* MetaHook) batchHandler(w http.ResponseWriter, r *http.Request) {
+	if r.Method != "POST" {
+		http.Error(w, "Invalid request method, expected POST!", http.StatusMethodNotAllowed)
+		return
+	}
+
+	var req updateRequest
+	err := json.NewDecoder(r.Body).Decode(&req)
+	if err!=nil {
+		http.Error(w, err.Error(), http.StatusBadRequest)
+		return
+	}
+
+	values := make(map[string]string)
+	add := func(key string, value string) error {
+		if _, exists := values[key]; exists {
+			return fmt.Errorf("Duplicate key in batch: %s", key)
+		}
+		values[key] = value
+		return nil
+	}
+	for _,field := range req.StringFields {
+		err = add(field.Key, field.Value)
+		if err!=nil { break }
+	}
+	for _,field := range req.BoolFields {
+		if err!=nil { break }
+		err = add(field.Key, metaconfig.FormatBool(field.Value))
+	}
+	for _,field := range req.DoubleFields {
+		if err!=nil { break }
+		err = add(field.Key, metaconfig.FormatDouble(field.Value))
+	}
+	for _,field := range req.ListFields {
+		if err!=nil { break }
+		err = add(field.Key, metaconfig.FormatList(field.Value))
+	}
+	if err!=nil {
+		http.Error(w, err.Error(), http.StatusBadRequest)
+		return
+	}
+
+	m.batchLock.Lock()
+	defer m.batchLock.Unlock()
+
+	if err:=m.metaConfig.SetValues(values); err!=nil {
+		http.Error(w, err.Error(), http.StatusBadRequest)
+		return
+	}
+
+	var res updateResponse
+	callHook := func(hook func() error, exists bool) {
+		if !exists { return }
+		if err := hook(); err!=nil {
+			res.Err = append(res.Err, err.Error())
+		}
+	}
+	// Keys are unique in a applied batch, so every hook is called once
+	for _,field := range req.StringFields {
+		hook, exists := m.updateHooks.StringFieldHooks[field.Key]
+		callHook(func() error { return hook(field.Key, field.Value) }, exists)
+	}
+	for _,field := range req.BoolFields {
+		hook, exists := m.updateHooks.BoolFieldHooks[field.Key]
+		callHook(func() error { return hook(field.Key, field.Value) }, exists)
+	}
+	for _,field := range req.DoubleFields {
+		hook, exists := m.updateHooks.DoubleFieldHooks[field.Key]
+		callHook(func() error { return hook(field.Key, field.Value) }, exists)
+	}
+	for _,field := range req.ListFields {
+		hook, exists := m.updateHooks.ListFieldHooks[field.Key]
+		callHook(func() error { return hook(field.Key, field.Value) }, exists)
+	}
+
+	if err:=m.metaConfig.WriteToDisk(); err!=nil {
+		res.Err = append(res.Err, err.Error())
+	}
+
+	w.Header().Set("Content-Type", "application/json")
+	json.NewEncoder(w).Encode(res)
+}
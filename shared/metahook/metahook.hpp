@@ -23,28 +23,48 @@
 #include <string>
 #include <unordered_map>
 #include <functional>
+#include <filesystem>
+#include <charconv>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
 #include <boost/config.hpp>
 
 #include "shared/metaconfig/metaconfig.hpp"
+#include "shared/metaconfig/metashm.hpp"
+#include "shared/metahook/hookpool.hpp"
+#include "shared/metahook/updaterequest.hpp"
+#include "shared/metrics/metrics.hpp"
+#include "shared/util/trace.hpp"
+#include "shared/util/workpool.hpp"
 
 namespace beast = boost::beast;
 namespace http = beast::http;
 namespace net = boost::asio;
 using tcp = net::ip::tcp;
+using unixsocket = net::local::stream_protocol;
 
 using namespace std;
 
 namespace metahook {
+
+	// Update requests with a larger body are rejected
+	inline constexpr size_t METAHOOK_MAX_BODY_SIZE = 16 * 1024 * 1024;
+
 	/**
 	 * Structure which holds function definitions for specific MetaConfig fields
 	 *
 	 * The hook function callback is called when the API is called to change the specified MetaConfig field.
 	 *
 	 * Every hook is executed synchroniously, make sure they do not use cost-intensive IO operations.
+	 * Exceptions thrown by a hook are returned to the caller in the "err" list of the response.
+	 * With MetaHookOptions::AsyncHooks, hooks run on a worker pool instead (see HookPool).
 	 *
 	 * Hooks are expected return after the system
 	 * is in a state where the updated field is fully operational.
@@ -60,6 +80,29 @@ namespace metahook {
 		unordered_map<string, function<void(string, vector<string>)>> ListFieldHooks;
 	};
 
+	/**
+	 * Options of the MetaHook API
+	 */
+	struct MetaHookOptions {
+		// Run hooks on a worker pool, requests return a job id that can be polled with GET /jobs/<id>
+		bool AsyncHooks = false;
+		// Workers of the pool, hooks of the same key always run on the same worker (in order)
+		size_t HookWorkers = 4;
+		// Hooks that can be queued, further hooks are reported as errors of their job
+		size_t HookQueueSize = 1024;
+		// Running hooks exceeding this are reported as failed
+		chrono::milliseconds HookTimeout = chrono::seconds(30);
+		// Metrics exported on GET /metrics in the Prometheus text format (the route is disabled if not set)
+		metrics::MetricRegistry* Metrics = nullptr;
+		// Serve POST /trace/start, POST /trace/stop and GET /trace (spans as Chrome trace JSON, see util::trace)
+		bool Tracing = false;
+		// Publish the config to this shared config after every applied request (see MetaShmWriter)
+		metaconfig::MetaShmWriter* Shm = nullptr;
+		// Run the updates (config writes, synchronous hooks, disk writes) on this pool,
+		// MetaHook creates a pool with one worker if not set
+		util::workpool* Workers = nullptr;
+	};
+
 	/**
 	 * MetaHook is a component to update the MetaConfiguration
 	 * over a controlled HTTP API
@@ -72,17 +115,476 @@ namespace metahook {
 	 *
 	 * Main purpose for this API is that infrastructure controllers like juju
 	 * can manage the MetaConfig at runtime.
+	 *
+	 * The API is the same as the one of metahook.go (POST /update, see UpdateRequest):
+	 * - /update sets every field on its own and calls its hook.
+	 * - /batch validates all fields and applies them at once (all-or-nothing),
+	 *   calls the hook of every key once and writes the config to disk once.
+	 *   Updates and batches are serialized, so hooks are called in the order the requests were applied
+	 *   (also if MetaHookOptions::Workers runs requests concurrently).
+	 * - With MetaHookOptions::AsyncHooks, /update and /batch return after applying the config
+	 *   with a "job" id in the response, GET /jobs/<id> returns the state and the hook errors of the job
+	 *   (`{"job":1,"done":false,"pending":2,"err":null}`).
+	 * - With MetaHookOptions::Metrics, GET /metrics returns the metrics of the registry.
+	 * - With MetaHookOptions::Tracing, POST /trace/start and /trace/stop control the recording of spans,
+	 *   GET /trace returns the recorded spans of the process as Chrome trace JSON.
+	 * - With MetaHookOptions::Shm, the applied config is published to the shared config,
+	 *   publish errors are returned in the "err" list.
+	 * Connections are accepted and handled asynchronously on the io_context of the component,
+	 * they are kept alive, buffers of a connection are reused for all its requests.
+	 * Updates run on MetaHookOptions::Workers and the response is written back on the io_context,
+	 * so slow hooks or disk writes do not stall other connections or the component.
+	 * The MetaConfig must outlive the io_context processing the connections.
 	 */
 	class MetaHook {
+	public:
+		/**
+		 * Initialize MetaHook API, creates the socket path and removes old sockets
+		 */
+		MetaHook(net::io_context& ioContext,
+						 string socketPath,
+						 filesystem::perms socketPerm,
+						 UpdateHooks updateHooks,
+						 metaconfig::MetaConfig* metaConfig,
+						 MetaHookOptions options = MetaHookOptions())
+			: state(make_shared<hookstate>(metaConfig, move(updateHooks), options)),
+				socketPath(socketPath),
+				socketPerm(socketPerm),
+				acceptor(ioContext) {
+			// Create path recursively
+			filesystem::path fspath(socketPath);
+			if (fspath.has_parent_path()) {
+				filesystem::create_directories(fspath.parent_path());
+			}
+			// Cleanup old socket
+			filesystem::remove(socketPath);
+		}
+
+		virtual ~MetaHook() {
+			Close();
+		}
+
+		MetaHook(const MetaHook&) = delete;
+		MetaHook& operator=(const MetaHook&) = delete;
+
+		/**
+		 * Create unix socket / listener and start accepting connections
+		 *
+		 * Serve() does not block, connections are handled while the io_context runs.
+		 * Function will throw a runtime error if the socket cannot be created
+		 */
+		void Serve() {
+			// Remove socket if already existent
+			filesystem::remove(socketPath);
+			beast::error_code ec;
+			unixsocket::endpoint endpoint(socketPath);
+			acceptor.open(endpoint.protocol(), ec);
+			if (!ec) acceptor.bind(endpoint, ec);
+			if (!ec) acceptor.listen(net::socket_base::max_listen_connections, ec);
+			if (ec) {
+				throw runtime_error("Failed to open metahook socket at: " + socketPath + "\n" + ec.message());
+			}
+			// Change socket permissions
+			filesystem::permissions(socketPath, socketPerm);
+			doAccept();
+		}
+
+		/**
+		 * Stop accepting connections and remove the socket
+		 *
+		 * Open connections are finished by the io_context.
+		 */
+		void Close() {
+			if (!acceptor.is_open()) return;
+			beast::error_code ec;
+			acceptor.close(ec);
+			error_code fsec;
+			filesystem::remove(socketPath, fsec);
+		}
 
 	private:
-		metaconfig::MetaConfig* metaConfig;
-		UpdateHooks updateHooks;
+		class session;
+
+		/**
+		 * State shared with the sessions, so they can outlive the MetaHook
+		 */
+		struct hookstate {
+			metaconfig::MetaConfig* metaConfig;
+			UpdateHooks updateHooks;
+			// Serializes batches (apply, hooks, write) and updates (apply, call or queue hooks)
+			mutex updateLock;
+			// Only set with MetaHookOptions::AsyncHooks
+			unique_ptr<HookPool> hookPool;
+			metrics::MetricRegistry* metricRegistry;
+			bool tracing;
+			metaconfig::MetaShmWriter* shm;
+			// Runs the updates, points to ownedWorkers if MetaHookOptions::Workers is not set
+			util::workpool* workers;
+			unique_ptr<util::workpool> ownedWorkers;
+
+			hookstate(metaconfig::MetaConfig* metaConfig, UpdateHooks updateHooks, const MetaHookOptions& options)
+				: metaConfig(metaConfig), updateHooks(move(updateHooks)), metricRegistry(options.Metrics), tracing(options.Tracing),
+					shm(options.Shm), workers(options.Workers) {
+				if (options.AsyncHooks) {
+					hookPool = make_unique<HookPool>(options.HookWorkers, options.HookQueueSize, options.HookTimeout);
+				}
+				if (!workers) {
+					ownedWorkers = make_unique<util::workpool>(1);
+					workers = ownedWorkers.get();
+				}
+			}
+		};
+
+		shared_ptr<hookstate> state;
 		string socketPath;
-		
+		filesystem::perms socketPerm;
+		unixsocket::acceptor acceptor;
+
+		void doAccept();
+	};
+
+	/**
+	 * Connection of a MetaHook client
+	 *
+	 * Request body, parsed request, errors and response body are members, their capacity is reused.
+	 */
+	class MetaHook::session : public enable_shared_from_this<session> {
+	public:
+		session(unixsocket::socket socket, shared_ptr<hookstate> state)
+			: socket(move(socket)), state(move(state)) {}
+
+		void Start() {
+			doRead();
+		}
+
+	private:
+		unixsocket::socket socket;
+		shared_ptr<hookstate> state;
+		beast::flat_buffer buffer;
+		optional<http::request_parser<http::string_body>> parser;
+		http::response<http::string_body> res;
+		string body;
+		UpdateRequest request;
+		vector<string> errs;
+		// Hooks of the request, queued on the HookPool with AsyncHooks
+		vector<HookCall> calls;
+		// Result of the update, set on the worker and responded on the io_context
+		optional<uint64_t> job;
+		optional<string> rejected;
+
+		void doRead() {
+			parser.emplace();
+			parser->body_limit(METAHOOK_MAX_BODY_SIZE);
+			// Parser appends to the body, so the capacity of the last request is reused
+			body.clear();
+			parser->get().body().swap(body);
+			http::async_read(socket, buffer, *parser, [self = shared_from_this()](beast::error_code ec, size_t) {
+				self->onRead(ec);
+			});
+		}
+
+		void onRead(beast::error_code ec) {
+			if (ec) {
+				// Client closed the connection or sent a invalid request
+				if (ec != http::error::end_of_stream) {
+					respondError(http::status::bad_request, ec.message(), false);
+				} else closeSocket();
+				return;
+			}
+			TRACE_SPAN("metahook.request");
+			auto& req = parser->get();
+			body.swap(req.body());
+
+			string_view target(req.target().data(), req.target().size());
+			if (target.starts_with("/jobs/")) {
+				respondJob(target.substr(6), req.method(), req.keep_alive());
+				return;
+			}
+			if (target == "/metrics" && state->metricRegistry) {
+				respondMetrics(req.method(), req.keep_alive());
+				return;
+			}
+			if (target.starts_with("/trace") && state->tracing) {
+				respondTrace(target, req.method(), req.keep_alive());
+				return;
+			}
+			bool batch = target == "/batch";
+			if (!batch && target != "/update") {
+				respondError(http::status::not_found, "404 page not found", req.keep_alive());
+				return;
+			}
+			if (req.method() != http::verb::post) {
+				respondError(http::status::method_not_allowed, "Invalid request method, expected POST!", req.keep_alive());
+				return;
+			}
+			try {
+				request.Parse(body.data(), body.size());
+			} catch (const exception& e) {
+				respondError(http::status::bad_request, e.what(), req.keep_alive());
+				return;
+			}
+			// The session is not touched by the io_context until the response is posted back
+			bool keepAlive = req.keep_alive();
+			auto work = [self = shared_from_this(), batch, keepAlive]() mutable {
+				session* s = self.get();
+				s->runUpdate(batch);
+				// The handler takes the reference, so the session (and the pool) is never released on the worker
+				auto executor = s->socket.get_executor();
+				net::post(executor, [self = move(self), keepAlive]() { self->respondUpdate(keepAlive); });
+			};
+			if (!state->workers->post(move(work))) {
+				respondError(http::status::service_unavailable, "MetaHook is closed", keepAlive);
+			}
+		}
+
+		/**
+		 * Apply the request, runs on the workers
+		 */
+		void runUpdate(bool batch) {
+			TRACE_SPAN("metahook.update");
+			errs.clear();
+			calls.clear();
+			job.reset();
+			rejected.reset();
+			if (batch) {
+				try {
+					job = updateBatch();
+				} catch (const exception& e) {
+					// The batch was rejected, nothing was applied
+					rejected = e.what();
+					return;
+				}
+			} else {
+				// Serialized with the other requests, also if MetaHookOptions::Workers runs them concurrently
+				lock_guard<mutex> lock(state->updateLock);
+				update();
+				if (state->hookPool) job = state->hookPool->Submit(move(calls));
+			}
+			if (state->shm) publishShm();
+		}
+
+		/**
+		 * Respond with the result of runUpdate(), runs on the io_context
+		 */
+		void respondUpdate(bool keepAlive) {
+			if (rejected) {
+				respondError(http::status::bad_request, *rejected, keepAlive);
+				return;
+			}
+			res.body().clear();
+			AppendUpdateResponse(res.body(), errs, job);
+			respond(http::status::ok, "application/json", keepAlive);
+		}
+
+		vector<string> listValue(const UpdateField& field) const {
+			return vector<string>(request.ListItems.begin() + field.ListBegin, request.ListItems.begin() + field.ListEnd);
+		}
+
+		/**
+		 * Update the fields in the MetaConfig and call the updateHook for them (if defined)
+		 */
+		void update() {
+			auto* metaConfig = state->metaConfig;
+			const auto& hooks = state->updateHooks;
+			for (const auto& field : request.StringFields) {
+				apply(field, hooks.StringFieldHooks, [&](const string& key) {
+					string value(field.String);
+					metaConfig->SetString(key, value);
+					return value;
+				});
+			}
+			for (const auto& field : request.BoolFields) {
+				apply(field, hooks.BoolFieldHooks, [&](const string& key) {
+					metaConfig->SetBool(key, field.Bool);
+					return field.Bool;
+				});
+			}
+			for (const auto& field : request.DoubleFields) {
+				apply(field, hooks.DoubleFieldHooks, [&](const string& key) {
+					metaConfig->SetDouble(key, field.Double);
+					return field.Double;
+				});
+			}
+			for (const auto& field : request.ListFields) {
+				apply(field, hooks.ListFieldHooks, [&](const string& key) {
+					vector<string> value = listValue(field);
+					metaConfig->SetList(key, value);
+					return value;
+				});
+			}
+		}
+
+		/**
+		 * Apply all fields as one batch, then call the updateHook of every key and write the config once
+		 *
+		 * Throws if the batch is invalid, hook and write errors are collected.
+		 * Returns the job of the hooks with AsyncHooks.
+		 */
+		optional<uint64_t> updateBatch() {
+			auto* metaConfig = state->metaConfig;
+			const auto& hooks = state->updateHooks;
+			metaconfig::ConfigBatch batch;
+			for (const auto& field : request.StringFields) batch.SetString(string(field.Key), string(field.String));
+			for (const auto& field : request.BoolFields) batch.SetBool(string(field.Key), field.Bool);
+			for (const auto& field : request.DoubleFields) batch.SetDouble(string(field.Key), field.Double);
+			for (const auto& field : request.ListFields) batch.SetList(string(field.Key), listValue(field));
+
+			lock_guard<mutex> lock(state->updateLock);
+			metaConfig->Apply(batch);
+			// Keys are unique in a applied batch, so every hook is called once
+			for (const auto& field : request.StringFields) {
+				apply(field, hooks.StringFieldHooks, [&](const string&) { return string(field.String); });
+			}
+			for (const auto& field : request.BoolFields) {
+				apply(field, hooks.BoolFieldHooks, [&](const string&) { return field.Bool; });
+			}
+			for (const auto& field : request.DoubleFields) {
+				apply(field, hooks.DoubleFieldHooks, [&](const string&) { return field.Double; });
+			}
+			for (const auto& field : request.ListFields) {
+				apply(field, hooks.ListFieldHooks, [&](const string&) { return listValue(field); });
+			}
+			optional<uint64_t> job;
+			if (state->hookPool) job = state->hookPool->Submit(move(calls));
+			try {
+				metaConfig->WriteToDisk();
+			} catch (const exception& e) {
+				errs.push_back(e.what());
+			}
+			return job;
+		}
+
+		/**
+		 * Publish the config to the shared config if it changed, errors are collected
+		 */
+		void publishShm() {
+			try {
+				state->shm->Sync(*state->metaConfig);
+			} catch (const exception& e) {
+				errs.push_back(e.what());
+			}
+		}
+
+		/**
+		 * Get the value of the field with `get` and call its hook with the value, errors are collected
+		 *
+		 * With AsyncHooks, the hook is added to the calls instead.
+		 */
+		template <typename Hooks, typename Get>
+		void apply(const UpdateField& field, const Hooks& hooks, Get&& get) {
+			try {
+				string key(field.Key);
+				auto value = get(key);
+				auto hook = hooks.find(key);
+				if (hook == hooks.end()) return;
+				if (state->hookPool) {
+					// The hook is copied, the hooks of the state may outlive the session but the call may outlive both
+					calls.push_back({key, [fn = hook->second, key, value = move(value)]() mutable {
+						fn(key, move(value));
+					}});
+				} else {
+					TRACE_SPAN("metahook.hook");
+					hook->second(key, move(value));
+				}
+			} catch (const exception& e) {
+				errs.push_back(e.what());
+			}
+		}
+
+		/**
+		 * Respond with the status of the job `id` (GET /jobs/<id>)
+		 */
+		void respondJob(string_view id, http::verb method, bool keepAlive) {
+			if (method != http::verb::get) {
+				respondError(http::status::method_not_allowed, "Invalid request method, expected GET!", keepAlive);
+				return;
+			}
+			uint64_t jobId = 0;
+			auto [ptr, ec] = from_chars(id.data(), id.data() + id.size(), jobId);
+			optional<HookJobStatus> status;
+			if (state->hookPool && ec == errc() && ptr == id.data() + id.size()) {
+				status = state->hookPool->Status(jobId);
+			}
+			if (!status) {
+				respondError(http::status::not_found, "Job not found", keepAlive);
+				return;
+			}
+			res.body().clear();
+			AppendJobResponse(res.body(), *status);
+			respond(http::status::ok, "application/json", keepAlive);
+		}
+
+		/**
+		 * Respond with the metrics of the registry (GET /metrics)
+		 */
+		void respondMetrics(http::verb method, bool keepAlive) {
+			if (method != http::verb::get) {
+				respondError(http::status::method_not_allowed, "Invalid request method, expected GET!", keepAlive);
+				return;
+			}
+			res.body().clear();
+			state->metricRegistry->Collect(res.body());
+			respond(http::status::ok, "text/plain; version=0.0.4; charset=utf-8", keepAlive);
+		}
+
+		/**
+		 * Control the recording of spans (POST /trace/start, POST /trace/stop) or dump them (GET /trace)
+		 */
+		void respondTrace(string_view target, http::verb method, bool keepAlive) {
+			bool control = target == "/trace/start" || target == "/trace/stop";
+			if (!control && target != "/trace") {
+				respondError(http::status::not_found, "404 page not found", keepAlive);
+				return;
+			}
+			if (method != (control ? http::verb::post : http::verb::get)) {
+				respondError(http::status::method_not_allowed,
+										 control ? "Invalid request method, expected POST!" : "Invalid request method, expected GET!", keepAlive);
+				return;
+			}
+			res.body().clear();
+			if (target == "/trace/start") util::trace::start();
+			else if (target == "/trace/stop") util::trace::stop();
+			else util::trace::dump(res.body());
+			respond(http::status::ok, "application/json", keepAlive);
+		}
+
+		void respondError(http::status status, string_view message, bool keepAlive) {
+			res.body().assign(message);
+			res.body() += '\n';
+			respond(status, "text/plain; charset=utf-8", keepAlive);
+		}
+
+		void respond(http::status status, const char* contentType, bool keepAlive) {
+			res.result(status);
+			res.version(11);
+			res.set(http::field::content_type, contentType);
+			res.keep_alive(keepAlive);
+			res.prepare_payload();
+			http::async_write(socket, res, [self = shared_from_this()](beast::error_code ec, size_t) {
+				if (ec || !self->res.keep_alive()) {
+					self->closeSocket();
+					return;
+				}
+				self->doRead();
+			});
+		}
+
+		void closeSocket() {
+			beast::error_code ec;
+			socket.shutdown(unixsocket::socket::shutdown_send, ec);
+		}
 	};
 
-	
+	inline void MetaHook::doAccept() {
+		acceptor.async_accept([this](beast::error_code ec, unixsocket::socket socket) {
+			// Acceptor was closed
+			if (ec == net::error::operation_aborted) return;
+			if (!ec) {
+				make_shared<session>(move(socket), state)->Start();
+			}
+			if (acceptor.is_open()) doAccept();
+		});
+	}
 }
 
 #endif
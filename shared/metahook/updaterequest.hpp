@@ -0,0 +1,381 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef UPDATEREQUEST_H
+#define UPDATEREQUEST_H
+
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "shared/metahook/hookpool.hpp"
+
+using namespace std;
+
+namespace metahook {
+
+	// Maximum nesting of unknown values skipped by the parser
+	inline constexpr int UPDATE_REQUEST_MAX_DEPTH = 64;
+
+	/**
+	 * Field of a update request
+	 *
+	 * Only the member matching the field type is set, list values are the range [ListBegin, ListEnd) of ListItems.
+	 */
+	struct UpdateField {
+		string_view Key;
+		string_view String;
+		bool Bool = false;
+		double Double = 0.0;
+		size_t ListBegin = 0;
+		size_t ListEnd = 0;
+	};
+
+	/**
+	 * Parsed update request, the JSON contract of metahook.go:
+	 *
+	 * ```
+	 * {
+	 *   "string_fields": [{"key": "somekey", "value": "somevalue"}],
+	 *   "bool_fields": [{"key": "somekey", "value": true}],
+	 *   "double_fields": [{"key": "somekey", "value": 1.5}],
+	 *   "list_fields": [{"key": "somekey", "value": ["a", "b"]}]
+	 * }
+	 * ```
+	 *
+	 * Parse() unescapes strings in place, all fields are views into the parsed buffer.
+	 * A request object can be reused, its vectors keep their capacity, so parsing does not allocate.
+	 * Unknown members are skipped and null values are read as empty values (like encoding/json).
+	 */
+	class UpdateRequest {
+	public:
+		vector<UpdateField> StringFields;
+		vector<UpdateField> BoolFields;
+		vector<UpdateField> DoubleFields;
+		vector<UpdateField> ListFields;
+		vector<string_view> ListItems;
+
+		/**
+		 * Parse the JSON request in `data`, the buffer is modified and must outlive the fields
+		 *
+		 * Function will throw a runtime error if the request is invalid
+		 */
+		void Parse(char* data, size_t size) {
+			StringFields.clear();
+			BoolFields.clear();
+			DoubleFields.clear();
+			ListFields.clear();
+			ListItems.clear();
+			cur = data;
+			end = data + size;
+
+			parseObject([&](string_view member) {
+				if (member == "string_fields") parseFields(StringFields, FIELD_STRING);
+				else if (member == "bool_fields") parseFields(BoolFields, FIELD_BOOL);
+				else if (member == "double_fields") parseFields(DoubleFields, FIELD_DOUBLE);
+				else if (member == "list_fields") parseFields(ListFields, FIELD_LIST);
+				else skipValue(0);
+			});
+			skipWhitespace();
+			if (cur != end) fail("unexpected data after request");
+		}
+
+	private:
+		enum FIELDTYPE { FIELD_STRING, FIELD_BOOL, FIELD_DOUBLE, FIELD_LIST };
+
+		char* cur = nullptr;
+		char* end = nullptr;
+
+		[[noreturn]] void fail(const string& reason) const {
+			throw runtime_error("invalid update request: " + reason);
+		}
+
+		void skipWhitespace() {
+			while (cur != end && (*cur == ' ' || *cur == '\t' || *cur == '\n' || *cur == '\r')) cur++;
+		}
+
+		char peek() {
+			skipWhitespace();
+			if (cur == end) fail("unexpected end of request");
+			return *cur;
+		}
+
+		void expect(char c) {
+			if (peek() != c) fail(string("expected '") + c + "'");
+			cur++;
+		}
+
+		bool consumeLiteral(string_view literal) {
+			skipWhitespace();
+			if ((size_t)(end - cur) < literal.size() || string_view(cur, literal.size()) != literal) return false;
+			cur += literal.size();
+			return true;
+		}
+
+		/**
+		 * Parse a object and call `member(name)` for every member, the callback must consume the value
+		 */
+		template <typename Member>
+		void parseObject(Member&& member) {
+			expect('{');
+			if (peek() == '}') {
+				cur++;
+				return;
+			}
+			while (true) {
+				string_view name = parseString();
+				expect(':');
+				member(name);
+				char c = peek();
+				cur++;
+				if (c == '}') return;
+				if (c != ',') fail("expected ',' or '}'");
+			}
+		}
+
+		/**
+		 * Parse a array and call `element()` for every element, the callback must consume the element
+		 *
+		 * Returns false if the value is null.
+		 */
+		template <typename Element>
+		bool parseArray(Element&& element) {
+			if (consumeLiteral("null")) return false;
+			expect('[');
+			if (peek() == ']') {
+				cur++;
+				return true;
+			}
+			while (true) {
+				element();
+				char c = peek();
+				cur++;
+				if (c == ']') return true;
+				if (c != ',') fail("expected ',' or ']'");
+			}
+		}
+
+		void parseFields(vector<UpdateField>& fields, FIELDTYPE type) {
+			parseArray([&]() {
+				UpdateField field;
+				parseObject([&](string_view member) {
+					if (member == "key") {
+						field.Key = parseNullableString();
+					} else if (member == "value") {
+						switch (type) {
+						case FIELD_STRING: field.String = parseNullableString(); break;
+						case FIELD_BOOL: field.Bool = parseBool(); break;
+						case FIELD_DOUBLE: field.Double = parseDouble(); break;
+						case FIELD_LIST:
+							field.ListBegin = ListItems.size();
+							parseArray([&]() { ListItems.push_back(parseNullableString()); });
+							field.ListEnd = ListItems.size();
+							break;
+						}
+					} else skipValue(0);
+				});
+				fields.push_back(field);
+			});
+		}
+
+		string_view parseNullableString() {
+			if (consumeLiteral("null")) return string_view();
+			return parseString();
+		}
+
+		bool parseBool() {
+			if (consumeLiteral("true")) return true;
+			if (consumeLiteral("false") || consumeLiteral("null")) return false;
+			fail("expected bool");
+		}
+
+		double parseDouble() {
+			if (consumeLiteral("null")) return 0.0;
+			skipWhitespace();
+			double value = 0.0;
+			auto [ptr, ec] = from_chars(cur, end, value);
+			if (ec != errc() || ptr == cur) fail("expected number");
+			cur = const_cast<char*>(ptr);
+			return value;
+		}
+
+		static int hexValue(char c) {
+			if (c >= '0' && c <= '9') return c - '0';
+			if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+			if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+			return -1;
+		}
+
+		uint32_t parseHex4() {
+			if (end - cur < 4) fail("invalid unicode escape");
+			uint32_t value = 0;
+			for (int i = 0; i < 4; i++) {
+				int digit = hexValue(*cur++);
+				if (digit < 0) fail("invalid unicode escape");
+				value = value << 4 | digit;
+			}
+			return value;
+		}
+
+		/**
+		 * Parse a string and unescape it in place (escapes are never shorter than their value)
+		 */
+		string_view parseString() {
+			expect('"');
+			char* begin = cur;
+			char* out = cur;
+			while (true) {
+				if (cur == end) fail("unterminated string");
+				char c = *cur++;
+				if (c == '"') break;
+				if ((unsigned char)c < 0x20) fail("control character in string");
+				if (c != '\\') {
+					*out++ = c;
+					continue;
+				}
+				if (cur == end) fail("unterminated string");
+				switch (*cur++) {
+				case '"': *out++ = '"'; break;
+				case '\\': *out++ = '\\'; break;
+				case '/': *out++ = '/'; break;
+				case 'b': *out++ = '\b'; break;
+				case 'f': *out++ = '\f'; break;
+				case 'n': *out++ = '\n'; break;
+				case 'r': *out++ = '\r'; break;
+				case 't': *out++ = '\t'; break;
+				case 'u': {
+					uint32_t code = parseHex4();
+					if (code >= 0xD800 && code < 0xDC00 && end - cur >= 6 && cur[0] == '\\' && cur[1] == 'u') {
+						cur += 2;
+						uint32_t low = parseHex4();
+						if (low < 0xDC00 || low >= 0xE000) fail("invalid surrogate pair");
+						code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+					}
+					out = appendUtf8(out, code);
+					break;
+				}
+				default: fail("invalid escape");
+				}
+			}
+			return string_view(begin, out - begin);
+		}
+
+		static char* appendUtf8(char* out, uint32_t code) {
+			if (code < 0x80) {
+				*out++ = (char)code;
+			} else if (code < 0x800) {
+				*out++ = (char)(0xC0 | code >> 6);
+				*out++ = (char)(0x80 | (code & 0x3F));
+			} else if (code < 0x10000) {
+				*out++ = (char)(0xE0 | code >> 12);
+				*out++ = (char)(0x80 | (code >> 6 & 0x3F));
+				*out++ = (char)(0x80 | (code & 0x3F));
+			} else {
+				*out++ = (char)(0xF0 | code >> 18);
+				*out++ = (char)(0x80 | (code >> 12 & 0x3F));
+				*out++ = (char)(0x80 | (code >> 6 & 0x3F));
+				*out++ = (char)(0x80 | (code & 0x3F));
+			}
+			return out;
+		}
+
+		void skipValue(int depth) {
+			if (depth > UPDATE_REQUEST_MAX_DEPTH) fail("request nested too deep");
+			char c = peek();
+			if (c == '"') {
+				parseString();
+			} else if (c == '{') {
+				parseObject([&](string_view) { skipValue(depth + 1); });
+			} else if (c == '[') {
+				parseArray([&]() { skipValue(depth + 1); });
+			} else if (!consumeLiteral("true") && !consumeLiteral("false") && !consumeLiteral("null")) {
+				parseDouble();
+			}
+		}
+	};
+
+	/**
+	 * Append a JSON list of error strings, null if there are no errors (encoding/json writes empty slices as null)
+	 */
+	inline void AppendErrorList(string& out, const vector<string>& errs) {
+		if (errs.empty()) {
+			out += "null";
+			return;
+		}
+		out += '[';
+		for (size_t i = 0; i < errs.size(); i++) {
+			if (i > 0) out += ',';
+			out += '"';
+			for (char c : errs[i]) {
+				switch (c) {
+				case '"': out += "\\\""; break;
+				case '\\': out += "\\\\"; break;
+				case '\n': out += "\\n"; break;
+				case '\r': out += "\\r"; break;
+				case '\t': out += "\\t"; break;
+				default:
+					if ((unsigned char)c < 0x20) {
+						static const char hex[] = "0123456789abcdef";
+						out += "\\u00";
+						out += hex[(unsigned char)c >> 4];
+						out += hex[c & 0xF];
+					} else out += c;
+				}
+			}
+			out += '"';
+		}
+		out += ']';
+	}
+
+	/**
+	 * Append the JSON response of a update request (`{"err":[...]}`, errors are strings)
+	 *
+	 * If the hooks run asynchronously, the id of their job is added (`{"err":null,"job":1}`).
+	 */
+	inline void AppendUpdateResponse(string& out, const vector<string>& errs, optional<uint64_t> job = nullopt) {
+		out += "{\"err\":";
+		AppendErrorList(out, errs);
+		if (job) {
+			out += ",\"job\":";
+			out += to_string(*job);
+		}
+		out += "}\n";
+	}
+
+	/**
+	 * Append the JSON status of a hook job (`{"job":1,"done":true,"pending":0,"err":null}`)
+	 */
+	inline void AppendJobResponse(string& out, const HookJobStatus& status) {
+		out += "{\"job\":";
+		out += to_string(status.Id);
+		out += status.Done ? ",\"done\":true" : ",\"done\":false";
+		out += ",\"pending\":";
+		out += to_string(status.Pending);
+		out += ",\"err\":";
+		AppendErrorList(out, status.Errors);
+		out += "}\n";
+	}
+}
+
+#endif
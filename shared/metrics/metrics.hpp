@@ -0,0 +1,289 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace metrics {
+
+	// Number of cells a Counter is striped over, threads increment different cells
+	inline constexpr size_t METRICS_COUNTER_STRIPES = 16;
+	// Histogram buckets are powers of 2 nanoseconds from 2^METRICS_HISTOGRAM_MIN_EXP (256ns) ...
+	inline constexpr size_t METRICS_HISTOGRAM_MIN_EXP = 8;
+	// ... to 2^(METRICS_HISTOGRAM_MIN_EXP + METRICS_HISTOGRAM_BUCKETS - 1) (~34s)
+	inline constexpr size_t METRICS_HISTOGRAM_BUCKETS = 28;
+
+	/**
+	 * Stripe of the calling thread, assigned round robin on the first use
+	 */
+	inline size_t stripe() {
+		static atomic<size_t> nextStripe = 0;
+		static thread_local size_t threadStripe = nextStripe.fetch_add(1, memory_order_relaxed) % METRICS_COUNTER_STRIPES;
+		return threadStripe;
+	}
+
+	/**
+	 * Monotonic lock-free counter
+	 *
+	 * The count is striped over cache lines, so concurrent increments of hot paths do not contend.
+	 * Reading sums all stripes, reads are meant for the (rare) metric collection.
+	 */
+	class Counter {
+	public:
+		void Add(uint64_t n = 1) {
+			cells[stripe()].value.fetch_add(n, memory_order_relaxed);
+		}
+
+		uint64_t Value() const {
+			uint64_t sum = 0;
+			for (const auto& cell : cells) sum += cell.value.load(memory_order_relaxed);
+			return sum;
+		}
+
+	private:
+		struct alignas(64) cell {
+			atomic<uint64_t> value = 0;
+		};
+		cell cells[METRICS_COUNTER_STRIPES];
+	};
+
+	/**
+	 * Lock-free gauge that remembers its maximum (high-water mark)
+	 */
+	class Gauge {
+	public:
+		void Set(int64_t v) {
+			value.store(v, memory_order_relaxed);
+			updateMax(v);
+		}
+
+		void Add(int64_t n = 1) {
+			updateMax(value.fetch_add(n, memory_order_relaxed) + n);
+		}
+
+		void Sub(int64_t n = 1) {
+			value.fetch_sub(n, memory_order_relaxed);
+		}
+
+		int64_t Value() const {
+			return value.load(memory_order_relaxed);
+		}
+
+		int64_t Max() const {
+			return max.load(memory_order_relaxed);
+		}
+
+	private:
+		atomic<int64_t> value = 0;
+		atomic<int64_t> max = 0;
+
+		void updateMax(int64_t v) {
+			int64_t current = max.load(memory_order_relaxed);
+			while (v > current && !max.compare_exchange_weak(current, v, memory_order_relaxed));
+		}
+	};
+
+	/**
+	 * Lock-free histogram of durations
+	 *
+	 * Buckets are powers of 2 nanoseconds, observing a duration costs a bit scan and two atomic increments.
+	 */
+	class Histogram {
+	public:
+		void Observe(int64_t ns) {
+			uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+			// Smallest exponent with v <= 2^exp
+			size_t exp = v <= 1 ? 0 : bit_width(v - 1);
+			size_t index = exp <= METRICS_HISTOGRAM_MIN_EXP ? 0 : exp - METRICS_HISTOGRAM_MIN_EXP;
+			// Durations above the last bucket are only counted in +Inf
+			if (index < METRICS_HISTOGRAM_BUCKETS) buckets[index].fetch_add(1, memory_order_relaxed);
+			count.fetch_add(1, memory_order_relaxed);
+			sum.fetch_add(v, memory_order_relaxed);
+		}
+
+		void Observe(chrono::nanoseconds duration) {
+			Observe(duration.count());
+		}
+
+		/**
+		 * Number of observations in the bucket (not cumulative)
+		 */
+		uint64_t Bucket(size_t index) const {
+			return buckets[index].load(memory_order_relaxed);
+		}
+
+		/**
+		 * Upper bound of the bucket in nanoseconds
+		 */
+		static uint64_t BucketBound(size_t index) {
+			return uint64_t(1) << (index + METRICS_HISTOGRAM_MIN_EXP);
+		}
+
+		uint64_t Count() const {
+			return count.load(memory_order_relaxed);
+		}
+
+		uint64_t SumNs() const {
+			return sum.load(memory_order_relaxed);
+		}
+
+	private:
+		atomic<uint64_t> buckets[METRICS_HISTOGRAM_BUCKETS] = {};
+		atomic<uint64_t> count = 0;
+		atomic<uint64_t> sum = 0;
+	};
+
+	/**
+	 * Writes metrics in the Prometheus text format (version 0.0.4)
+	 *
+	 * Every metric must be written once, names should follow the Prometheus conventions
+	 * (e.g. counters end with _total, durations are exported in seconds).
+	 */
+	class MetricWriter {
+	public:
+		explicit MetricWriter(string& out) : out(out) {}
+
+		void WriteCounter(string_view name, string_view help, double value) {
+			writeHeader(name, help, "counter");
+			writeSample(name, "", value);
+		}
+
+		void WriteGauge(string_view name, string_view help, double value) {
+			writeHeader(name, help, "gauge");
+			writeSample(name, "", value);
+		}
+
+		/**
+		 * Write a histogram of durations, bucket bounds and the sum are converted to seconds
+		 */
+		void WriteHistogram(string_view name, string_view help, const Histogram& histogram) {
+			writeHeader(name, help, "histogram");
+			string bucketName = string(name) + "_bucket";
+			// Buckets are read one by one, the total is read first so the +Inf bucket is never below a bucket
+			uint64_t total = histogram.Count();
+			uint64_t cumulative = 0;
+			for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+				cumulative += histogram.Bucket(i);
+				if (cumulative > total) total = cumulative;
+				string label = "le=\"";
+				appendDouble(label, (double)Histogram::BucketBound(i) / 1e9);
+				label += "\"";
+				writeSample(bucketName, label, (double)cumulative);
+			}
+			writeSample(bucketName, "le=\"+Inf\"", (double)total);
+			writeSample(string(name) + "_sum", "", (double)histogram.SumNs() / 1e9);
+			writeSample(string(name) + "_count", "", (double)total);
+		}
+
+	private:
+		string& out;
+
+		void writeHeader(string_view name, string_view help, string_view type) {
+			out += "# HELP ";
+			out += name;
+			out += ' ';
+			out += help;
+			out += "\n# TYPE ";
+			out += name;
+			out += ' ';
+			out += type;
+			out += '\n';
+		}
+
+		void writeSample(string_view name, string_view labels, double value) {
+			out += name;
+			if (!labels.empty()) {
+				out += '{';
+				out += labels;
+				out += '}';
+			}
+			out += ' ';
+			appendDouble(out, value);
+			out += '\n';
+		}
+
+		static void appendDouble(string& str, double value) {
+			char buffer[32];
+			auto [ptr, ec] = to_chars(buffer, buffer + sizeof(buffer), value);
+			str.append(buffer, ptr);
+		}
+	};
+
+	/**
+	 * Collector that writes the metrics of a component
+	 */
+	using MetricCollector = function<void(MetricWriter&)>;
+
+	/**
+	 * Set of collectors exported together (e.g. on the /metrics route of the MetaHook)
+	 *
+	 * Components own their metrics and only write them on collection,
+	 * the collector of a component must be unregistered before the component is destroyed.
+	 */
+	class MetricRegistry {
+	public:
+		/**
+		 * Register a collector, returns a id for Unregister()
+		 */
+		uint64_t Register(MetricCollector collector) {
+			lock_guard<mutex> lock(registryLock);
+			uint64_t id = nextId++;
+			collectors.push_back({id, move(collector)});
+			return id;
+		}
+
+		void Unregister(uint64_t id) {
+			lock_guard<mutex> lock(registryLock);
+			erase_if(collectors, [id](const auto& entry) { return entry.first == id; });
+		}
+
+		/**
+		 * Append the metrics of all collectors to `out` (Prometheus text format)
+		 */
+		void Collect(string& out) {
+			MetricWriter writer(out);
+			lock_guard<mutex> lock(registryLock);
+			for (const auto& [id, collector] : collectors) {
+				collector(writer);
+			}
+		}
+
+	private:
+		mutex registryLock;
+		uint64_t nextId = 1;
+		vector<pair<uint64_t, MetricCollector>> collectors;
+	};
+}
+
+#endif
@@ -0,0 +1,71 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASYNCCHAN_H
+#define ASYNCCHAN_H
+
+#include <utility>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+
+#include "shared/util/chan.hpp"
+
+namespace net = boost::asio;
+
+using namespace std;
+
+namespace util {
+	/**
+	 * Get next value from the chan asynchronously with a asio completion token
+	 *
+	 * Instead of parking a thread on the chan, the operation completes on the executor
+	 * associated with the completion handler (e.g. the executor of the coroutine with `net::use_awaitable`).
+	 * The completion signature is `void(pair<T, bool>)`, the pair has the same meaning as the one returned by get().
+	 *
+	 * ```
+	 * auto [value, ok] = co_await util::async_get(ch, net::use_awaitable);
+	 * ```
+	 *
+	 * The executor is kept busy (work guard) until the operation completes.
+	 * Pending operations are completed with <T(), false> if the chan is closed, cancellation is not supported.
+	 *
+	 * If the handler has no associated executor, the result is posted to the asio system executor,
+	 * use `net::bind_executor` to select where it should run.
+	 */
+	template <typename T, typename Alloc, typename CompletionToken>
+	auto async_get(chan<T, Alloc>& ch, CompletionToken&& token) {
+		return net::async_initiate<CompletionToken, void(pair<T, bool>)>(
+			[&ch](auto handler) {
+				auto work = net::make_work_guard(net::get_associated_executor(handler));
+				// The chan calls this on the pushing thread, it only hands the result over to the executor
+				ch.get_async([handler = move(handler), work = move(work)](pair<T, bool> res) mutable {
+					auto ex = work.get_executor();
+					net::post(ex, [handler = move(handler), work = move(work), res = move(res)]() mutable {
+						move(handler)(move(res));
+					});
+				});
+			},
+			token
+		);
+	}
+}
+
+#endif
@@ -0,0 +1,83 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef ASYNCWORKPOOL_H
+#define ASYNCWORKPOOL_H
+
+#include <utility>
+#include <boost/asio/execution.hpp>
+
+#include "shared/util/workpool.hpp"
+
+namespace net = boost::asio;
+
+using namespace std;
+
+namespace util {
+	/**
+	 * Asio executor running handlers on a workpool
+	 *
+	 * Satisfies the asio standard executor requirements, so it can be used with `net::post`, `net::dispatch`
+	 * and `net::bind_executor` to move completion handlers (e.g. of net::io_context operations) onto the pool:
+	 *
+	 * ```
+	 * util::workpool pool;
+	 * net::post(util::workpool_executor(pool), []() { ... });
+	 * socket.async_read_some(buffer, net::bind_executor(util::workpool_executor(pool), handler));
+	 * ```
+	 *
+	 * Handlers are never run inline (blocking.never), handlers posted to a closed pool are dropped.
+	 * The pool is not a asio execution_context, so the executor cannot be converted to `net::any_io_executor`.
+	 */
+	class workpool_executor {
+	public:
+		explicit workpool_executor(workpool& pool) noexcept : pool(&pool) {}
+
+		template <typename F>
+		void execute(F&& f) const {
+			pool->post(worktask(forward<F>(f)));
+		}
+
+		workpool& query(net::execution::context_t) const noexcept {
+			return *pool;
+		}
+
+		static constexpr net::execution::blocking_t query(net::execution::blocking_t) noexcept {
+			return net::execution::blocking.never;
+		}
+
+		workpool_executor require(net::execution::blocking_t::never_t) const noexcept {
+			return *this;
+		}
+
+		bool operator==(const workpool_executor& other) const noexcept {
+			return pool == other.pool;
+		}
+
+		bool operator!=(const workpool_executor& other) const noexcept {
+			return pool != other.pool;
+		}
+
+	private:
+		workpool* pool;
+	};
+}
+
+#endif
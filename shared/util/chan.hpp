@@ -20,14 +20,86 @@
 #ifndef CHAN_H
 #define CHAN_H
 
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
 #include <mutex>
 #include <queue>
+#include <ranges>
+#include <tuple>
 #include <utility>
+#include <vector>
+
+#include "shared/util/trace.hpp"
 
 using namespace std;
 
 namespace util {
+	/**
+	 * Policy applied when a value is pushed to a bounded chan that is full
+	 */
+	enum OVERFLOWPOLICY {
+		// Suspend the producer until a reader makes space (like a buffered Go chan)
+		BLOCK,
+		// Reject the value, push() returns false (like a Go select with default case)
+		FAIL,
+		// Discard the oldest value in the chan to make space for the new one
+		DROP_OLDEST,
+		// Discard the pushed value, push() returns false
+		DROP_NEWEST,
+	};
+
+	/**
+	 * Counters of the overflow policy actions and the waits of a chan
+	 */
+	struct chanstats {
+		// Number of pushes that had to wait for space (BLOCK)
+		size_t blocked = 0;
+		// Time the pushes waited for space in nanoseconds (BLOCK)
+		uint64_t blockedNs = 0;
+		// Number of pushes that were rejected (FAIL)
+		size_t rejected = 0;
+		// Number of queued values that were discarded (DROP_OLDEST)
+		size_t droppedOldest = 0;
+		// Number of pushed values that were discarded (DROP_NEWEST)
+		size_t droppedNewest = 0;
+		// Maximum number of values that were queued at once
+		size_t highWater = 0;
+		// Number of gets that had to wait for a value
+		size_t waited = 0;
+		// Time the gets waited for a value in nanoseconds
+		uint64_t waitedNs = 0;
+	};
+
+	/**
+	 * Wakeup handle of a thread waiting in select()
+	 *
+	 * Every chan notifies all registered waiters when a value is pushed or the chan is closed.
+	 */
+	struct chanwaiter {
+		mutex waiterMutex;
+		condition_variable waiterCond;
+		bool signaled = false;
+
+		void notify() {
+			{
+				lock_guard<mutex> lock(waiterMutex);
+				signaled = true;
+			}
+			waiterCond.notify_one();
+		};
+	};
+
+	template <typename Chan, typename Fn>
+	struct selectcase;
+
 	/**
 	 * Chan is a simple wrapper around std::queue
 	 * that allows asynchron access and waiting for new value
@@ -36,11 +108,43 @@ namespace util {
 	 * 
 	 * Every operation / method can be used asynchron without any synchronisation mechanism.
 	 *
-	 * Close the channel with close() or call the destructor.
+	 * By default the chan is unbounded, a capacity can be set to limit its size,
+	 * the OVERFLOWPOLICY then determines what happens if a value is pushed to a full chan.
+	 *
+	 * The queue allocates its nodes with `Alloc`, use pmrchan to take them from a memory resource.
+	 *
+	 * Close the channel with close() or call the destructor,
+	 * use shutdown() to let the readers receive the queued values first.
 	 */
-	template <typename T>
+	template <typename T, typename Alloc = allocator<T>>
 	class chan {
 	public:
+		using value_type = T;
+		using allocator_type = Alloc;
+		// Handler of a asynchronous get, called with the same pair a get() returns
+		using asynchandler = move_only_function<void(pair<T, bool>)>;
+
+		/**
+		 * Create a unbounded chan
+		 */
+		chan() = default;
+
+		/**
+		 * Create a bounded chan that holds at most `capacity` values
+		 *
+		 * A capacity of 0 creates a unbounded chan.
+		 */
+		explicit chan(size_t capacity, OVERFLOWPOLICY policy = BLOCK)
+			: chanCapacity(capacity), chanPolicy(policy) {};
+
+		/**
+		 * Create a chan that allocates its queue with `alloc`
+		 *
+		 * A capacity of 0 creates a unbounded chan.
+		 */
+		chan(size_t capacity, OVERFLOWPOLICY policy, const Alloc& alloc)
+			: chanCapacity(capacity), chanPolicy(policy), chanQueue(alloc) {};
+
 		virtual ~chan() {
 			// If channel was not shut, shut it now. Note that this is more like a preventFootGun() function
 			// its recommended to close the channel in a controlled manner with close();
@@ -50,16 +154,140 @@ namespace util {
 		/**
 		 * Push a value to the chan
 		 *
-		 * If the channel is already closed, it will do nothing.
+		 * If the chan is bounded and full, the OVERFLOWPOLICY of the chan is applied.
+		 *
+		 * Returns true if the value was added to the chan.
+		 * If the channel is already closed (or is closed while blocking), it will do nothing and return false.
 		 */ 
-		void push(T val) {
-			lock_guard<mutex> lock(chanMutex);
+		bool push(T val) {
+			unique_lock<mutex> lock(chanMutex);
 			// If channel is shut don't allow anything to be pushed to the queue
-			if (isChanShut) return;
+			if (isWriteClosed()) return false;
+			if (!asyncReaders.empty()) {
+				// Hand the value directly to the oldest asynchronous reader (queue is always empty in this case)
+				auto handler = move(asyncReaders.front());
+				asyncReaders.pop_front();
+				lock.unlock();
+				handler(make_pair(move(val), true));
+				return true;
+			}
+			if (isFull()) {
+				switch (chanPolicy) {
+				case BLOCK: {
+					TRACE_SPAN("chan.push.wait");
+					stats.blocked++;
+					writerThreadCount++;
+					auto waitStart = chrono::steady_clock::now();
+					// Wait for a writerCond notification, this happens in 2 scenarios, 1. Something is read 2. channel is shut
+					writerCond.wait(lock, [this]{ return isWriteClosed() || !isFull(); });
+					stats.blockedNs += elapsedNs(waitStart);
+					writerThreadCount--;
+					// If channel is shut, notify closer to check the writerCount
+					if (isWriteClosed()) {
+						shutCond.notify_one();
+						return false;
+					}
+					break;
+				}
+				case FAIL:
+					stats.rejected++;
+					return false;
+				case DROP_OLDEST:
+					stats.droppedOldest++;
+					chanQueue.pop();
+					break;
+				case DROP_NEWEST:
+					stats.droppedNewest++;
+					return false;
+				}
+			}
 			// Push value to the queue and notify the chanCond to update one random reader thread
 			// This is the same behavior as you will see in Go channels.
-			chanQueue.push(val);
+			chanQueue.push(move(val));
+			if (chanQueue.size() > stats.highWater) stats.highWater = chanQueue.size();
 			chanCond.notify_one();
+			notifySelectors();
+			return true;
+		};
+
+		/**
+		 * Push multiple values to the chan
+		 *
+		 * All values are pushed under one lock acquisition and readers are notified once.
+		 * If the chan is bounded, the OVERFLOWPOLICY is applied to every value that does not fit.
+		 * With BLOCK, already pushed values are handed to the readers before the writer suspends.
+		 *
+		 * Returns the number of values added to the chan.
+		 */
+		template <typename InputIt>
+		size_t push_bulk(InputIt first, InputIt last) {
+			unique_lock<mutex> lock(chanMutex);
+			size_t pushed = 0;
+			// Values handed directly to asynchronous readers, they are called after releasing the lock
+			vector<pair<asynchandler, T>> handoffs;
+			for (; first != last && !isWriteClosed(); ++first) {
+				if (!asyncReaders.empty()) {
+					handoffs.emplace_back(move(asyncReaders.front()), *first);
+					asyncReaders.pop_front();
+					pushed++;
+					continue;
+				}
+				if (isFull()) {
+					bool discard = false;
+					switch (chanPolicy) {
+					case BLOCK: {
+						TRACE_SPAN("chan.push.wait");
+						stats.blocked++;
+						// Readers must be notified before waiting, otherwise they never make space
+						if (pushed) chanCond.notify_all();
+						writerThreadCount++;
+						auto waitStart = chrono::steady_clock::now();
+						writerCond.wait(lock, [this]{ return isWriteClosed() || !isFull(); });
+						stats.blockedNs += elapsedNs(waitStart);
+						writerThreadCount--;
+						if (isWriteClosed()) {
+							shutCond.notify_one();
+							discard = true;
+						}
+						break;
+					}
+					case FAIL:
+						stats.rejected++;
+						discard = true;
+						break;
+					case DROP_OLDEST:
+						stats.droppedOldest++;
+						chanQueue.pop();
+						break;
+					case DROP_NEWEST:
+						stats.droppedNewest++;
+						discard = true;
+						break;
+					}
+					if (discard) continue;
+				}
+				chanQueue.push(*first);
+				pushed++;
+			}
+			if (chanQueue.size() > stats.highWater) stats.highWater = chanQueue.size();
+			if (pushed==1) chanCond.notify_one();
+			else if (pushed>1) chanCond.notify_all();
+			if (pushed) notifySelectors();
+			lock.unlock();
+			for (auto& handoff : handoffs) {
+				handoff.first(make_pair(move(handoff.second), true));
+			}
+			return pushed;
+		};
+
+		/**
+		 * Push all values of a range to the chan
+		 *
+		 * Same behavior as push_bulk().
+		 */
+		template <ranges::input_range R>
+		size_t push_range(R&& range) {
+			return push_bulk(ranges::begin(range), ranges::end(range));
 		};
 
 		/**
@@ -70,7 +298,7 @@ namespace util {
 		 *
 		 * This will return a pair, which always returns the `value` and a `ok` parameter.
 		 * If everything is fine, the `value` is filled and `ok` is `true`.
-		 * If the channel was closed, `value` is `T()` and `ok` is `false`.
+		 * If the channel was closed (or shut down and drained), `value` is `T()` and `ok` is `false`.
 		 *
 		 * Important: If you use multiple get() that wait at the same time,
 		 * the thread which gets informed is "randomly" determined by the OS thread handler.
@@ -79,23 +307,148 @@ namespace util {
 			unique_lock<mutex> lock(chanMutex);
 			// If get is called while ChanShut, it must be catched here
 			// because if not wait will wait forever (as notify_all() was already called at this point)
-			if (isChanShut) return make_pair(T(), false);
+			if (isReadClosed()) return make_pair(T(), false);
 
-			// Increment reader count
-			readerThreadCount++;
 			// Wait for a chanCond notification, this happens in 2 scenarios, 1. Something is pushed 2. channel is shut
-			chanCond.wait(lock, [this]{ return isChanShut || !chanQueue.empty(); });
-			// Decrement reader count
-			readerThreadCount--;
+			waitReadable([&]{
+				chanCond.wait(lock, [this]{ return isReadClosed() || !chanQueue.empty(); });
+				return true;
+			});
 			// If channel is shut, notify closer to check the readerCount
-			if (isChanShut) {
-				readerCond.notify_one();
+			if (isReadClosed()) {
+				shutCond.notify_one();
 				return make_pair(T(), false);
 			}
 			// If something is pushed, pop it from queue and return it
-			T el = move(chanQueue.front());
-			chanQueue.pop();
-			return make_pair(el, true);
+			return make_pair(popFront(), true);
+		};
+
+		/**
+		 * Get next value from the chan without blocking
+		 *
+		 * Returns <value, true> if a value was queued.
+		 * If the chan is empty or closed, `value` is `T()` and `ok` is `false` (use isclosed() to distinguish).
+		 */
+		pair<T, bool> try_get() {
+			lock_guard<mutex> lock(chanMutex);
+			if (isChanShut || chanQueue.empty()) return make_pair(T(), false);
+			return make_pair(popFront(), true);
+		};
+
+		/**
+		 * Get next value from the chan and wait at most `timeout` for it
+		 *
+		 * Same behavior as get_until().
+		 */
+		template <typename Rep, typename Period>
+		pair<T, bool> get_for(const chrono::duration<Rep, Period>& timeout) {
+			return get_until(chrono::steady_clock::now() + timeout);
+		};
+
+		/**
+		 * Get next value from the chan and wait until `deadline` for it
+		 *
+		 * If everything is fine, the `value` is filled and `ok` is `true`.
+		 * If the deadline passed or the channel was closed, `value` is `T()` and `ok` is `false`.
+		 */
+		template <typename Clock, typename Duration>
+		pair<T, bool> get_until(const chrono::time_point<Clock, Duration>& deadline) {
+			unique_lock<mutex> lock(chanMutex);
+			if (isReadClosed()) return make_pair(T(), false);
+
+			bool ready = waitReadable([&]{
+				return chanCond.wait_until(lock, deadline, [this]{ return isReadClosed() || !chanQueue.empty(); });
+			});
+			if (isReadClosed()) {
+				shutCond.notify_one();
+				return make_pair(T(), false);
+			}
+			if (!ready) return make_pair(T(), false);
+			return make_pair(popFront(), true);
+		};
+
+		/**
+		 * Get next value from the chan without suspending the thread
+		 *
+		 * The handler is called exactly once with the pair that get() would return.
+		 * If a value is queued or the chan is closed, it is called immediately on the current thread.
+		 * Otherwise it is stored and called by the thread that pushes the next value (or closes the chan),
+		 * so the handler must be cheap and should only dispatch the result (e.g. post it to an executor).
+		 *
+		 * Waiting asynchronous readers are served before threads suspended in get().
+		 */
+		void get_async(asynchandler handler) {
+			unique_lock<mutex> lock(chanMutex);
+			if (isReadClosed()) {
+				lock.unlock();
+				handler(make_pair(T(), false));
+				return;
+			}
+			if (chanQueue.empty()) {
+				asyncReaders.push_back(move(handler));
+				return;
+			}
+			T el = popFront();
+			lock.unlock();
+			handler(make_pair(move(el), true));
+		};
+
+		/**
+		 * Get multiple values from the chan
+		 *
+		 * If no value is in chan, this will suspend the thread
+		 * and block execution until the next value is pushed.
+		 * Then up to `max` values are moved to the end of `out` under one lock acquisition.
+		 *
+		 * Returns the number of values moved, if the channel was closed it returns 0.
+		 */
+		size_t get_batch(vector<T>& out, size_t max) {
+			if (max==0) return 0;
+			unique_lock<mutex> lock(chanMutex);
+			if (isReadClosed()) return 0;
+
+			waitReadable([&]{
+				chanCond.wait(lock, [this]{ return isReadClosed() || !chanQueue.empty(); });
+				return true;
+			});
+			if (isReadClosed()) {
+				shutCond.notify_one();
+				return 0;
+			}
+			return popBatch(out, max);
+		};
+
+		/**
+		 * Get multiple values from the chan and wait until `deadline` for the first one
+		 *
+		 * Same behavior as get_batch(), but returns 0 if the deadline passed.
+		 * Use isclosed() to distinguish a timeout from a closed chan.
+		 */
+		template <typename Clock, typename Duration>
+		size_t get_batch_until(vector<T>& out, size_t max, const chrono::time_point<Clock, Duration>& deadline) {
+			if (max==0) return 0;
+			unique_lock<mutex> lock(chanMutex);
+			if (isReadClosed()) return 0;
+
+			waitReadable([&]{
+				return chanCond.wait_until(lock, deadline, [this]{ return isReadClosed() || !chanQueue.empty(); });
+			});
+			if (isReadClosed()) {
+				shutCond.notify_one();
+				return 0;
+			}
+			return popBatch(out, max);
+		};
+
+		/**
+		 * Move up to `max` queued values to the end of `out` without blocking
+		 *
+		 * Returns the number of values moved, 0 if the chan is empty or closed.
+		 */
+		size_t drain(vector<T>& out, size_t max) {
+			lock_guard<mutex> lock(chanMutex);
+			if (isChanShut) return 0;
+			return popBatch(out, max);
 		};
 
 		/**
@@ -103,6 +456,9 @@ namespace util {
 		 *
 		 * Closing the channel will send a notification to all threads where a reader is waiting (with *get()*).
 		 * All readers will then return <T(), false> to indicate the channel has closed (simular to a go chan).
+		 * Writers blocked on a full chan will return false.
+		 * Handlers of pending get_async() calls are called with <T(), false>.
+		 * Values that are still queued are discarded, use shutdown() to deliver them.
 		 *
 		 * The channel is also closed if the object is destructed.
 		 *
@@ -113,15 +469,51 @@ namespace util {
 			if (isChanShut) return;
 			isChanShut = true;
 			chanCond.notify_all();
-			readerCond.wait(lock, [this]{ return readerThreadCount<=0; });
+			writerCond.notify_all();
+			notifySelectors();
+			shutCond.wait(lock, [this]{
+				return readerThreadCount<=0 && writerThreadCount<=0 && selectWaiters.empty();
+			});
+			// Asynchronous readers are completed outside of the lock
+			deque<asynchandler> pending;
+			pending.swap(asyncReaders);
+			lock.unlock();
+			for (auto& handler : pending) {
+				handler(make_pair(T(), false));
+			}
 		};
 
 		/**
-		 * Returns the state of the channel
+		 * Close the channel for writers, readers still receive the queued values (like closing a Go chan)
+		 *
+		 * Pushes return false after shutdown, writers blocked on a full chan return false.
+		 * Readers return the queued values and <T(), false> once the chan is empty,
+		 * waiting readers and pending get_async() calls are completed immediately if the chan is already empty.
+		 *
+		 * Use close() afterwards (or the destructor) to discard values that nobody reads anymore.
+		 */
+		void shutdown() {
+			unique_lock<mutex> lock(chanMutex);
+			if (isWriteClosed()) return;
+			isWriteShut = true;
+			chanCond.notify_all();
+			writerCond.notify_all();
+			notifySelectors();
+			// Asynchronous readers are only waiting if the queue is empty
+			deque<asynchandler> pending;
+			pending.swap(asyncReaders);
+			lock.unlock();
+			for (auto& handler : pending) {
+				handler(make_pair(T(), false));
+			}
+		};
+
+		/**
+		 * Returns the state of the channel (true after close() or shutdown())
 		 */
 		bool isclosed() {
 			lock_guard<mutex> lock(chanMutex);
-			return isChanShut;
+			return isWriteClosed();
 		};
 
 		/**
@@ -134,23 +526,358 @@ namespace util {
 			if (isChanShut) return 0;
 			return chanQueue.size();
 		};
+
+		/**
+		 * Get the capacity of the chan
+		 *
+		 * Returns 0 if the chan is unbounded.
+		 */
+		size_t capacity() const {
+			return chanCapacity;
+		};
+
+		/**
+		 * Get the counters of the overflow policy actions and the waits
+		 */
+		chanstats getstats() {
+			lock_guard<mutex> lock(chanMutex);
+			return stats;
+		};
 	
 	private:
+		template <typename Chan, typename Fn>
+		friend struct selectcase;
+
 		// Determines the state of the channel
 		bool isChanShut = false;
+		// Channel is closed for writers, readers drain the queue (see shutdown())
+		bool isWriteShut = false;
+
+		// Maximum number of queued values (0 means unbounded)
+		size_t chanCapacity = 0;
+		// Action taken if a value is pushed to a full chan
+		OVERFLOWPOLICY chanPolicy = BLOCK;
+		// Counters of the overflow policy actions
+		chanstats stats;
 
 		// Underlying FIFO datastructur
-		queue<T> chanQueue;
+		queue<T, deque<T, Alloc>> chanQueue;
 		// Lock for any operation in chan
 		mutex chanMutex;
 		// Variable for notifying readers if state changed or something is pushed to the structure
 		condition_variable chanCond;
 
+		// Variable for notifying writers blocked on a full chan if something is read or the state changed
+		condition_variable writerCond;
+
 		// Count of waiting readers (suspended threads waiting to be notified)
 		int readerThreadCount = 0;
+		// Count of waiting writers (suspended threads waiting for space)
+		int writerThreadCount = 0;
 		// Variable for notifying the channel after they have been shut
-		condition_variable readerCond;
+		condition_variable shutCond;
+
+		// Threads waiting in select() on this chan
+		vector<chanwaiter*> selectWaiters;
+
+		// Handlers of pending get_async() calls, only filled while the queue is empty
+		deque<asynchandler> asyncReaders;
+
+		/**
+		 * Returns true if the chan is bounded and has reached its capacity
+		 *
+		 * Must be called while holding the chanMutex.
+		 */
+		bool isFull() const {
+			return chanCapacity && chanQueue.size() >= chanCapacity;
+		};
+
+		/**
+		 * Returns true if pushes are rejected
+		 *
+		 * Must be called while holding the chanMutex.
+		 */
+		bool isWriteClosed() const {
+			return isChanShut || isWriteShut;
+		};
+
+		/**
+		 * Returns true if readers return <T(), false>, after close() or once a shut down chan is drained
+		 *
+		 * Must be called while holding the chanMutex.
+		 */
+		bool isReadClosed() const {
+			return isChanShut || (isWriteShut && chanQueue.empty());
+		};
+
+		/**
+		 * Suspend the calling reader with `wait` (returns the result of `wait`)
+		 *
+		 * The reader is counted for close(), the wait is only recorded if the reader actually suspends.
+		 * Must be called while holding the chanMutex.
+		 */
+		template <typename Wait>
+		bool waitReadable(Wait&& wait) {
+			// The wait predicate already holds, the lock is not released
+			if (!chanQueue.empty()) return wait();
+
+			TRACE_SPAN("chan.get.wait");
+			auto waitStart = chrono::steady_clock::now();
+			readerThreadCount++;
+			bool ready = wait();
+			readerThreadCount--;
+			stats.waited++;
+			stats.waitedNs += elapsedNs(waitStart);
+			return ready;
+		};
+
+		static uint64_t elapsedNs(chrono::steady_clock::time_point start) {
+			return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+		};
+
+		/**
+		 * Pop the front value from the queue
+		 *
+		 * Must be called while holding the chanMutex and with a non empty queue.
+		 */
+		T popFront() {
+			T el = move(chanQueue.front());
+			chanQueue.pop();
+			// Notify one blocked writer that there is space again
+			if (chanCapacity) writerCond.notify_one();
+			return el;
+		};
+
+		/**
+		 * Wake all threads waiting in select() on this chan
+		 *
+		 * Must be called while holding the chanMutex.
+		 */
+		void notifySelectors() {
+			for (auto waiter : selectWaiters) {
+				waiter->notify();
+			}
+		};
+
+		/**
+		 * Register a select() waiter
+		 */
+		void subscribe(chanwaiter* waiter) {
+			lock_guard<mutex> lock(chanMutex);
+			selectWaiters.push_back(waiter);
+		};
+
+		/**
+		 * Unregister a select() waiter
+		 *
+		 * Notifies the closer because it waits until all waiters have left.
+		 */
+		void unsubscribe(chanwaiter* waiter) {
+			lock_guard<mutex> lock(chanMutex);
+			erase(selectWaiters, waiter);
+			if (isChanShut) shutCond.notify_one();
+		};
+
+		/**
+		 * Try to receive a value for select()
+		 *
+		 * Returns true if the case is ready, which is the case if a value was queued or the chan is closed.
+		 */
+		bool trySelect(pair<T, bool>& res) {
+			lock_guard<mutex> lock(chanMutex);
+			if (isReadClosed()) {
+				res = make_pair(T(), false);
+				return true;
+			}
+			if (chanQueue.empty()) return false;
+			res = make_pair(popFront(), true);
+			return true;
+		};
+
+		/**
+		 * Move up to `max` values from the queue to the end of `out`
+		 *
+		 * Must be called while holding the chanMutex.
+		 */
+		size_t popBatch(vector<T>& out, size_t max) {
+			size_t count = 0;
+			while (count < max && !chanQueue.empty()) {
+				out.push_back(move(chanQueue.front()));
+				chanQueue.pop();
+				count++;
+			}
+			// Notify blocked writers that there is space again
+			if (chanCapacity && count) {
+				if (count==1) writerCond.notify_one();
+				else writerCond.notify_all();
+			}
+			return count;
+		};
 	};
+
+	/**
+	 * Chan that allocates its queue from a std::pmr::memory_resource
+	 *
+	 * The resource is only used while holding the chan lock, so a unsynchronized_pool_resource
+	 * that is exclusive to the chan is sufficient. Freed queue nodes are recycled by the pool,
+	 * a chan in steady state then does not allocate from the heap anymore.
+	 *
+	 * ```
+	 * pmr::unsynchronized_pool_resource pool;
+	 * util::pmrchan<int> ch(1024, util::BLOCK, &pool);
+	 * ```
+	 *
+	 * The resource must outlive the chan.
+	 */
+	template <typename T>
+	using pmrchan = chan<T, pmr::polymorphic_allocator<T>>;
+
+	/**
+	 * Receive case of a select()
+	 *
+	 * Create it with recv().
+	 */
+	template <typename Chan, typename Fn>
+	struct selectcase {
+		using result_type = pair<typename Chan::value_type, bool>;
+
+		Chan* ch;
+		Fn fn;
+
+		void subscribe(chanwaiter* waiter) { ch->subscribe(waiter); };
+		void unsubscribe(chanwaiter* waiter) { ch->unsubscribe(waiter); };
+		bool trySelect(result_type& res) { return ch->trySelect(res); };
+		void fire(result_type&& res) { fn(move(res)); };
+	};
+
+	/**
+	 * Create a receive case for select()
+	 *
+	 * The handler is called with the pair returned by the chan, like with get().
+	 * If the chan is closed, the case is ready and the handler is called with <T(), false> (simular to a go chan).
+	 */
+	template <typename T, typename Alloc, typename Fn>
+	selectcase<chan<T, Alloc>, decay_t<Fn>> recv(chan<T, Alloc>& ch, Fn&& fn) {
+		return {&ch, forward<Fn>(fn)};
+	}
+
+	namespace detail {
+		/**
+		 * Try every case once, starting at `start` to avoid starving the last cases
+		 *
+		 * The result of the ready case is stored in `results`.
+		 * Returns the index of the ready case or -1.
+		 */
+		template <typename CaseTuple, typename ResTuple, size_t... I>
+		int trySelectCases(CaseTuple& cases, ResTuple& results, size_t start, index_sequence<I...>) {
+			constexpr size_t count = sizeof...(I);
+			int ready = -1;
+			for (size_t n = 0; n < count && ready < 0; n++) {
+				size_t idx = (start + n) % count;
+				// Expand to the case with the index idx
+				((I == idx && get<I>(cases).trySelect(get<I>(results)) ? (ready = I, true) : false) || ...);
+			}
+			return ready;
+		}
+
+		/**
+		 * Call the handler of the case with the index `idx`
+		 */
+		template <typename CaseTuple, typename ResTuple, size_t... I>
+		void fireSelectCase(CaseTuple& cases, ResTuple& results, size_t idx, index_sequence<I...>) {
+			((I == idx ? (get<I>(cases).fire(move(get<I>(results))), true) : false) || ...);
+		}
+
+		/**
+		 * Wait until one case is ready or the deadline passed
+		 */
+		template <typename Clock, typename Duration, typename... Cases>
+		int selectUntil(const chrono::time_point<Clock, Duration>* deadline, Cases&... cases) {
+			static thread_local size_t selectRotation = 0;
+			auto tup = tie(cases...);
+			tuple<typename Cases::result_type...> results;
+			auto seq = index_sequence_for<Cases...>{};
+			size_t start = selectRotation++;
+
+			// Fast path without registering a waiter
+			int ready = trySelectCases(tup, results, start, seq);
+			if (ready < 0 && !(deadline && Clock::now() >= *deadline)) {
+				chanwaiter waiter;
+				(cases.subscribe(&waiter), ...);
+				while (true) {
+					{
+						// Reset before checking, a push after the check will set it again
+						lock_guard<mutex> lock(waiter.waiterMutex);
+						waiter.signaled = false;
+					}
+					ready = trySelectCases(tup, results, start, seq);
+					if (ready >= 0) break;
+
+					unique_lock<mutex> lock(waiter.waiterMutex);
+					if (deadline) {
+						if (!waiter.waiterCond.wait_until(lock, *deadline, [&]{ return waiter.signaled; })) break;
+					} else {
+						waiter.waiterCond.wait(lock, [&]{ return waiter.signaled; });
+					}
+				}
+				(cases.unsubscribe(&waiter), ...);
+			}
+			// Handler is called after unregistering, so it is allowed to close or destroy the chans
+			if (ready >= 0) fireSelectCase(tup, results, ready, seq);
+			return ready;
+		}
+	}
+
+	/**
+	 * Wait on multiple chans at the same time (simular to a go select statement)
+	 *
+	 * Blocks until one of the cases is ready and calls its handler (exactly one handler is called).
+	 * If multiple cases are ready, the start case is rotated to avoid starving a chan.
+	 *
+	 * ```
+	 * util::select(
+	 *   util::recv(ctrlChan, [](pair<Ctrl, bool> res) { ... }),
+	 *   util::recv(dataChan, [](pair<Data, bool> res) { ... })
+	 * );
+	 * ```
+	 *
+	 * Returns the index of the case that fired.
+	 */
+	template <typename... Cases>
+	int select(Cases&&... cases) {
+		return detail::selectUntil<chrono::steady_clock, chrono::steady_clock::duration>(nullptr, cases...);
+	}
+
+	/**
+	 * Select that waits until `deadline` for a ready case
+	 *
+	 * Returns the index of the case that fired or -1 if the deadline passed.
+	 */
+	template <typename Clock, typename Duration, typename... Cases>
+	int select_until(const chrono::time_point<Clock, Duration>& deadline, Cases&&... cases) {
+		return detail::selectUntil(&deadline, cases...);
+	}
+
+	/**
+	 * Select that waits at most `timeout` for a ready case
+	 *
+	 * Returns the index of the case that fired or -1 if the timeout passed.
+	 */
+	template <typename Rep, typename Period, typename... Cases>
+	int select_for(const chrono::duration<Rep, Period>& timeout, Cases&&... cases) {
+		return select_until(chrono::steady_clock::now() + timeout, forward<Cases>(cases)...);
+	}
+
+	/**
+	 * Select that does not block if no case is ready (simular to a go select with default case)
+	 *
+	 * Returns the index of the case that fired or -1 if no case was ready.
+	 */
+	template <typename... Cases>
+	int try_select(Cases&&... cases) {
+		auto deadline = chrono::steady_clock::time_point::min();
+		return detail::selectUntil(&deadline, cases...);
+	}
 }
 
 #endif
@@ -0,0 +1,535 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RINGCHAN_H
+#define RINGCHAN_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <iterator>
+#include <ranges>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace util {
+	/**
+	 * Size of a cache line, used to pad indices that are written by different threads
+	 */
+	inline constexpr size_t CACHE_LINE_SIZE = 64;
+
+	/**
+	 * Determines which threads are allowed to push to a ringchan
+	 */
+	enum RINGMODE {
+		// Exactly one thread pushes values
+		SPSC,
+		// Any number of threads push values
+		MPSC,
+	};
+
+	/**
+	 * Ringchan is a fixed-capacity lock-free alternative to chan
+	 *
+	 * It provides the same push() / get() / close() semantics as chan,
+	 * but the fast path does not take any lock.
+	 * Values are stored in a ring buffer where every slot carries a sequence number,
+	 * producers claim slots on the tail and the consumer releases them on the head.
+	 *
+	 * Ringchan only supports one reader, calling get() from multiple threads at the same time is not allowed.
+	 * The RINGMODE determines if one (SPSC) or multiple (MPSC) threads are allowed to push.
+	 *
+	 * If the ringchan is empty (on get()) or full (on push()) the thread spins briefly
+	 * and then parks on a atomic wait, the peer only issues a wakeup if a thread is actually parked.
+	 *
+	 * Close the channel with close() or call the destructor,
+	 * use shutdown() to let the reader receive the queued values first.
+	 */
+	template <typename T, RINGMODE Mode = MPSC>
+	class ringchan {
+	public:
+		/**
+		 * Create a ringchan that holds at most `capacity` values
+		 *
+		 * The capacity is rounded up to the next power of two.
+		 */
+		explicit ringchan(size_t capacity) {
+			if (capacity==0) {
+				throw invalid_argument("Ringchan requires a capacity greater than 0");
+			}
+			ringCapacity = 2;
+			while (ringCapacity < capacity) ringCapacity <<= 1;
+			ringMask = ringCapacity - 1;
+
+			ringBuffer = make_unique<cell[]>(ringCapacity);
+			for (size_t i = 0; i < ringCapacity; i++) {
+				ringBuffer[i].seq.store(i, memory_order_relaxed);
+			}
+		};
+
+		virtual ~ringchan() {
+			// If channel was not shut, shut it now. Note that this is more like a preventFootGun() function
+			// its recommended to close the channel in a controlled manner with close();
+			close();
+		};
+
+		ringchan(const ringchan&) = delete;
+		ringchan& operator=(const ringchan&) = delete;
+
+		/**
+		 * Push a value to the ringchan
+		 *
+		 * If the ringchan is full, this will suspend the thread until the reader makes space.
+		 *
+		 * Returns true if the value was added to the ringchan.
+		 * If the channel is already closed (or is closed while blocking), it will do nothing and return false.
+		 */
+		bool push(T val) {
+			if (isWriteClosed()) return false;
+			if (tryEnqueue(val)) return true;
+
+			// Slow path, wait for the reader
+			waitingThreadCount.fetch_add(1, memory_order_acq_rel);
+			bool ok = false;
+			await(spaceSignal, parkedWriterCount, [&]{
+				if (isWriteClosed()) return true;
+				return ok = tryEnqueue(val);
+			});
+			waitingThreadCount.fetch_sub(1, memory_order_acq_rel);
+			return ok;
+		};
+
+		/**
+		 * Push a value to the ringchan without blocking
+		 *
+		 * Returns false if the ringchan is full or closed.
+		 */
+		bool try_push(T val) {
+			if (isWriteClosed()) return false;
+			return tryEnqueue(val);
+		};
+
+		/**
+		 * Push multiple values to the ringchan
+		 *
+		 * Values are pushed in order, if the ringchan is full the thread is suspended like with push().
+		 *
+		 * Returns the number of values added to the ringchan.
+		 */
+		template <typename InputIt>
+		size_t push_bulk(InputIt first, InputIt last) {
+			size_t pushed = 0;
+			for (; first != last; ++first) {
+				if (!push(*first)) break;
+				pushed++;
+			}
+			return pushed;
+		};
+
+		/**
+		 * Push all values of a range to the ringchan
+		 *
+		 * Same behavior as push_bulk().
+		 */
+		template <ranges::input_range R>
+		size_t push_range(R&& range) {
+			return push_bulk(ranges::begin(range), ranges::end(range));
+		};
+
+		/**
+		 * Get next value from the ringchan
+		 *
+		 * If no value is in the ringchan, this will suspend the thread
+		 * and block execution until the next value is pushed.
+		 *
+		 * This will return a pair, which always returns the `value` and a `ok` parameter.
+		 * If everything is fine, the `value` is filled and `ok` is `true`.
+		 * If the channel was closed (or shut down and drained), `value` is `T()` and `ok` is `false`.
+		 *
+		 * Important: Only one thread is allowed to call get() at the same time.
+		 */
+		pair<T, bool> get() {
+			T val;
+			if (isShut.load(memory_order_acquire)) return make_pair(T(), false);
+			if (tryDequeue(val)) return make_pair(move(val), true);
+			if (isWriteShut.load(memory_order_acquire)) return drainedGet();
+
+			// Slow path, wait for a writer
+			waitingThreadCount.fetch_add(1, memory_order_acq_rel);
+			bool ok = false;
+			await(dataSignal, parkedReaderCount, [&]{
+				if (isShut.load(memory_order_acquire)) return true;
+				// Loaded before dequeuing, so values pushed before shutdown() are seen
+				bool drained = isWriteShut.load(memory_order_acquire);
+				if ((ok = tryDequeue(val))) return true;
+				return drained;
+			});
+			waitingThreadCount.fetch_sub(1, memory_order_acq_rel);
+			if (!ok) return make_pair(T(), false);
+			return make_pair(move(val), true);
+		};
+
+		/**
+		 * Get next value from the ringchan without blocking
+		 *
+		 * Returns <value, true> if a value was queued.
+		 * If the ringchan is empty or closed, `value` is `T()` and `ok` is `false` (use isclosed() to distinguish).
+		 */
+		pair<T, bool> try_get() {
+			T val;
+			if (isShut.load(memory_order_acquire) || !tryDequeue(val)) return make_pair(T(), false);
+			return make_pair(move(val), true);
+		};
+
+		/**
+		 * Get the next value without taking it, nullptr if the ringchan is empty or closed
+		 *
+		 * Only the reader is allowed to call peek(), the value stays valid until the reader takes it.
+		 */
+		const T* peek() {
+			if (isShut.load(memory_order_acquire)) return nullptr;
+			size_t pos = ringHead.load(memory_order_relaxed);
+			cell* c = &ringBuffer[pos & ringMask];
+			if ((intptr_t)c->seq.load(memory_order_acquire) - (intptr_t)(pos + 1) < 0) return nullptr;
+			return &c->val;
+		};
+
+		/**
+		 * Get next value from the ringchan and wait at most `timeout` for it
+		 *
+		 * Same behavior as get_until().
+		 */
+		template <typename Rep, typename Period>
+		pair<T, bool> get_for(const chrono::duration<Rep, Period>& timeout) {
+			return get_until(chrono::steady_clock::now() + timeout);
+		};
+
+		/**
+		 * Get next value from the ringchan and wait until `deadline` for it
+		 *
+		 * Atomic waits cannot time out, so after spinning the reader sleeps with an increasing backoff
+		 * (capped at MAX_BACKOFF) instead of parking. This adds up to MAX_BACKOFF of latency.
+		 *
+		 * If everything is fine, the `value` is filled and `ok` is `true`.
+		 * If the deadline passed or the channel was closed, `value` is `T()` and `ok` is `false`.
+		 */
+		template <typename Clock, typename Duration>
+		pair<T, bool> get_until(const chrono::time_point<Clock, Duration>& deadline) {
+			T val;
+			if (isShut.load(memory_order_acquire)) return make_pair(T(), false);
+			if (tryDequeue(val)) return make_pair(move(val), true);
+
+			waitingThreadCount.fetch_add(1, memory_order_acq_rel);
+			bool ok = false;
+			chrono::microseconds backoff(1);
+			for (int i = 0; !isShut.load(memory_order_acquire); i++) {
+				if ((ok = tryDequeue(val))) break;
+				if (isWriteShut.load(memory_order_acquire)) {
+					waitingThreadCount.fetch_sub(1, memory_order_acq_rel);
+					return drainedGet();
+				}
+				if (i < SPIN_ITERATIONS) continue;
+				auto now = Clock::now();
+				if (now >= deadline) break;
+				this_thread::sleep_for(min<chrono::nanoseconds>(backoff, deadline - now));
+				backoff = min<chrono::microseconds>(backoff * 2, MAX_BACKOFF);
+			}
+			waitingThreadCount.fetch_sub(1, memory_order_acq_rel);
+			if (!ok) return make_pair(T(), false);
+			return make_pair(move(val), true);
+		};
+
+		/**
+		 * Get multiple values from the ringchan
+		 *
+		 * If no value is in the ringchan, this will suspend the thread
+		 * and block execution until the next value is pushed.
+		 * Then up to `max` values are moved to the end of `out`.
+		 *
+		 * Returns the number of values moved, if the channel was closed it returns 0.
+		 */
+		size_t get_batch(vector<T>& out, size_t max) {
+			if (max==0) return 0;
+			auto res = get();
+			if (!res.second) return 0;
+			out.push_back(move(res.first));
+			return 1 + drain(out, max - 1);
+		};
+
+		/**
+		 * Get multiple values from the ringchan and wait until `deadline` for the first one
+		 *
+		 * Same behavior as get_batch(), but returns 0 if the deadline passed.
+		 * Use isclosed() to distinguish a timeout from a closed ringchan.
+		 */
+		template <typename Clock, typename Duration>
+		size_t get_batch_until(vector<T>& out, size_t max, const chrono::time_point<Clock, Duration>& deadline) {
+			if (max==0) return 0;
+			auto res = get_until(deadline);
+			if (!res.second) return 0;
+			out.push_back(move(res.first));
+			return 1 + drain(out, max - 1);
+		};
+
+		/**
+		 * Move up to `max` queued values to the end of `out` without blocking
+		 *
+		 * Returns the number of values moved, 0 if the ringchan is empty or closed.
+		 */
+		size_t drain(vector<T>& out, size_t max) {
+			if (isShut.load(memory_order_acquire)) return 0;
+			size_t count = 0;
+			T val;
+			while (count < max && tryDequeue(val)) {
+				out.push_back(move(val));
+				count++;
+			}
+			return count;
+		};
+
+		/**
+		 * Close the channel
+		 *
+		 * Closing the channel will wake up the reader and all writers that are waiting.
+		 * The reader will then return <T(), false> and writers return false to indicate the channel has closed.
+		 *
+		 * Values that are still queued are discarded, use shutdown() to deliver them.
+		 *
+		 * The channel is also closed if the object is destructed.
+		 *
+		 * This function waits until all waiting threads have left the ringchan.
+		 */
+		void close() {
+			if (isShut.exchange(true, memory_order_acq_rel)) return;
+			dataSignal.fetch_add(1, memory_order_release);
+			dataSignal.notify_all();
+			spaceSignal.fetch_add(1, memory_order_release);
+			spaceSignal.notify_all();
+			while (waitingThreadCount.load(memory_order_acquire) > 0) {
+				this_thread::yield();
+			}
+		};
+
+		/**
+		 * Close the channel for writers, the reader still receives the queued values (like closing a Go chan)
+		 *
+		 * Pushes return false after shutdown and writers waiting for space are woken up and return false.
+		 * The reader returns the queued values and <T(), false> once the ringchan is empty.
+		 * Pushes are lock-free, so a push racing with shutdown() may still return true and its value
+		 * may not be seen by the reader anymore, values pushed before shutdown() are always delivered.
+		 */
+		void shutdown() {
+			if (isWriteShut.exchange(true, memory_order_acq_rel)) return;
+			dataSignal.fetch_add(1, memory_order_release);
+			dataSignal.notify_all();
+			spaceSignal.fetch_add(1, memory_order_release);
+			spaceSignal.notify_all();
+		};
+
+		/**
+		 * Returns the state of the channel (true after close() or shutdown())
+		 */
+		bool isclosed() {
+			return isWriteClosed();
+		};
+
+		/**
+		 * Get size of the ringchan
+		 *
+		 * The value is only a snapshot, concurrent writers can change it at any time.
+		 */
+		int size() {
+			if (isShut.load(memory_order_acquire)) return 0;
+			size_t head = ringHead.load(memory_order_acquire);
+			size_t tail = ringTail.load(memory_order_acquire);
+			return tail > head ? (int)(tail - head) : 0;
+		};
+
+		/**
+		 * Get the capacity of the ringchan
+		 */
+		size_t capacity() const {
+			return ringCapacity;
+		};
+
+	private:
+		// Number of iterations a thread busy-waits before it is parked
+		static constexpr int SPIN_ITERATIONS = 128;
+		// Maximum sleep between two polls of a timed get
+		static constexpr chrono::microseconds MAX_BACKOFF = chrono::microseconds(500);
+
+		struct cell {
+			// Sequence number of the slot, determines if the slot is free or filled for the current lap
+			atomic<size_t> seq;
+			T val;
+		};
+
+		// Ring buffer with ringCapacity slots
+		unique_ptr<cell[]> ringBuffer;
+		size_t ringCapacity;
+		size_t ringMask;
+
+		// Next slot to read (only written by the reader)
+		alignas(CACHE_LINE_SIZE) atomic<size_t> ringHead = 0;
+		// Next slot to write (written by the writers)
+		alignas(CACHE_LINE_SIZE) atomic<size_t> ringTail = 0;
+
+		// Determines the state of the channel
+		alignas(CACHE_LINE_SIZE) atomic<bool> isShut = false;
+		// Channel is closed for writers, the reader drains the ring (see shutdown())
+		atomic<bool> isWriteShut = false;
+		// Count of threads in the slow path, close() waits until they have left
+		atomic<int> waitingThreadCount = 0;
+		// Signal that is bumped to wake the parked reader
+		atomic<uint32_t> dataSignal = 0;
+		// Count of parked readers
+		atomic<int> parkedReaderCount = 0;
+		// Signal that is bumped to wake parked writers
+		atomic<uint32_t> spaceSignal = 0;
+		// Count of parked writers
+		atomic<int> parkedWriterCount = 0;
+
+		/**
+		 * Returns true if pushes are rejected
+		 */
+		bool isWriteClosed() const {
+			return isShut.load(memory_order_acquire) || isWriteShut.load(memory_order_acquire);
+		};
+
+		/**
+		 * Get for a shut down ringchan, takes the last values a writer published before shutdown() was seen
+		 */
+		pair<T, bool> drainedGet() {
+			T val;
+			if (!isShut.load(memory_order_acquire) && tryDequeue(val)) return make_pair(move(val), true);
+			return make_pair(T(), false);
+		};
+
+		/**
+		 * Try to enqueue the value into the next free slot
+		 *
+		 * The value is only moved if the function returns true.
+		 */
+		bool tryEnqueue(T& val) {
+			size_t pos = ringTail.load(memory_order_relaxed);
+			cell* c;
+			while (true) {
+				c = &ringBuffer[pos & ringMask];
+				size_t seq = c->seq.load(memory_order_acquire);
+				intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+				if (diff == 0) {
+					if constexpr (Mode == SPSC) {
+						ringTail.store(pos + 1, memory_order_relaxed);
+						break;
+					} else if (ringTail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+						break;
+					}
+				} else if (diff < 0) {
+					// Slot is still occupied from the last lap, ring is full
+					return false;
+				} else {
+					pos = ringTail.load(memory_order_relaxed);
+				}
+			}
+			c->val = move(val);
+			c->seq.store(pos + 1, memory_order_release);
+			wake(dataSignal, parkedReaderCount);
+			return true;
+		};
+
+		/**
+		 * Try to dequeue the value from the head slot
+		 */
+		bool tryDequeue(T& val) {
+			size_t pos = ringHead.load(memory_order_relaxed);
+			cell* c = &ringBuffer[pos & ringMask];
+			size_t seq = c->seq.load(memory_order_acquire);
+			if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) {
+				// Slot is not filled yet, ring is empty
+				return false;
+			}
+			val = move(c->val);
+			// Release the slot for the next lap
+			c->seq.store(pos + ringCapacity, memory_order_release);
+			ringHead.store(pos + 1, memory_order_release);
+			wake(spaceSignal, parkedWriterCount);
+			return true;
+		};
+
+		/**
+		 * Wake all threads parked on the signal
+		 *
+		 * The notify syscall is only issued if there is a parked thread.
+		 */
+		void wake(atomic<uint32_t>& signal, atomic<int>& parkedCount) {
+			atomic_thread_fence(memory_order_seq_cst);
+			if (parkedCount.load(memory_order_relaxed) > 0) {
+				signal.fetch_add(1, memory_order_release);
+				signal.notify_all();
+			}
+		};
+
+		/**
+		 * Wait until ready() returns true
+		 *
+		 * Spins for SPIN_ITERATIONS and then parks the thread on the signal.
+		 */
+		template <typename Pred>
+		void await(atomic<uint32_t>& signal, atomic<int>& parkedCount, Pred ready) {
+			for (int i = 0; i < SPIN_ITERATIONS; i++) {
+				if (ready()) return;
+#if defined(__x86_64__) || defined(__i386__)
+				__builtin_ia32_pause();
+#endif
+			}
+			while (true) {
+				uint32_t sig = signal.load(memory_order_acquire);
+				parkedCount.fetch_add(1, memory_order_seq_cst);
+				atomic_thread_fence(memory_order_seq_cst);
+				// Check again after announcing the park, a wake issued before that would be lost otherwise
+				if (ready()) {
+					parkedCount.fetch_sub(1, memory_order_relaxed);
+					return;
+				}
+				signal.wait(sig, memory_order_acquire);
+				parkedCount.fetch_sub(1, memory_order_relaxed);
+			}
+		};
+	};
+
+	/**
+	 * Ringchan with exactly one writer and one reader
+	 */
+	template <typename T>
+	using spscchan = ringchan<T, SPSC>;
+
+	/**
+	 * Ringchan with multiple writers and one reader
+	 */
+	template <typename T>
+	using mpscchan = ringchan<T, MPSC>;
+}
+
+#endif
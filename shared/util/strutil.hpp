@@ -21,9 +21,15 @@
 #define STRUTIL_H
 
 #include <algorithm>
+#include <cstring>
+#include <iterator>
 #include <sstream>
 #include <vector>
 #include <string>
+#include <string_view>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -55,8 +61,11 @@ namespace util::strutil {
 	 * Unsplit will end the string with a delimiter (e.g. ["some", "stuff"] -> "some,stuff,")
 	 */
 	inline string unsplit(const vector<string>& tokens, const char& delimiter) {
+		size_t size = tokens.size();
+		for (const auto& tokBuf : tokens) size += tokBuf.size();
 		string str;
-		for (auto tokBuf : tokens) {
+		str.reserve(size);
+		for (const auto& tokBuf : tokens) {
 		  str+=tokBuf;
 			str+=delimiter;
 		}
@@ -77,6 +86,146 @@ namespace util::strutil {
 									 return tolower(a) == tolower(b);
 								 });
 	}
+
+	/**
+	 * Lazy range over the tokens of a string, see splitView()
+	 */
+	class splitrange {
+	public:
+		class iterator {
+		public:
+			using iterator_category = forward_iterator_tag;
+			using value_type = string_view;
+			using difference_type = ptrdiff_t;
+			using pointer = const string_view*;
+			using reference = const string_view&;
+
+			iterator() = default;
+			iterator(string_view rest, char delimiter) : rest(rest), delimiter(delimiter), atEnd(false) {
+				next();
+			}
+
+			reference operator*() const { return token; }
+			pointer operator->() const { return &token; }
+
+			iterator& operator++() {
+				next();
+				return *this;
+			}
+
+			iterator operator++(int) {
+				iterator it = *this;
+				next();
+				return it;
+			}
+
+			bool operator==(const iterator& other) const {
+				if (atEnd || other.atEnd) return atEnd == other.atEnd;
+				return token.data() == other.token.data();
+			}
+
+		private:
+			string_view rest;
+			string_view token;
+			char delimiter = ',';
+			bool atEnd = true;
+
+			void next() {
+				// Skip empty tokens
+				while (!rest.empty() && rest.front() == delimiter) rest.remove_prefix(1);
+				if (rest.empty()) {
+					atEnd = true;
+					return;
+				}
+				const void* found = memchr(rest.data(), delimiter, rest.size());
+				size_t len = found ? static_cast<const char*>(found) - rest.data() : rest.size();
+				token = rest.substr(0, len);
+				rest.remove_prefix(len);
+			}
+		};
+
+		splitrange(string_view str, char delimiter) : str(str), delimiter(delimiter) {}
+
+		iterator begin() const { return iterator(str, delimiter); }
+		iterator end() const { return iterator(); }
+
+	private:
+		string_view str;
+		char delimiter;
+	};
+
+	/**
+	 * Split a string lazily based on a delimiter, tokens are views into `str`
+	 *
+	 * Empty elements are omitted like in split(), nothing is allocated:
+	 *
+	 * ```
+	 * for (string_view token : splitView("some,stuff,,", ',')) { ... }
+	 * ```
+	 */
+	inline splitrange splitView(string_view str, char delimiter) {
+		return splitrange(str, delimiter);
+	}
+
+	/**
+	 * Join the tokens with a delimiter between them (e.g. ["some", "stuff"] -> "some,stuff")
+	 *
+	 * The capacity of the result is reserved up front.
+	 */
+	template <typename Range>
+	inline string join(const Range& tokens, string_view delimiter) {
+		size_t size = 0;
+		size_t count = 0;
+		for (const auto& token : tokens) {
+			size += string_view(token).size();
+			count++;
+		}
+		string str;
+		str.reserve(size + (count > 0 ? (count - 1) * delimiter.size() : 0));
+		bool first = true;
+		for (const auto& token : tokens) {
+			if (!first) str += delimiter;
+			str += string_view(token);
+			first = false;
+		}
+		return str;
+	}
+
+	/**
+	 * Compare two strings without case sensitivity, only ASCII letters are folded
+	 *
+	 * Unlike cmpIgnoreCase() this does not depend on the locale,
+	 * with SSE2 16 chars are compared at once.
+	 */
+	inline bool cmpIgnoreCaseAscii(string_view str1, string_view str2) {
+		if (str1.size() != str2.size()) return false;
+		const char* a = str1.data();
+		const char* b = str2.data();
+		size_t size = str1.size();
+		size_t i = 0;
+#ifdef __SSE2__
+		const __m128i upperMin = _mm_set1_epi8('A' - 1);
+		const __m128i upperMax = _mm_set1_epi8('Z' + 1);
+		const __m128i caseBit = _mm_set1_epi8(0x20);
+		auto lower = [&](__m128i v) {
+			// Chars >= 0x80 are negative in the signed compare and never folded
+			__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, upperMin), _mm_cmplt_epi8(v, upperMax));
+			return _mm_or_si128(v, _mm_and_si128(upper, caseBit));
+		};
+		for (; i + 16 <= size; i += 16) {
+			__m128i va = lower(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+			__m128i vb = lower(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) return false;
+		}
+#endif
+		for (; i < size; i++) {
+			char ca = a[i], cb = b[i];
+			if (ca >= 'A' && ca <= 'Z') ca |= 0x20;
+			if (cb >= 'A' && cb <= 'Z') cb |= 0x20;
+			if (ca != cb) return false;
+		}
+		return true;
+	}
 }
 
 #endif
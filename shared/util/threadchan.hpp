@@ -0,0 +1,434 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef THREADCHAN_H
+#define THREADCHAN_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ranges>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "shared/util/ringchan.hpp"
+
+using namespace std;
+
+namespace util {
+	/**
+	 * Threadchan is a multi-writer / single-reader channel without shared state on the write path
+	 *
+	 * Every writer thread gets its own spscchan on the first push, so writers never contend with each other.
+	 * The reader collects the values round-robin from all thread buffers, or merged by `Order`.
+	 *
+	 * Values of one writer thread are read in the order they were pushed.
+	 * Without `Order` there is no order between values of different threads.
+	 * With an `Order` comparator the reader peeks the head of every buffer and always takes the smallest one,
+	 * so values are read in global order if every thread pushes in that order.
+	 * A value pushed after a larger value was already read is still read after it.
+	 *
+	 * Buffers of exited threads are released after the reader consumed them.
+	 *
+	 * Close the channel with close() or call the destructor,
+	 * use shutdown() to let the reader receive the buffered values first.
+	 */
+	template <typename T, typename Order = void>
+	class threadchan {
+	public:
+		using value_type = T;
+
+		/**
+		 * Create a threadchan where every writer thread buffers at most `capacity` values
+		 */
+		explicit threadchan(size_t capacity)
+			: chanId(nextChanId.fetch_add(1, memory_order_relaxed)), bufferCapacity(capacity) {
+			if (capacity==0) {
+				throw invalid_argument("Threadchan requires a capacity greater than 0");
+			}
+		};
+
+		virtual ~threadchan() {
+			// If channel was not shut, shut it now. Note that this is more like a preventFootGun() function
+			// its recommended to close the channel in a controlled manner with close();
+			close();
+		};
+
+		threadchan(const threadchan&) = delete;
+		threadchan& operator=(const threadchan&) = delete;
+
+		/**
+		 * Push a value to the buffer of the calling thread
+		 *
+		 * If the buffer is full, this will suspend the thread until the reader makes space.
+		 *
+		 * Returns true if the value was added to the threadchan.
+		 * If the channel is already closed (or is closed while blocking), it will do nothing and return false.
+		 */
+		bool push(T val) {
+			if (isWriteClosed()) return false;
+			if (!localBuffer()->ring.push(move(val))) return false;
+			wakeReader();
+			return true;
+		};
+
+		/**
+		 * Push multiple values to the buffer of the calling thread
+		 *
+		 * Returns the number of values added to the threadchan.
+		 */
+		template <typename InputIt>
+		size_t push_bulk(InputIt first, InputIt last) {
+			if (isWriteClosed()) return 0;
+			size_t pushed = localBuffer()->ring.push_bulk(first, last);
+			if (pushed) wakeReader();
+			return pushed;
+		};
+
+		/**
+		 * Push all values of a range to the buffer of the calling thread
+		 *
+		 * Same behavior as push_bulk().
+		 */
+		template <ranges::input_range R>
+		size_t push_range(R&& range) {
+			return push_bulk(ranges::begin(range), ranges::end(range));
+		};
+
+		/**
+		 * Get next value from the threadchan
+		 *
+		 * Same behavior as chan::get(), only one thread is allowed to read at the same time.
+		 */
+		pair<T, bool> get() {
+			vector<T> out;
+			if (!get_batch(out, 1)) return make_pair(T(), false);
+			return make_pair(move(out.front()), true);
+		};
+
+		/**
+		 * Get next value from the threadchan without blocking
+		 *
+		 * If the threadchan is empty or closed, `value` is `T()` and `ok` is `false`.
+		 */
+		pair<T, bool> try_get() {
+			vector<T> out;
+			if (!drain(out, 1)) return make_pair(T(), false);
+			return make_pair(move(out.front()), true);
+		};
+
+		/**
+		 * Get multiple values from the threadchan
+		 *
+		 * If no value is in the threadchan, this will suspend the thread
+		 * and block execution until the next value is pushed.
+		 * Then up to `max` values are collected from the thread buffers and moved to the end of `out`.
+		 *
+		 * Returns the number of values moved, if the channel was closed it returns 0.
+		 */
+		size_t get_batch(vector<T>& out, size_t max) {
+			return waitBatch(out, max, (chrono::steady_clock::time_point*)nullptr);
+		};
+
+		/**
+		 * Get multiple values from the threadchan and wait until `deadline` for the first one
+		 *
+		 * Same behavior as get_batch(), but returns 0 if the deadline passed.
+		 * Use isclosed() to distinguish a timeout from a closed threadchan.
+		 */
+		template <typename Clock, typename Duration>
+		size_t get_batch_until(vector<T>& out, size_t max, const chrono::time_point<Clock, Duration>& deadline) {
+			return waitBatch(out, max, &deadline);
+		};
+
+		/**
+		 * Collect up to `max` buffered values and move them to the end of `out` without blocking
+		 *
+		 * Returns the number of values moved, 0 if the threadchan is empty or closed.
+		 */
+		size_t drain(vector<T>& out, size_t max) {
+			if (isShut.load(memory_order_acquire)) return 0;
+			return collect(out, max);
+		};
+
+		/**
+		 * Close the channel
+		 *
+		 * Wakes the reader and all writers blocked on a full buffer,
+		 * they return <T(), false> / false to indicate the channel has closed.
+		 * Values that are still buffered are discarded, use shutdown() to deliver them.
+		 *
+		 * This function waits until all waiting threads have left the threadchan.
+		 */
+		void close() {
+			{
+				unique_lock<mutex> lock(readerMutex);
+				if (isShut.exchange(true, memory_order_acq_rel)) return;
+				readerCond.notify_all();
+				shutCond.wait(lock, [this]{ return !readerWaiting; });
+			}
+			lock_guard<mutex> lock(registryMutex);
+			for (auto& buf : registry) {
+				buf->ring.close();
+			}
+		};
+
+		/**
+		 * Close the channel for writers, the reader still receives the buffered values (like closing a Go chan)
+		 *
+		 * Pushes return false after shutdown, writers blocked on a full buffer return false.
+		 * The reader collects the buffered values and returns <T(), false> / 0 once all buffers are empty.
+		 * Like with ringchan::shutdown(), a push racing with shutdown() may be lost.
+		 */
+		void shutdown() {
+			{
+				lock_guard<mutex> lock(readerMutex);
+				if (isWriteShut.exchange(true, memory_order_acq_rel)) return;
+				readerCond.notify_all();
+			}
+			lock_guard<mutex> lock(registryMutex);
+			for (auto& buf : registry) {
+				buf->ring.shutdown();
+			}
+		};
+
+		/**
+		 * Returns the state of the channel (true after close() or shutdown())
+		 */
+		bool isclosed() {
+			return isWriteClosed();
+		};
+
+		/**
+		 * Get number of values in all thread buffers
+		 *
+		 * Important: This operation is not constant, it locks the buffer registry and visits every buffer.
+		 */
+		int size() {
+			if (isShut.load(memory_order_acquire)) return 0;
+			lock_guard<mutex> lock(registryMutex);
+			int count = 0;
+			for (auto& buf : registry) {
+				count += buf->ring.size();
+			}
+			return count;
+		};
+
+		/**
+		 * Get the capacity of a single thread buffer
+		 */
+		size_t capacity() const {
+			return bufferCapacity;
+		};
+
+	private:
+		struct threadbuffer {
+			spscchan<T> ring;
+			// Set if the writer thread exited, the buffer is released once it is empty
+			atomic<bool> abandoned = false;
+
+			explicit threadbuffer(size_t capacity) : ring(capacity) {};
+		};
+
+		/**
+		 * Reference of a thread to its buffer in a threadchan
+		 *
+		 * Marks the buffer as abandoned when the thread exits.
+		 */
+		struct localref {
+			uint64_t chanId;
+			shared_ptr<threadbuffer> buf;
+
+			localref(uint64_t id, shared_ptr<threadbuffer> buf) : chanId(id), buf(move(buf)) {};
+			localref(localref&&) = default;
+			localref& operator=(localref&&) = default;
+			~localref() {
+				if (buf) buf->abandoned.store(true, memory_order_release);
+			};
+		};
+
+		// Ids identify the threadchan in the thread local references (addresses may be reused)
+		static inline atomic<uint64_t> nextChanId = 1;
+		static inline thread_local vector<localref> localRefs;
+
+		uint64_t chanId;
+		size_t bufferCapacity;
+		atomic<bool> isShut = false;
+		// Channel is closed for writers, the reader drains the buffers (see shutdown())
+		atomic<bool> isWriteShut = false;
+
+		// Buffers of all writer threads
+		mutex registryMutex;
+		vector<shared_ptr<threadbuffer>> registry;
+		// Incremented whenever the registry changes
+		atomic<uint64_t> registryVersion = 0;
+
+		// Reader state, only accessed by the reading thread
+		vector<shared_ptr<threadbuffer>> readerBuffers;
+		uint64_t readerVersion = 0;
+		size_t readerRotation = 0;
+
+		// Synchronisation for parking the reader
+		alignas(CACHE_LINE_SIZE) atomic<bool> readerParked = false;
+		mutex readerMutex;
+		condition_variable readerCond;
+		bool readerWaiting = false;
+		condition_variable shutCond;
+
+		/**
+		 * Get the buffer of the calling thread, it is created on the first call
+		 */
+		threadbuffer* localBuffer() {
+			for (auto it = localRefs.begin(); it != localRefs.end(); it++) {
+				if (it->chanId == chanId) return it->buf.get();
+			}
+			// Drop references to closed threadchans before adding a new one
+			erase_if(localRefs, [](const localref& ref) { return ref.buf->ring.isclosed(); });
+
+			auto buf = make_shared<threadbuffer>(bufferCapacity);
+			{
+				lock_guard<mutex> lock(registryMutex);
+				// close() / shutdown() may have visited the registry already
+				if (isShut.load(memory_order_acquire)) buf->ring.close();
+				else if (isWriteShut.load(memory_order_acquire)) buf->ring.shutdown();
+				registry.push_back(buf);
+				registryVersion.fetch_add(1, memory_order_release);
+			}
+			localRefs.emplace_back(chanId, buf);
+			return buf.get();
+		};
+
+		/**
+		 * Returns true if pushes are rejected
+		 */
+		bool isWriteClosed() const {
+			return isShut.load(memory_order_acquire) || isWriteShut.load(memory_order_acquire);
+		};
+
+		/**
+		 * Wake the reader if it is parked
+		 */
+		void wakeReader() {
+			atomic_thread_fence(memory_order_seq_cst);
+			if (readerParked.load(memory_order_relaxed)) {
+				lock_guard<mutex> lock(readerMutex);
+				readerCond.notify_one();
+			}
+		};
+
+		/**
+		 * Update the reader buffer list if the registry changed
+		 *
+		 * Abandoned buffers that are empty are removed from the registry.
+		 */
+		void refreshBuffers() {
+			bool prune = false;
+			for (auto& buf : readerBuffers) {
+				if (buf->abandoned.load(memory_order_acquire) && buf->ring.size()==0) {
+					prune = true;
+					break;
+				}
+			}
+			if (!prune && readerVersion == registryVersion.load(memory_order_acquire)) return;
+
+			lock_guard<mutex> lock(registryMutex);
+			erase_if(registry, [](const shared_ptr<threadbuffer>& buf) {
+				return buf->abandoned.load(memory_order_acquire) && buf->ring.size()==0;
+			});
+			registryVersion.fetch_add(1, memory_order_release);
+			readerBuffers = registry;
+			readerVersion = registryVersion.load(memory_order_acquire);
+		};
+
+		/**
+		 * Collect up to `max` values from the thread buffers, round-robin or merged by `Order`
+		 */
+		size_t collect(vector<T>& out, size_t max) {
+			refreshBuffers();
+			size_t count = 0;
+			size_t bufCount = readerBuffers.size();
+			if constexpr (!is_void_v<Order>) {
+				if (bufCount > 1) {
+					while (count < max) {
+						threadbuffer* next = nullptr;
+						const T* nextHead = nullptr;
+						for (auto& buf : readerBuffers) {
+							const T* head = buf->ring.peek();
+							if (head && (!nextHead || Order()(*head, *nextHead))) {
+								next = buf.get();
+								nextHead = head;
+							}
+						}
+						if (!next) break;
+						count += next->ring.drain(out, 1);
+					}
+					return count;
+				}
+			}
+			for (size_t i = 0; i < bufCount && count < max; i++) {
+				count += readerBuffers[(readerRotation + i) % bufCount]->ring.drain(out, max - count);
+			}
+			readerRotation++;
+			return count;
+		};
+
+		/**
+		 * Collect values and park the reader until a value arrives, the deadline passed or the channel is closed
+		 */
+		template <typename TimePoint>
+		size_t waitBatch(vector<T>& out, size_t max, const TimePoint* deadline) {
+			if (max==0 || isShut.load(memory_order_acquire)) return 0;
+			// Loaded before collecting, so values pushed before shutdown() are seen
+			bool drained = isWriteShut.load(memory_order_acquire);
+			size_t count = collect(out, max);
+			if (count || drained) return count;
+
+			unique_lock<mutex> lock(readerMutex);
+			readerWaiting = true;
+			while (true) {
+				readerParked.store(true, memory_order_relaxed);
+				atomic_thread_fence(memory_order_seq_cst);
+				// Check again after announcing the park, a push before that would not wake the reader
+				if (isShut.load(memory_order_acquire)) break;
+				drained = isWriteShut.load(memory_order_acquire);
+				count = collect(out, max);
+				if (count || drained) break;
+				if (deadline) {
+					if (readerCond.wait_until(lock, *deadline) == cv_status::timeout) break;
+				} else {
+					readerCond.wait(lock);
+				}
+			}
+			readerParked.store(false, memory_order_relaxed);
+			readerWaiting = false;
+			if (isShut.load(memory_order_acquire)) {
+				shutCond.notify_one();
+				return 0;
+			}
+			return count;
+		};
+	};
+}
+
+#endif
@@ -0,0 +1,269 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+/**
+ * Lightweight tracing of scoped operations
+ *
+ * Spans record their start and end timestamp (TSC on x86) into a ring buffer of the calling thread,
+ * recording only happens between start() and stop(), otherwise a span costs one relaxed atomic load.
+ * dump() writes the recorded spans as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+ *
+ * Compile with -DCTHULHU_TRACE_DISABLED to remove all spans at compile time.
+ *
+ * ```
+ * void handle() {
+ *   TRACE_SPAN("metahook.update");
+ *   ...
+ * }
+ * ```
+ */
+namespace util::trace {
+
+	// Spans kept per thread, older spans are overwritten
+	inline constexpr size_t TRACE_BUFFER_EVENTS = 8192;
+
+	/**
+	 * Current timestamp in ticks (TSC on x86, steady clock nanoseconds otherwise)
+	 */
+	inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	/**
+	 * Recorded span, guarded by a sequence number (seqlock) so dump() never reads a torn span
+	 */
+	struct traceevent {
+		// Index of the span in the buffer + 1, 0 while the span is written
+		atomic<uint64_t> seq = 0;
+		atomic<const char*> name = nullptr;
+		atomic<uint64_t> start = 0;
+		atomic<uint64_t> end = 0;
+	};
+
+	/**
+	 * Ring buffer of the spans of one thread, only the owning thread writes to it
+	 */
+	struct tracebuffer {
+		uint64_t tid;
+		atomic<uint64_t> head = 0;
+		unique_ptr<traceevent[]> events;
+
+		tracebuffer() : tid(syscall(SYS_gettid)), events(make_unique<traceevent[]>(TRACE_BUFFER_EVENTS)) {}
+
+		void record(const char* name, uint64_t start, uint64_t end) {
+			uint64_t index = head.load(memory_order_relaxed);
+			traceevent& event = events[index % TRACE_BUFFER_EVENTS];
+			event.seq.store(0, memory_order_relaxed);
+			atomic_thread_fence(memory_order_release);
+			event.name.store(name, memory_order_relaxed);
+			event.start.store(start, memory_order_relaxed);
+			event.end.store(end, memory_order_relaxed);
+			event.seq.store(index + 1, memory_order_release);
+			head.store(index + 1, memory_order_release);
+		}
+	};
+
+	/**
+	 * Shared state of the tracer
+	 */
+	struct tracestate {
+		mutex lock;
+		// Buffers of all threads that recorded spans, buffers of exited threads are dropped after the next dump
+		vector<shared_ptr<tracebuffer>> buffers;
+		// Reference point for the conversion of ticks to time, taken when recording is started the first time
+		uint64_t baseTicks = 0;
+		int64_t baseNs = 0;
+	};
+
+	// Checked by every span
+	inline atomic<bool> recording = false;
+
+	inline tracestate& state() {
+		// Never destroyed, threads may still record while the process exits
+		static tracestate* s = new tracestate();
+		return *s;
+	}
+
+	inline int64_t steadyNs() {
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	/**
+	 * Get the buffer of the calling thread, it is registered on the first use
+	 */
+	inline tracebuffer* localbuffer() {
+		static thread_local shared_ptr<tracebuffer> buffer;
+		if (!buffer) {
+			buffer = make_shared<tracebuffer>();
+			tracestate& s = state();
+			lock_guard<mutex> lock(s.lock);
+			s.buffers.push_back(buffer);
+		}
+		return buffer.get();
+	}
+
+	/**
+	 * Start recording spans
+	 */
+	inline void start() {
+		tracestate& s = state();
+		{
+			lock_guard<mutex> lock(s.lock);
+			if (s.baseTicks == 0) {
+				s.baseTicks = ticks();
+				s.baseNs = steadyNs();
+			}
+		}
+		recording.store(true, memory_order_relaxed);
+	}
+
+	/**
+	 * Stop recording spans, recorded spans are kept until they are overwritten
+	 */
+	inline void stop() {
+		recording.store(false, memory_order_relaxed);
+	}
+
+	inline bool isrecording() {
+		return recording.load(memory_order_relaxed);
+	}
+
+	/**
+	 * Append the recorded spans to `out` as Chrome trace JSON
+	 *
+	 * Spans can be dumped while recording, spans overwritten during the dump are skipped.
+	 * Ticks are converted with the rate measured between the first start() and the dump (requires a invariant TSC).
+	 */
+	inline void dump(string& out) {
+		tracestate& s = state();
+		lock_guard<mutex> lock(s.lock);
+		uint64_t nowTicks = ticks();
+		int64_t nowNs = steadyNs();
+		double nsPerTick = nowTicks > s.baseTicks && nowNs > s.baseNs
+			? (double)(nowNs - s.baseNs) / (double)(nowTicks - s.baseTicks) : 1.0;
+		long pid = getpid();
+
+		out += "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+		bool first = true;
+		for (const auto& buffer : s.buffers) {
+			uint64_t head = buffer->head.load(memory_order_acquire);
+			uint64_t begin = head > TRACE_BUFFER_EVENTS ? head - TRACE_BUFFER_EVENTS : 0;
+			for (uint64_t index = begin; index < head; index++) {
+				traceevent& event = buffer->events[index % TRACE_BUFFER_EVENTS];
+				uint64_t seq = event.seq.load(memory_order_acquire);
+				const char* name = event.name.load(memory_order_relaxed);
+				uint64_t start = event.start.load(memory_order_relaxed);
+				uint64_t end = event.end.load(memory_order_relaxed);
+				atomic_thread_fence(memory_order_acquire);
+				// Overwritten or written concurrently
+				if (seq != index + 1 || event.seq.load(memory_order_relaxed) != seq || !name) continue;
+
+				string_view spanName(name);
+				// The category is the prefix of the name (e.g. "chan" of "chan.push.wait")
+				string_view category = spanName.substr(0, spanName.find('.'));
+				// Signed, the TSC of another core may be slightly behind the base
+				double ts = ((double)s.baseNs + (double)(int64_t)(start - s.baseTicks) * nsPerTick) / 1000.0;
+				double dur = (double)(end - start) * nsPerTick / 1000.0;
+				if (!first) out += ',';
+				first = false;
+				out += "{\"name\":\"";
+				out += spanName;
+				out += "\",\"cat\":\"";
+				out += category;
+				out += "\",\"ph\":\"X\",\"pid\":";
+				out += to_string(pid);
+				out += ",\"tid\":";
+				out += to_string(buffer->tid);
+				out += ",\"ts\":";
+				out += to_string(ts);
+				out += ",\"dur\":";
+				out += to_string(dur);
+				out += '}';
+			}
+		}
+		out += "]}";
+		// Buffers only referenced here belong to exited threads
+		erase_if(s.buffers, [](const shared_ptr<tracebuffer>& buffer) { return buffer.use_count() == 1; });
+	}
+
+#ifndef CTHULHU_TRACE_DISABLED
+	/**
+	 * Records the lifetime of the scope as span
+	 *
+	 * The name must be a string literal (it is stored as pointer), use "<category>.<operation>".
+	 */
+	class span {
+	public:
+		explicit span(const char* name)
+			: name(name), startTicks(recording.load(memory_order_relaxed) ? ticks() : 0) {}
+
+		~span() {
+			if (startTicks) localbuffer()->record(name, startTicks, ticks());
+		}
+
+		span(const span&) = delete;
+		span& operator=(const span&) = delete;
+
+	private:
+		const char* name;
+		uint64_t startTicks;
+	};
+#else
+	class span {
+	public:
+		explicit span(const char*) {}
+	};
+#endif
+}
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+
+#ifndef CTHULHU_TRACE_DISABLED
+// Trace the enclosing scope as span with the (string literal) name
+#define TRACE_SPAN(name) util::trace::span TRACE_CONCAT(traceSpan, __LINE__)(name)
+#else
+#define TRACE_SPAN(name) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,330 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "shared/util/trace.hpp"
+#include "shared/util/wsdeque.hpp"
+
+using namespace std;
+
+namespace util {
+	using worktask = move_only_function<void()>;
+
+	/**
+	 * CPU a worker is placed on
+	 */
+	struct workercpu {
+		int cpu = -1;
+		int node = 0;
+	};
+
+	/**
+	 * Parse a sysfs cpulist (e.g. "0-3,8-11")
+	 */
+	inline vector<int> parsecpulist(const string& list) {
+		vector<int> cpus;
+		size_t pos = 0;
+		while (pos < list.size()) {
+			size_t end = list.find(',', pos);
+			if (end == string::npos) end = list.size();
+			string range = list.substr(pos, end - pos);
+			size_t dash = range.find('-');
+			try {
+				int first = stoi(range.substr(0, dash));
+				int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+				for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+			} catch (...) {}
+			pos = end + 1;
+		}
+		return cpus;
+	}
+
+	/**
+	 * Get the CPUs the process may run on, interleaved over the NUMA nodes
+	 *
+	 * The nodes are read from /sys/devices/system/node, without NUMA information all CPUs are on node 0.
+	 * Placing worker i on cpu i of the result spreads the workers evenly over the nodes.
+	 */
+	inline vector<workercpu> cpuplacement() {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) != 0) return {};
+
+		vector<int> nodeOf(CPU_SETSIZE, 0);
+		error_code ec;
+		for (const auto& entry : filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+			string name = entry.path().filename().string();
+			if (!name.starts_with("node")) continue;
+			int node;
+			try {
+				node = stoi(name.substr(4));
+			} catch (...) {
+				continue;
+			}
+			ifstream file(entry.path() / "cpulist");
+			string list;
+			getline(file, list);
+			for (int cpu : parsecpulist(list)) {
+				if (cpu >= 0 && cpu < CPU_SETSIZE) nodeOf[cpu] = node;
+			}
+		}
+
+		vector<vector<int>> nodes;
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &set)) continue;
+			size_t node = nodeOf[cpu];
+			if (nodes.size() <= node) nodes.resize(node + 1);
+			nodes[node].push_back(cpu);
+		}
+		vector<workercpu> placement;
+		for (size_t i = 0; ; i++) {
+			bool added = false;
+			for (size_t node = 0; node < nodes.size(); node++) {
+				if (i >= nodes[node].size()) continue;
+				placement.push_back({nodes[node][i], (int)node});
+				added = true;
+			}
+			if (!added) break;
+		}
+		return placement;
+	}
+
+	/**
+	 * Work-stealing thread pool
+	 *
+	 * Every worker owns a wsdeque, tasks posted by a worker are pushed to its own deque (no shared queue).
+	 * Tasks posted by other threads are distributed round robin over small per-worker inboxes.
+	 * Idle workers steal from the other workers, workers on the same NUMA node are tried first.
+	 * Workers without work park on a futex (atomic wait) and are woken by the next post.
+	 *
+	 * With `pin`, every worker is pinned to one CPU (see cpuplacement()).
+	 *
+	 * Tasks must not throw, a exception escaping a task terminates the process (like in a std::thread).
+	 * close() (or the destructor) runs all posted tasks and joins the workers.
+	 */
+	class workpool {
+	public:
+		explicit workpool(size_t workers = thread::hardware_concurrency(), bool pin = false) {
+			if (workers == 0) workers = 1;
+			vector<workercpu> placement = pin ? cpuplacement() : vector<workercpu>();
+			for (size_t i = 0; i < workers; i++) {
+				auto w = make_unique<worker>();
+				if (!placement.empty()) w->placement = placement[i % placement.size()];
+				workerList.push_back(move(w));
+			}
+			// Victims on the same node first, each worker starts at its neighbor so thieves spread out
+			for (size_t i = 0; i < workers; i++) {
+				auto& victims = workerList[i]->victims;
+				for (size_t n = 1; n < workers; n++) {
+					size_t v = (i + n) % workers;
+					victims.push_back(v);
+				}
+				stable_partition(victims.begin(), victims.end(), [&](size_t v) {
+					return workerList[v]->placement.node == workerList[i]->placement.node;
+				});
+			}
+			for (size_t i = 0; i < workers; i++) {
+				workerList[i]->thread = std::thread([this, i]() { runWorker(i); });
+			}
+		}
+
+		virtual ~workpool() {
+			close();
+		}
+
+		workpool(const workpool&) = delete;
+		workpool& operator=(const workpool&) = delete;
+
+		/**
+		 * Post a task to the pool
+		 *
+		 * Returns false if the pool is closed, the task is not run then.
+		 */
+		bool post(worktask task) {
+			pending.fetch_add(1, memory_order_seq_cst);
+			if (closing.load(memory_order_seq_cst)) {
+				pending.fetch_sub(1, memory_order_relaxed);
+				return false;
+			}
+			auto* t = new worktask(move(task));
+			if (currentPool == this) {
+				workerList[currentIndex]->tasks.push(t);
+			} else {
+				worker& w = *workerList[nextInbox.fetch_add(1, memory_order_relaxed) % workerList.size()];
+				lock_guard<mutex> lock(w.inboxLock);
+				w.inbox.push_back(t);
+			}
+			atomic_thread_fence(memory_order_seq_cst);
+			if (sleeping.load(memory_order_seq_cst) > 0) {
+				signal.fetch_add(1, memory_order_release);
+				signal.notify_one();
+			}
+			return true;
+		}
+
+		/**
+		 * Close the pool, waits until all posted tasks ran and the workers exited
+		 *
+		 * Must not be called from a task of the pool.
+		 */
+		void close() {
+			closing.store(true, memory_order_seq_cst);
+			signal.fetch_add(1, memory_order_release);
+			signal.notify_all();
+			lock_guard<mutex> lock(closeLock);
+			for (auto& w : workerList) {
+				if (w->thread.joinable()) w->thread.join();
+			}
+		}
+
+		/**
+		 * Number of workers
+		 */
+		size_t size() const {
+			return workerList.size();
+		}
+
+		/**
+		 * Returns true if the calling thread is a worker of this pool
+		 */
+		bool isworker() const {
+			return currentPool == this;
+		}
+
+		/**
+		 * Get the CPU the worker is pinned to (cpu is -1 if the pool is not pinned)
+		 */
+		workercpu placement(size_t index) const {
+			return workerList[index]->placement;
+		}
+
+	private:
+		struct worker {
+			wsdeque<worktask*> tasks;
+			mutex inboxLock;
+			deque<worktask*> inbox;
+			workercpu placement;
+			// Workers to steal from, in order of preference
+			vector<size_t> victims;
+			std::thread thread;
+		};
+
+		static inline thread_local workpool* currentPool = nullptr;
+		static inline thread_local size_t currentIndex = 0;
+
+		vector<unique_ptr<worker>> workerList;
+		// Posted tasks that were not taken by a worker yet
+		atomic<int64_t> pending = 0;
+		atomic<bool> closing = false;
+		// Parked workers wait for a change of the signal
+		atomic<uint32_t> signal = 0;
+		atomic<int> sleeping = 0;
+		atomic<size_t> nextInbox = 0;
+		mutex closeLock;
+
+		void runWorker(size_t index) {
+			currentPool = this;
+			currentIndex = index;
+			worker& self = *workerList[index];
+			if (self.placement.cpu >= 0) {
+				cpu_set_t set;
+				CPU_ZERO(&set);
+				CPU_SET(self.placement.cpu, &set);
+				pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			}
+			while (true) {
+				worktask* task = find(self);
+				if (task) {
+					pending.fetch_sub(1, memory_order_relaxed);
+					(*task)();
+					delete task;
+					continue;
+				}
+				if (closing.load(memory_order_seq_cst) && pending.load(memory_order_seq_cst) == 0) return;
+				park();
+			}
+		}
+
+		/**
+		 * Find the next task: own deque, own inbox, then the deques and inboxes of the victims
+		 */
+		worktask* find(worker& self) {
+			if (worktask* task = self.tasks.pop()) return task;
+			{
+				lock_guard<mutex> lock(self.inboxLock);
+				if (!self.inbox.empty()) {
+					worktask* task = self.inbox.front();
+					self.inbox.pop_front();
+					// The rest of the inbox is moved to the deque, so other workers can steal it
+					for (worktask* t : self.inbox) self.tasks.push(t);
+					self.inbox.clear();
+					return task;
+				}
+			}
+			TRACE_SPAN("workpool.steal");
+			for (size_t v : self.victims) {
+				if (worktask* task = workerList[v]->tasks.steal()) return task;
+			}
+			for (size_t v : self.victims) {
+				worker& victim = *workerList[v];
+				unique_lock<mutex> lock(victim.inboxLock, try_to_lock);
+				if (!lock.owns_lock() || victim.inbox.empty()) continue;
+				worktask* task = victim.inbox.front();
+				victim.inbox.pop_front();
+				return task;
+			}
+			return nullptr;
+		}
+
+		/**
+		 * Wait until a task is posted or the pool is closed
+		 */
+		void park() {
+			uint32_t sig = signal.load(memory_order_acquire);
+			sleeping.fetch_add(1, memory_order_seq_cst);
+			// Check again after announcing the park, a post issued before that would not wake this worker
+			if (pending.load(memory_order_seq_cst) > 0 || closing.load(memory_order_seq_cst)) {
+				sleeping.fetch_sub(1, memory_order_relaxed);
+				return;
+			}
+			signal.wait(sig, memory_order_acquire);
+			sleeping.fetch_sub(1, memory_order_relaxed);
+		}
+	};
+}
+
+#endif
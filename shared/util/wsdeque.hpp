@@ -0,0 +1,151 @@
+/**
+ * Cthulhu System
+ *
+ * Copyright (C) 2024  Linus Ilian Moser <linus.moser@megakuul.ch>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef WSDEQUE_H
+#define WSDEQUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+namespace util {
+	/**
+	 * Lock-free work-stealing deque (Chase-Lev)
+	 *
+	 * The owner thread pushes and pops at the bottom (LIFO), any other thread steals from the top (FIFO).
+	 * The deque stores trivially copyable values (e.g. pointers to tasks), T() marks a empty result.
+	 *
+	 * Implements the C11 version of "Correct and Efficient Work-Stealing for Weak Memory Models" (Lê et al.).
+	 * The ring grows when it is full, old rings are kept until the deque is destroyed
+	 * because a concurrent thief may still read from them.
+	 */
+	template <typename T>
+	class wsdeque {
+	public:
+		explicit wsdeque(size_t capacity = 256) {
+			size_t size = 1;
+			while (size < capacity) size <<= 1;
+			rings.push_back(make_unique<ring>(size));
+			current.store(rings.back().get(), memory_order_relaxed);
+		}
+
+		wsdeque(const wsdeque&) = delete;
+		wsdeque& operator=(const wsdeque&) = delete;
+
+		/**
+		 * Push a value to the bottom (owner only)
+		 */
+		void push(T value) {
+			int64_t b = bottom.load(memory_order_relaxed);
+			int64_t t = top.load(memory_order_acquire);
+			ring* r = current.load(memory_order_relaxed);
+			if (b - t > (int64_t)r->capacity - 1) {
+				r = grow(r, t, b);
+			}
+			r->put(b, value);
+			atomic_thread_fence(memory_order_release);
+			bottom.store(b + 1, memory_order_relaxed);
+		}
+
+		/**
+		 * Pop a value from the bottom (owner only), returns T() if the deque is empty
+		 */
+		T pop() {
+			int64_t b = bottom.load(memory_order_relaxed) - 1;
+			ring* r = current.load(memory_order_relaxed);
+			bottom.store(b, memory_order_relaxed);
+			atomic_thread_fence(memory_order_seq_cst);
+			int64_t t = top.load(memory_order_relaxed);
+			if (t > b) {
+				// Empty
+				bottom.store(b + 1, memory_order_relaxed);
+				return T();
+			}
+			T value = r->get(b);
+			if (t == b) {
+				// Last value, races with the thieves
+				if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+					value = T();
+				}
+				bottom.store(b + 1, memory_order_relaxed);
+			}
+			return value;
+		}
+
+		/**
+		 * Steal a value from the top (any thread), returns T() if the deque is empty or the steal lost a race
+		 */
+		T steal() {
+			int64_t t = top.load(memory_order_acquire);
+			atomic_thread_fence(memory_order_seq_cst);
+			int64_t b = bottom.load(memory_order_acquire);
+			if (t >= b) return T();
+			ring* r = current.load(memory_order_acquire);
+			T value = r->get(t);
+			if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+				return T();
+			}
+			return value;
+		}
+
+		/**
+		 * Returns true if the deque looks empty (the result may be outdated immediately)
+		 */
+		bool empty() const {
+			return bottom.load(memory_order_relaxed) <= top.load(memory_order_relaxed);
+		}
+
+	private:
+		struct ring {
+			size_t capacity;
+			unique_ptr<atomic<T>[]> items;
+
+			explicit ring(size_t capacity) : capacity(capacity), items(make_unique<atomic<T>[]>(capacity)) {}
+
+			T get(int64_t index) const {
+				return items[index & (capacity - 1)].load(memory_order_relaxed);
+			}
+
+			void put(int64_t index, T value) {
+				items[index & (capacity - 1)].store(value, memory_order_relaxed);
+			}
+		};
+
+		alignas(64) atomic<int64_t> top = 0;
+		alignas(64) atomic<int64_t> bottom = 0;
+		atomic<ring*> current;
+		// All rings ever used (owner only), thieves may still read from old rings
+		vector<unique_ptr<ring>> rings;
+
+		ring* grow(ring* old, int64_t t, int64_t b) {
+			auto next = make_unique<ring>(old->capacity * 2);
+			for (int64_t i = t; i < b; i++) next->put(i, old->get(i));
+			ring* r = next.get();
+			rings.push_back(move(next));
+			current.store(r, memory_order_release);
+			return r;
+		}
+	};
+}
+
+#endif